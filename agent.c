@@ -0,0 +1,183 @@
+/*
+ * spor/agent.c
+ * key agent protocol: requests to a process holding an unlocked key
+ *
+ * the agent pays for the KDF once and keeps the private key in
+ * locked memory; clients send it a hash to sign or an encrypted
+ * message key to unwrap, so a job costs one ECC operation.  the key
+ * itself never leaves the agent.
+ */
+
+#define _GNU_SOURCE          /* struct ucred */
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "bufio.h"
+#include "spor.h"
+#include "util.h"
+
+static void set_path(struct sockaddr_un *sa, const char *path) {
+  if ( ! path || ! *path ) DIE("no agent socket");
+  if ( strlen(path) >= sizeof(sa->sun_path) ) DIE("agent socket path too long");
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  strcpy(sa->sun_path, path);
+}
+
+static void send_msg(const int fd, const unsigned char code,
+                     const unsigned char *buf, const unsigned sz) {
+  unsigned char hdr[3];
+  if ( sz > BUFSZ ) DIE("agent message too long");
+  hdr[0] = code;
+  hdr[1] = sz >> 8;
+  hdr[2] = sz;
+  write_full_or_die(fd, hdr, sizeof(hdr), "writing to agent");
+  write_full_or_die(fd, buf, sz, "writing to agent");
+}
+
+static int recv_msg(const int fd, unsigned char *code,
+                    unsigned char *buf, unsigned *szp) {
+  /* returns 0 on a clean close before the header */
+  unsigned char hdr[3];
+  size_t len;
+
+  if ( ! (len=read_full_or_die(fd, hdr, sizeof(hdr), "reading from agent")) ) return 0;
+  if ( len < sizeof(hdr) ) DIE("short agent message");
+  *code = hdr[0];
+  *szp = hdr[1] << 8 | hdr[2];
+  if ( *szp > BUFSZ ) DIE("agent message too long");
+  if ( read_full_or_die(fd, buf, *szp, "reading from agent") < *szp ) DIE("short agent message");
+  return 1;
+}
+
+
+/**
+ ** Client
+ **/
+
+int agent_connect(const char *path) {
+  struct sockaddr_un sa;
+  int fd;
+
+  set_path(&sa, path);
+  if ( (fd=socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) DIES("creating agent socket");
+  if ( connect(fd, (struct sockaddr *)&sa, sizeof(sa)) ) DIES2("connecting to agent", path);
+  return fd;
+}
+
+void agent_call(const int fd, const unsigned char op,
+                const unsigned char *in, const unsigned insz,
+                unsigned char *out, unsigned long *outszp) {
+  unsigned char status, buf[BUFSZ];
+  unsigned sz;
+
+  send_msg(fd, op, in, insz);
+  if ( ! recv_msg(fd, &status, buf, &sz) ) DIEC("agent closed connection on request", op);
+  if ( status ) DIEC("agent refused request", op);
+  if ( sz > *outszp ) DIE("agent reply too long");
+  memcpy(out, buf, sz);
+  *outszp = sz;
+  zeromem(buf, sizeof(buf));
+}
+
+
+/**
+ ** Server
+ **/
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+static void serve_conn(const int fd, struct asymkey *akeyp) {
+  /* a failed operation kills this process, not the agent */
+  unsigned char op, in[BUFSZ], out[BUFSZ];
+  unsigned insz;
+  unsigned long outsz;
+
+  while ( recv_msg(fd, &op, in, &insz) ) {
+    outsz = sizeof(out);
+    switch ( op ) {
+    case AGENT_SIGN:
+      s0_asym_sign(akeyp, in, insz, out, &outsz);
+      break;
+    case AGENT_UNWRAP:
+      outsz = KEYSZ_SYM;
+      s0_asym_decrypt_key(akeyp, out, outsz, in, insz);
+      break;
+    case AGENT_PUBKEY:
+      out[0] = s0_asym_type(akeyp);
+      outsz--;
+      s0_asym_export(out+1, &outsz, 0, akeyp);
+      outsz++;
+      break;
+    default:
+      send_msg(fd, 1, NULL, 0);
+      continue;
+    }
+    send_msg(fd, 0, out, outsz);
+    zeromem(out, sizeof(out));
+  }
+  zeromem(in, sizeof(in));
+}
+
+static int same_user(const int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if ( getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ) return 0;
+  return cred.uid == getuid();
+}
+
+void agent_serve(const char *path, struct asymkey *akeyp) {
+  /* one forked child per connection, until SIGINT or SIGTERM */
+  struct sockaddr_un sa;
+  struct sigaction act;
+  mode_t mask;
+  int lfd, fd;
+
+  set_path(&sa, path);
+  if ( (lfd=socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) DIES("creating agent socket");
+  mask = umask(077);
+  if ( bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) ) DIES2("binding", path);
+  umask(mask);
+  if ( listen(lfd, 64) ) DIES("listening");
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = stop;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  signal(SIGCHLD, SIG_IGN);
+
+  while ( ! stopping ) {
+    if ( (fd=accept(lfd, NULL, NULL)) < 0 ) {
+      if ( errno == EINTR || errno == ECONNABORTED ) continue;
+      DIES("accepting");
+    }
+    if ( ! same_user(fd) ) {
+      close(fd);
+      continue;
+    }
+    switch ( fork() ) {
+    case -1:
+      DIES("forking");
+    case 0:
+      /* a PRNG state shared with siblings would repeat ECDSA nonces */
+      s0_prng_done();
+      close(lfd);
+      serve_conn(fd, akeyp);
+      exit(0);
+    default:
+      close(fd);
+    }
+  }
+  close(lfd);
+  unlink(path);
+}
@@ -0,0 +1,36 @@
+/*
+ * spor/agent.h
+ * key agent protocol: requests to a process holding an unlocked key
+ */
+#ifndef SPOR_AGENT_H
+#define SPOR_AGENT_H
+
+/*
+ * a request is an op byte, a two byte big endian length and that
+ * many bytes of data; the reply is a status byte (0 for success),
+ * a length and data.  one connection carries any number of requests.
+ */
+#define AGENT_SIGN     'g'    /* hash -> signature */
+#define AGENT_UNWRAP   'D'    /* encrypted message key -> message key */
+#define AGENT_PUBKEY   'b'    /* nothing -> key type, exported public key */
+
+struct asymkey;
+
+int agent_connect(
+  const char *path
+);
+void agent_call(
+  const int fd,
+  const unsigned char op,
+  const unsigned char *in,
+  const unsigned insz,
+  unsigned char *out,
+  unsigned long *outszp
+);
+
+void agent_serve(
+  const char *path,
+  struct asymkey *akeyp
+);
+
+#endif
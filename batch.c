@@ -0,0 +1,368 @@
+/*
+ * spor/batch.c
+ * run a manifest of stream operations in one process
+ *
+ * one line per entry: an operation (e, d, E, D, g or f), an input
+ * path and an output path (the signature, for g and f), separated
+ * by blanks.  blank lines and lines starting with '#' are skipped.
+ * setup, key import and the KDF are paid once; entries then run on a
+ * pool of forked workers, each fed one entry at a time over a socket.
+ * a failing entry kills only its worker, which is replaced.
+ *
+ * a verification list (lines of "path sigpath") runs in this process
+ * instead, VERIFY_BATCH signatures at a time, so they share the key's
+ * precomputed table and the modular inversions.  a line may name the
+ * signer by key id (as 'l' prints it), to be found in the keyring;
+ * entries are then checked grouped by key, each key looked up once.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bufio.h"
+#include "metrics.h"
+#include "spor.h"
+#include "util.h"
+
+struct entry {
+  char op;
+  char *in, *out;
+  char *key;                  /* signer's key id in hex, or NULL */
+  unsigned line;
+};
+
+struct worker {
+  pid_t pid;
+  int fd;                     /* -1 when retired */
+  long cur;                   /* entry in progress, -1 if idle */
+};
+
+#define VERIFY_BATCH 64
+
+static unsigned njobs;
+
+void s0_set_jobs(const unsigned n) {
+  long ncpu;
+  if ( n ) {
+    njobs = n;
+  } else {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    njobs = (ncpu > 0) ? ncpu : 1;
+  }
+}
+
+static char *read_manifest(const int fd) {
+  /* the whole manifest, NUL terminated */
+  struct bufio r;
+  char *text = NULL;
+  size_t len = 0, cap = 0, got;
+
+  bufio_open(&r, fd);
+  do {
+    if ( len + bufio_chunksz() + 1 > cap ) {
+      cap = 2*cap + bufio_chunksz() + 1;
+      if ( ! (text=realloc(text, cap)) ) DIE("allocating manifest");
+    }
+    got = bufio_read(&r, (unsigned char *)text + len, bufio_chunksz(), "reading manifest");
+    len += got;
+  } while ( got );
+  bufio_close(&r);
+  text[len] = '\0';
+  return text;
+}
+
+static unsigned parse_manifest(char *text, const char op, struct entry **entp) {
+  /* lines of "op in out", or of "in out [keyid]" if op is given */
+  struct entry *ent = NULL;
+  unsigned n = 0, cap = 0, line = 0;
+  char *p, *next, *f[3];
+  int nf;
+
+  for ( p=text; p && *p; p=next ) {
+    line++;
+    if ( (next=strchr(p, '\n')) ) *next++ = '\0';
+    for ( nf=0; nf<3; nf++ ) {
+      p += strspn(p, " \t\r");
+      if ( ! *p ) break;
+      f[nf] = p;
+      p += strcspn(p, " \t\r");
+      if ( *p ) *p++ = '\0';
+    }
+    if ( ! nf || f[0][0] == '#' ) continue;
+    p += strspn(p, " \t\r");
+    if ( op ? nf < 2 || *p : nf < 3 || *p || f[0][1] || ! strchr("edEDgf", f[0][0]) )
+      DIED("bad manifest line", line);
+
+    if ( n == cap ) {
+      cap = cap ? 2*cap : 1024;
+      if ( ! (ent=realloc(ent, cap * sizeof(*ent))) ) DIE("allocating manifest");
+    }
+    ent[n].op = op ? op : f[0][0];
+    ent[n].in = f[op ? 0 : 1];
+    ent[n].out = f[op ? 1 : 2];
+    ent[n].key = (op && nf == 3) ? f[2] : NULL;
+    ent[n].line = line;
+    n++;
+  }
+  *entp = ent;
+  return n;
+}
+
+static void run_entry(struct entry *e, struct asymkey *akeyp,
+                      unsigned char *pwbuf, const unsigned pwsz) {
+  int infd, outfd;
+
+  if ( (infd=open(e->in, O_RDONLY)) < 0 ) DIES2("opening", e->in);
+  if ( e->op == 'f' ) {
+    outfd = open(e->out, O_RDONLY);
+  } else {
+    outfd = open(e->out, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  }
+  if ( outfd < 0 ) DIES2("opening", e->out);
+
+  switch ( e->op ) {
+  case 'e': s0_encrypt_stream(infd, outfd, pwbuf, pwsz); break;
+  case 'd': s0_decrypt_stream(infd, outfd, pwbuf, pwsz); break;
+  case 'E': s0_asym_encrypt_stream(akeyp, infd, outfd); break;
+  case 'D': s0_asym_decrypt_stream(akeyp, infd, outfd); break;
+  case 'g': s0_sign_stream(akeyp, infd, outfd); break;
+  case 'f': s0_verify_stream(akeyp, infd, outfd); break;
+  }
+  close(infd);
+  close(outfd);
+}
+
+static void serve(const int fd, struct entry *ent, struct asymkey *akeyp,
+                  unsigned char *pwbuf, const unsigned pwsz) {
+  /* entry numbers in, a byte out for each one done */
+  unsigned idx;
+  unsigned char ok = 1;
+
+  while ( read_full_or_die(fd, (unsigned char *)&idx, sizeof(idx), "reading job") == sizeof(idx) ) {
+    run_entry(&ent[idx], akeyp, pwbuf, pwsz);
+    write_full_or_die(fd, &ok, 1, "reporting job");
+  }
+  exit(0);
+}
+
+static void spawn(struct worker *w, unsigned nw, unsigned i, struct entry *ent,
+                  struct asymkey *akeyp, unsigned char *pwbuf, const unsigned pwsz) {
+  int sv[2];
+  unsigned j;
+
+  if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ) DIES("creating worker socket");
+  switch ( (w[i].pid=fork()) ) {
+  case -1:
+    DIES("forking");
+  case 0:
+    close(sv[0]);
+    for ( j=0; j<nw; j++ ) if ( j != i && w[j].fd >= 0 ) close(w[j].fd);
+    s0_after_fork();
+    serve(sv[1], ent, akeyp, pwbuf, pwsz);
+  }
+  close(sv[1]);
+  w[i].fd = sv[0];
+  w[i].cur = -1;
+}
+
+static int dispatch(struct worker *w, unsigned idx) {
+  /* returns 0 if the worker is gone */
+  w->cur = idx;
+  return send(w->fd, &idx, sizeof(idx), MSG_NOSIGNAL) == sizeof(idx);
+}
+
+static void retire(struct worker *w) {
+  close(w->fd);
+  w->fd = -1;
+  waitpid(w->pid, NULL, 0);
+}
+
+void s0_batch(struct asymkey *akeyp, const int manifestfd, const int statusfd,
+              unsigned char *pwbuf, const unsigned pwsz) {
+  struct entry *ent, *e;
+  char *text;
+  unsigned n, nw, i, next = 0, done = 0, failed = 0;
+  unsigned char byte;
+  int needpw = 0, ok;
+
+  text = read_manifest(manifestfd);
+  n = parse_manifest(text, 0, &ent);
+  for ( i=0; i<n; i++ ) needpw |= ent[i].op == 'e' || ent[i].op == 'd';
+  if ( needpw && ! pwsz ) DIE("no passphrase");
+  if ( ! njobs ) s0_set_jobs(0);
+  nw = (n < njobs) ? n : njobs;
+
+  s0_set_keycache(1, pwbuf, needpw ? pwsz : 0);
+
+  struct worker w[nw ? nw : 1];
+  struct pollfd pfd[nw ? nw : 1];
+  for ( i=0; i<nw; i++ ) w[i].fd = -1;
+  for ( i=0; i<nw; i++ ) spawn(w, nw, i, ent, akeyp, pwbuf, pwsz);
+  for ( i=0; i<nw; i++ ) dispatch(&w[i], next++);
+
+  while ( done < n ) {
+    for ( i=0; i<nw; i++ ) {
+      pfd[i].fd = w[i].fd;
+      pfd[i].events = POLLIN;
+    }
+    if ( poll(pfd, nw, -1) < 0 ) {
+      if ( errno == EINTR ) continue;
+      DIES("waiting for workers");
+    }
+
+    for ( i=0; i<nw; i++ ) {
+      if ( w[i].fd < 0 || ! pfd[i].revents ) continue;
+
+      ok = read(w[i].fd, &byte, 1) == 1;
+      e = &ent[w[i].cur];
+      dprintf(statusfd, "%u %s %c %s %s\n", e->line, ok ? "ok" : "failed", e->op, e->in, e->out);
+      if ( ! ok ) {
+        /* don't leave half an output behind */
+        if ( e->op != 'f' ) unlink(e->out);
+        failed++;
+        retire(&w[i]);
+        if ( next < n ) spawn(w, nw, i, ent, akeyp, pwbuf, pwsz);
+      }
+      done++;
+
+      if ( next < n ) {
+        while ( ! dispatch(&w[i], next) ) {
+          retire(&w[i]);
+          spawn(w, nw, i, ent, akeyp, pwbuf, pwsz);
+        }
+        next++;
+      } else if ( w[i].fd >= 0 ) {
+        retire(&w[i]);
+      }
+    }
+  }
+
+  s0_set_keycache(0, NULL, 0);
+  free(ent);
+  free(text);
+  if ( failed ) DIED("failed batch entries", failed);
+}
+
+static int by_key(const void *a, const void *b) {
+  /* entries without a key id first, then by id, each in line order */
+  const struct entry *x = a, *y = b;
+  int c;
+  if ( x->key && y->key ) {
+    if ( (c=strcmp(x->key, y->key)) ) return c;
+  } else if ( x->key || y->key ) {
+    return x->key ? 1 : -1;
+  }
+  return (x->line > y->line) - (x->line < y->line);
+}
+
+static int same_key(const struct entry *x, const struct entry *y) {
+  return (! x->key && ! y->key) || (x->key && y->key && ! strcmp(x->key, y->key));
+}
+
+static struct asymkey *entry_key(const struct entry *e, struct asymkey *akeyp,
+                                 struct asymkey **ringkey) {
+  /* the key in memory, or the entry's from the keyring; NULL if the
+   * keyring hasn't got it.  *ringkey holds the last one found */
+  unsigned char id[KEYIDSZ];
+  unsigned i;
+
+  if ( ! e->key ) return akeyp;
+  s0_asym_free(*ringkey);
+  *ringkey = NULL;
+  if ( strlen(e->key) != 2*KEYIDSZ ) return NULL;
+  for ( i=0; i<KEYIDSZ; i++ ) {
+    if ( sscanf(e->key + 2*i, "%2hhx", &id[i]) != 1 ) return NULL;
+  }
+  *ringkey = s0_asym_new();
+  if ( ! s0_keyring_find(id, *ringkey) ) {
+    s0_asym_free(*ringkey);
+    *ringkey = NULL;
+  }
+  return *ringkey;
+}
+
+static int open_file(const char *path) {
+  /* a regular file, or -1: a directory would only fail once read */
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if ( fd >= 0 && (fstat(fd, &st) || ! S_ISREG(st.st_mode)) ) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+void s0_verify_list(struct asymkey *akeyp, const int listfd, const int statusfd) {
+  struct entry *ent, *e;
+  struct asymkey *key, *ringkey = NULL;
+  char *text;
+  unsigned n, i, j, k, m, failed = 0, hsz = s0_hash_size();
+  unsigned char hashes[VERIFY_BATCH * hsz], sigbuf[VERIFY_BATCH][BUFSZ];
+  const unsigned char *sigs[VERIFY_BATCH];
+  unsigned sigszs[VERIFY_BATCH], idx[VERIFY_BATCH];
+  int ok[VERIFY_BATCH], stat[VERIFY_BATCH], fd, sigfd;
+  unsigned long leafsz;
+  struct metrics_mark mark;
+
+  text = read_manifest(listfd);
+  n = parse_manifest(text, 'f', &ent);
+  qsort(ent, n, sizeof(*ent), by_key);
+
+  for ( i=0; i<n; i=k ) {
+    /* a batch is up to VERIFY_BATCH entries for one key, which stays
+     * loaded (with its table) while the next batch is for it too */
+    for ( k=i+1; k<n && k-i<VERIFY_BATCH && same_key(&ent[i], &ent[k]); k++ );
+    key = (i && same_key(&ent[i-1], &ent[i])) ? key : entry_key(&ent[i], akeyp, &ringkey);
+
+    /* missing or irregular files, non-signatures and unknown keys just fail */
+    for ( j=m=0; i+j<k; j++ ) {
+      e = &ent[i+j];
+      ok[j] = 0;
+      if ( ! key ) continue;
+      if ( (fd=open_file(e->in)) < 0 ) continue;
+      if ( (sigfd=open_file(e->out)) < 0 ) {
+        close(fd);
+        continue;
+      }
+      sigszs[m] = s0_read_sig(sigfd, s0_asym_type(key), sigbuf[m], BUFSZ, &leafsz);
+      close(sigfd);
+      if ( ! sigszs[m] ) {
+        close(fd);
+        continue;
+      }
+      if ( leafsz ) {
+        s0_tree_stream(fd, leafsz, hashes + m*hsz, hsz);
+      } else {
+        s0_hash_stream(fd, hashes + m*hsz, hsz);
+      }
+      close(fd);
+      sigs[m] = sigbuf[m];
+      idx[m++] = j;
+    }
+
+    if ( m ) {
+      metrics_start(PH_PK, &mark);
+      s0_asym_verify_batch(key, hashes, hsz, sigs, sigszs, m, stat);
+      metrics_stop(PH_PK, &mark);
+    }
+    while ( m-- ) ok[idx[m]] = stat[m];
+
+    for ( j=0; i+j<k; j++ ) {
+      e = &ent[i+j];
+      dprintf(statusfd, "%u %s %s %s%s%s\n", e->line, ok[j] ? "ok" : "failed", e->in, e->out,
+              e->key ? " " : "", e->key ? e->key : "");
+      failed += ! ok[j];
+    }
+  }
+
+  s0_asym_free(ringkey);
+  free(ent);
+  free(text);
+  if ( failed ) DIED("failed signatures", failed);
+}
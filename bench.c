@@ -0,0 +1,382 @@
+/**
+ ** bench.c
+ ** spor-bench: throughput and latency of spor's primitives and streams
+ **
+ ** one JSON object per line on stdout, one line per measurement, so
+ ** runs from different builds (MATH=, SPOR_HWACCEL, chunk sizes) can
+ ** be kept and compared with ordinary tools.
+ **/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufio.h"
+#include "pbkdf.h"
+#include "spor.h"
+#include "spor_ltc.h"
+#include "util.h"
+
+#define EXE "spor-bench"
+#define BENCH_MS        500    /* default time per measurement */
+#define PK_BATCH        64
+
+#define USAGE() \
+fprintf(stderr, "Usage: " EXE " [cipher] [hash] [stream] [kdf] [pk]\n"\
+  "    time the named groups, or all of them, writing a JSON object\n"\
+  "    per measurement to stdout.\n"\
+  "    SPOR_BENCH_MS: milliseconds per measurement (500)\n"\
+  "    SPOR_BENCH_DIR: directory for the stream files ($TMPDIR or /tmp)\n"\
+  "    SPOR_THREADS, SPOR_KDF: as for spor\n"\
+),exit(1)
+
+
+struct asymkey akey;
+
+static double budget = BENCH_MS / 1000.0;
+static unsigned long threads = 1;       /* SPOR_THREADS, 0 for one per CPU */
+
+static const size_t bufsizes[] = { 1<<10, 1<<16, 1<<20, 1<<24 };
+static const size_t streamsizes[] = { 1<<20, 1<<24, 1<<26 };
+static const size_t chunksizes[] = { 1<<16, 1<<20, 1<<22 };
+
+#define NELEM(a) (sizeof(a) / sizeof(a[0]))
+
+
+void cleanup_atexit(void) {
+  s0_teardown();
+  zeromem(&akey, sizeof(akey));
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long maxrss(void) {
+  /* KiB */
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static void header(const char *group, const char *op) {
+  printf("{\"group\":\"%s\",\"op\":\"%s\",\"math\":\"%s\"", group, op, ltc_mp.name);
+}
+
+static void rate(const unsigned long long bytes, const unsigned long long n, const double secs) {
+  /* throughput for bulk work, operations per second otherwise */
+  if ( bytes ) printf(",\"bytes\":%llu,\"secs\":%.6f,\"mbps\":%.1f}\n", bytes, secs, bytes / secs / 1e6);
+  else printf(",\"n\":%llu,\"secs\":%.6f,\"ops\":%.1f}\n", n, secs, n / secs);
+  fflush(stdout);
+}
+
+
+/**
+ ** Primitives
+ **/
+
+static void bench_cipher(void) {
+  unsigned char key[KEYSZ_SYM], iv[KEYSZ_SYM], *buf;
+  unsigned long long bytes;
+  double t0, t;
+  unsigned i;
+  int hw;
+
+  s0_prng_getbytes(key, sizeof(key));
+  s0_prng_getbytes(iv, sizeof(iv));
+  for ( hw=1; hw>=0; hw-- ) {
+    s0_set_hwaccel(hw);
+    for ( i=0; i<NELEM(bufsizes); i++ ) {
+      if ( ! (buf=calloc(1, bufsizes[i])) ) DIE("allocating buffer");
+      s0_cipher_init(key, iv, sizeof(key));
+      bytes = 0;
+      t0 = now();
+      do {
+        s0_cipher_encrypt(buf, bufsizes[i]);
+        bytes += bufsizes[i];
+      } while ( (t=now()-t0) < budget );
+      s0_cipher_done();
+      header("cipher", "encrypt");
+      printf(",\"hwaccel\":%d,\"size\":%zu", hw, bufsizes[i]);
+      rate(bytes, 0, t);
+      free(buf);
+    }
+  }
+  s0_set_hwaccel(1);
+}
+
+static void bench_hash(void) {
+  unsigned char hash[s0_hash_size()], *buf;
+  unsigned long long bytes;
+  double t0, t;
+  unsigned i;
+  int hw;
+
+  for ( hw=1; hw>=0; hw-- ) {
+    s0_set_hwaccel(hw);
+    for ( i=0; i<NELEM(bufsizes); i++ ) {
+      if ( ! (buf=calloc(1, bufsizes[i])) ) DIE("allocating buffer");
+      s0_hash_init();
+      bytes = 0;
+      t0 = now();
+      do {
+        s0_hash_update(buf, bufsizes[i]);
+        bytes += bufsizes[i];
+      } while ( (t=now()-t0) < budget );
+      s0_hash_done(hash, sizeof(hash));
+      header("hash", "update");
+      printf(",\"hwaccel\":%d,\"size\":%zu", hw, bufsizes[i]);
+      rate(bytes, 0, t);
+      free(buf);
+    }
+  }
+  s0_set_hwaccel(1);
+}
+
+static void bench_kdf(void) {
+  /* one derivation is the unit: latency, and the peak memory so far */
+  unsigned char skey[KEYSZ_SYM], salt[SALTSZ], pw[] = "benchmark";
+  struct s0_kdf kdf[3];
+  char str[64], *env;
+  unsigned i, nkdf = 0;
+  unsigned long long n;
+  double t0, t;
+
+  s0_prng_getbytes(salt, sizeof(salt));
+  s0_kdf_parse("argon2id,t=1,m=65536,p=1", &kdf[nkdf++]);
+  s0_kdf_default(&kdf[nkdf++]);
+  if ( (env=getenv("SPOR_KDF")) && s0_kdf_parse(env, &kdf[nkdf]) ) nkdf++;
+
+  for ( i=0; i<nkdf; i++ ) {
+    n = 0;
+    t0 = now();
+    do {
+      s0_derive_key(skey, sizeof(skey), pw, sizeof(pw)-1, salt, sizeof(salt), &kdf[i]);
+      n++;
+    } while ( (t=now()-t0) < budget );
+    s0_kdf_format(str, sizeof(str), &kdf[i]);
+    header("kdf", "derive");
+    printf(",\"params\":\"%s\",\"kib\":%u,\"maxrss_kib\":%ld,\"ms\":%.1f",
+           str, kdf[i].mcost, maxrss(), t * 1000 / n);
+    rate(0, n, t);
+  }
+  zeromem(skey, sizeof(skey));
+}
+
+static void bench_pk_type(const unsigned type, const char *name) {
+  /* the batch checks PK_BATCH signatures of the one hash */
+  const unsigned hashsz = s0_hash_size();
+  unsigned char hashes[PK_BATCH * hashsz], *hash = hashes, skey[KEYSZ_SYM];
+  unsigned char sig[PK_BATCH][BUFSZ], wrapped[BUFSZ];
+  const unsigned char *sigs[PK_BATCH];
+  unsigned sigszs[PK_BATCH], i;
+  unsigned long sigsz, wrapsz;
+  unsigned long long n;
+  int stat[PK_BATCH];
+  double t0, t;
+
+  n = 0;
+  t0 = now();
+  do {
+    s0_asym_keygen(&akey, type);
+    n++;
+  } while ( (t=now()-t0) < budget );
+  header("pk", "keygen");
+  printf(",\"type\":\"%s\"", name);
+  rate(0, n, t);
+
+  s0_prng_getbytes(hash, hashsz);
+  n = 0;
+  t0 = now();
+  do {
+    sigsz = sizeof(sig[0]);
+    s0_asym_sign(&akey, hash, hashsz, sig[0], &sigsz);
+    n++;
+  } while ( (t=now()-t0) < budget );
+  header("pk", "sign");
+  printf(",\"type\":\"%s\"", name);
+  rate(0, n, t);
+
+  n = 0;
+  t0 = now();
+  do {
+    if ( ! s0_asym_verify(&akey, hash, hashsz, sig[0], sigsz) ) DIE("verification failed");
+    n++;
+  } while ( (t=now()-t0) < budget );
+  header("pk", "verify");
+  printf(",\"type\":\"%s\"", name);
+  rate(0, n, t);
+
+  for ( i=0; i<PK_BATCH; i++ ) {
+    memcpy(hashes + i*hashsz, hash, hashsz);
+    sigsz = sizeof(sig[i]);
+    s0_asym_sign(&akey, hash, hashsz, sig[i], &sigsz);
+    sigs[i] = sig[i];
+    sigszs[i] = sigsz;
+  }
+  n = 0;
+  t0 = now();
+  do {
+    s0_asym_verify_batch(&akey, hashes, hashsz, sigs, sigszs, PK_BATCH, stat);
+    for ( i=0; i<PK_BATCH; i++ ) if ( ! stat[i] ) DIE("verification failed");
+    n += PK_BATCH;
+  } while ( (t=now()-t0) < budget );
+  header("pk", "verify_batch");
+  printf(",\"type\":\"%s\",\"batch\":%d", name, PK_BATCH);
+  rate(0, n, t);
+
+  s0_prng_getbytes(skey, sizeof(skey));
+  n = 0;
+  t0 = now();
+  do {
+    wrapsz = sizeof(wrapped);
+    s0_asym_encrypt_key(&akey, skey, sizeof(skey), wrapped, &wrapsz);
+    n++;
+  } while ( (t=now()-t0) < budget );
+  header("pk", "wrap");
+  printf(",\"type\":\"%s\"", name);
+  rate(0, n, t);
+
+  n = 0;
+  t0 = now();
+  do {
+    s0_asym_decrypt_key(&akey, skey, sizeof(skey), wrapped, wrapsz);
+    n++;
+  } while ( (t=now()-t0) < budget );
+  header("pk", "unwrap");
+  printf(",\"type\":\"%s\"", name);
+  rate(0, n, t);
+  zeromem(skey, sizeof(skey));
+}
+
+static void bench_pk(void) {
+  bench_pk_type(ASYM_P521, "p521");
+#ifdef LTC_CURVE25519
+  bench_pk_type(ASYM_25519, "25519");
+#endif
+}
+
+
+/**
+ ** Streams
+ ** 'A' streams, so the KDF stays out of the numbers
+ **/
+
+static int tempfile(const char *dir, const char *name) {
+  char path[4096];
+  int fd;
+  snprintf(path, sizeof(path), "%s/" EXE ".%d.%s", dir, (int)getpid(), name);
+  if ( (fd=open(path, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0 ) DIES(path);
+  unlink(path);
+  return fd;
+}
+
+static void rewind_or_die(const int fd) {
+  if ( lseek(fd, 0, SEEK_SET) < 0 ) DIES("seeking");
+}
+
+static void bench_stream(void) {
+  unsigned char *buf;
+  const char *dir;
+  unsigned long long n;
+  unsigned i, j, format;
+  int plain, cipher, out;
+  double t0, t;
+
+  if ( ! (dir=getenv("SPOR_BENCH_DIR")) && ! (dir=getenv("TMPDIR")) ) dir = "/tmp";
+  plain = tempfile(dir, "plain");
+  cipher = tempfile(dir, "cipher");
+  out = tempfile(dir, "out");
+  s0_asym_keygen(&akey, ASYM_P521);
+
+  for ( i=0; i<NELEM(streamsizes); i++ ) {
+    if ( ! (buf=malloc(streamsizes[i])) ) DIE("allocating buffer");
+    s0_prng_getbytes(buf, streamsizes[i]);
+    if ( ftruncate(plain, 0) ) DIES("truncating");
+    rewind_or_die(plain);
+    write_full_or_die(plain, buf, streamsizes[i], "writing");
+    free(buf);
+
+    for ( j=0; j<NELEM(chunksizes); j++ ) {
+      bufio_set_chunksz(chunksizes[j]);
+      for ( format=SPOR_ONDISK_VERSION; format<=SPOR_SEGMENTED_VERSION; format++ ) {
+        s0_set_format(format);
+
+        n = 0;
+        t0 = now();
+        do {
+          rewind_or_die(plain);
+          rewind_or_die(cipher);
+          if ( ftruncate(cipher, 0) ) DIES("truncating");
+          s0_asym_encrypt_stream(&akey, plain, cipher);
+          n++;
+        } while ( (t=now()-t0) < budget );
+        header("stream", "E");
+        printf(",\"format\":%u,\"size\":%zu,\"chunk\":%zu,\"threads\":%lu",
+               format, streamsizes[i], chunksizes[j], threads);
+        rate(n * streamsizes[i], n, t);
+
+        n = 0;
+        t0 = now();
+        do {
+          rewind_or_die(cipher);
+          rewind_or_die(out);
+          if ( ftruncate(out, 0) ) DIES("truncating");
+          s0_asym_decrypt_stream(&akey, cipher, out);
+          n++;
+        } while ( (t=now()-t0) < budget );
+        header("stream", "D");
+        printf(",\"format\":%u,\"size\":%zu,\"chunk\":%zu,\"threads\":%lu",
+               format, streamsizes[i], chunksizes[j], threads);
+        rate(n * streamsizes[i], n, t);
+      }
+    }
+  }
+  close(plain);
+  close(cipher);
+  close(out);
+}
+
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} groups[] = {
+  { "cipher", bench_cipher },
+  { "hash", bench_hash },
+  { "stream", bench_stream },
+  { "kdf", bench_kdf },
+  { "pk", bench_pk },
+};
+
+int main(int argc, char **argv) {
+  char *env;
+  unsigned i;
+  int j;
+
+  for ( j=1; j<argc; j++ ) {
+    for ( i=0; i<NELEM(groups) && strcmp(argv[j], groups[i].name); i++ );
+    if ( i == NELEM(groups) ) USAGE();
+  }
+
+  s0_setup();
+  s0_asym_setup(&akey);
+  atexit(cleanup_atexit);
+
+  if ( (env=getenv("SPOR_BENCH_MS")) ) budget = strtoul(env, NULL, 0) / 1000.0;
+  if ( (env=getenv("SPOR_THREADS")) ) {
+    threads = strtoul(env, NULL, 0);
+    s0_set_threads(threads);
+  }
+
+  for ( i=0; i<NELEM(groups); i++ ) {
+    for ( j=1; j<argc && strcmp(argv[j], groups[i].name); j++ );
+    if ( argc == 1 || j < argc ) groups[i].run();
+  }
+  exit(0);
+}
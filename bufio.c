@@ -0,0 +1,199 @@
+/*
+ * spor/bufio.c
+ * buffered, large-chunk descriptor I/O
+ *
+ * headers are parsed out of the same buffer that carries the bulk
+ * data, so a stream costs one read()/write() per chunk instead of
+ * one per header field and one per BUFSZ bytes of payload.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bufio.h"
+#include "metrics.h"
+#include "util.h"
+
+static size_t chunksz = BUFIO_CHUNKSZ;
+
+static size_t pagesz(void) {
+  long sz = sysconf(_SC_PAGESIZE);
+  return (sz > 0) ? sz : 4096;
+}
+
+void bufio_set_chunksz(size_t sz) {
+  /* round up to a whole number of pages */
+  size_t pg = pagesz();
+  if ( sz < pg ) sz = pg;
+  chunksz = (sz + pg - 1) & ~(pg - 1);
+}
+
+size_t bufio_chunksz(void) {
+  return chunksz;
+}
+
+
+/**
+ ** Raw descriptor access
+ **/
+
+size_t read_full_or_die(int fd, unsigned char *buf, size_t sz, char *msg) {
+  /* loop until sz bytes are read or EOF */
+  struct metrics_mark m;
+  size_t got = 0;
+  ssize_t len;
+  unsigned calls = 0;
+  while ( got < sz ) {
+    metrics_start(PH_READ, &m);
+    len = read(fd, buf+got, sz-got);
+    metrics_stop(PH_READ, &m);
+    calls++;
+    if ( len < 0 ) {
+      if ( errno == EINTR ) continue;
+      DIES(msg);
+    }
+    if ( len == 0 ) break;
+    got += len;
+  }
+  metrics_io(0, got, calls);
+  return got;
+}
+
+void write_full_or_die(int fd, const unsigned char *buf, size_t sz, char *msg) {
+  /* loop over short writes */
+  struct metrics_mark m;
+  size_t total = sz;
+  ssize_t len;
+  unsigned calls = 0;
+  while ( sz ) {
+    metrics_start(PH_WRITE, &m);
+    len = write(fd, buf, sz);
+    metrics_stop(PH_WRITE, &m);
+    calls++;
+    if ( len < 0 ) {
+      if ( errno == EINTR ) continue;
+      DIES(msg);
+    }
+    buf += len;
+    sz -= len;
+  }
+  metrics_io(1, total, calls);
+}
+
+
+/**
+ ** Buffered reader/writer
+ **/
+
+void bufio_open(struct bufio *b, const int fd) {
+  void *p;
+  memset(b, 0, sizeof(*b));
+  b->fd = fd;
+  b->cap = chunksz;
+  if ( posix_memalign(&p, pagesz(), b->cap) ) DIE("allocating I/O buffer");
+  b->buf = p;
+}
+
+void bufio_close(struct bufio *b) {
+  /* the buffer may have held plaintext */
+  if ( ! b->buf ) return;
+  zeromem(b->buf, b->dirty);
+  free(b->buf);
+  b->buf = NULL;
+}
+
+static size_t bufio_fill(struct bufio *r, char *msg) {
+  if ( r->pos < r->len || r->eof ) return r->len - r->pos;
+  r->pos = 0;
+  r->len = read_full_or_die(r->fd, r->buf, r->cap, msg);
+  if ( r->len < r->cap ) r->eof = 1;
+  if ( r->len > r->dirty ) r->dirty = r->len;
+  return r->len;
+}
+
+size_t bufio_next(struct bufio *r, unsigned char **p, char *msg) {
+  /* hand out the next buffered chunk for in-place processing */
+  size_t n = bufio_fill(r, msg);
+  *p = r->buf + r->pos;
+  r->pos += n;
+  if ( r->tap ) r->tap(r->tapctx, *p, n);
+  return n;
+}
+
+size_t bufio_read(struct bufio *r, unsigned char *buf, size_t sz, char *msg) {
+  /* copy out up to sz bytes, short only at EOF */
+  size_t got = 0, n;
+  if ( r->pos == r->len && ! r->eof && sz >= r->cap ) {
+    /* nothing buffered: large reads bypass the buffer */
+    got = read_full_or_die(r->fd, buf, sz, msg);
+    if ( got < sz ) r->eof = 1;
+  } else {
+    while ( got < sz && (n=bufio_fill(r, msg)) > 0 ) {
+      if ( n > sz - got ) n = sz - got;
+      memcpy(buf+got, r->buf+r->pos, n);
+      r->pos += n;
+      got += n;
+    }
+  }
+  if ( r->tap ) r->tap(r->tapctx, buf, got);
+  return got;
+}
+
+int bufio_peek(struct bufio *r, char *msg) {
+  if ( ! bufio_fill(r, msg) ) return -1;
+  return r->buf[r->pos];
+}
+
+void bufio_skip(struct bufio *r, unsigned long long n, char *msg) {
+  /* drop n bytes of input, seeking past them if the descriptor allows */
+  size_t have = r->len - r->pos;
+
+  if ( n <= have ) {
+    r->pos += n;
+    return;
+  }
+  n -= have;
+  r->pos = r->len;
+  if ( r->eof ) return;
+
+  if ( lseek(r->fd, (off_t)n, SEEK_CUR) >= 0 ) {
+    r->pos = r->len = 0;
+    return;
+  }
+  if ( errno != ESPIPE ) DIES(msg);
+
+  /* pipes and ttys: read and discard */
+  while ( n && (have=bufio_fill(r, msg)) > 0 ) {
+    if ( have > n ) have = n;
+    r->pos += have;
+    n -= have;
+  }
+}
+
+void bufio_flush(struct bufio *w, char *msg) {
+  write_full_or_die(w->fd, w->buf, w->len, msg);
+  w->len = 0;
+}
+
+void bufio_write(struct bufio *w, const unsigned char *buf, size_t sz, char *msg) {
+  size_t n;
+  if ( w->tap ) w->tap(w->tapctx, buf, sz);
+  if ( w->len + sz > w->cap && w->len ) {
+    /* top up the pending chunk and send it */
+    n = w->cap - w->len;
+    memcpy(w->buf+w->len, buf, n);
+    w->len = w->dirty = w->cap;
+    bufio_flush(w, msg);
+    buf += n;
+    sz -= n;
+  }
+  if ( sz >= w->cap ) {
+    /* nothing pending: large writes bypass the buffer */
+    write_full_or_die(w->fd, buf, sz, msg);
+    return;
+  }
+  memcpy(w->buf+w->len, buf, sz);
+  w->len += sz;
+  if ( w->len > w->dirty ) w->dirty = w->len;
+}
@@ -0,0 +1,42 @@
+/*
+ * spor/bufio.h
+ * buffered, large-chunk descriptor I/O
+ */
+#ifndef SPOR_BUFIO_H
+#define SPOR_BUFIO_H
+
+#include <stddef.h>
+
+/* default chunk size for bulk data (1 MiB) */
+#define BUFIO_CHUNKSZ   (1<<20)
+
+struct bufio {
+  int fd;
+  unsigned char *buf;   /* page-aligned, cap bytes */
+  size_t cap;
+  size_t pos;           /* reader: next unconsumed byte */
+  size_t len;           /* reader: valid bytes; writer: pending bytes */
+  int eof;
+  size_t dirty;         /* bytes of buf ever used, wiped on close */
+  void (*tap)(void *ctx, const unsigned char *buf, size_t len);
+  void *tapctx;         /* tap sees every byte read or written, in order */
+};
+
+void bufio_set_chunksz(size_t sz);
+size_t bufio_chunksz(void);
+
+void bufio_open(struct bufio *b, const int fd);
+void bufio_close(struct bufio *b);
+
+size_t bufio_next(struct bufio *r, unsigned char **p, char *msg);
+size_t bufio_read(struct bufio *r, unsigned char *buf, size_t sz, char *msg);
+int bufio_peek(struct bufio *r, char *msg);
+void bufio_skip(struct bufio *r, unsigned long long n, char *msg);
+
+void bufio_write(struct bufio *w, const unsigned char *buf, size_t sz, char *msg);
+void bufio_flush(struct bufio *w, char *msg);
+
+size_t read_full_or_die(int fd, unsigned char *buf, size_t sz, char *msg);
+void write_full_or_die(int fd, const unsigned char *buf, size_t sz, char *msg);
+
+#endif
@@ -0,0 +1,532 @@
+/*
+ * spor/libspor.c
+ * the library entry points, see libspor.h
+ *
+ * the stream code keeps its state in globals and speaks descriptors,
+ * so none of it runs here: these build and parse the same packets in
+ * memory, on the primitives that take their keys as arguments (the
+ * PRNG they share is locked, and a KDF finding the arena taken maps
+ * its own).  each call sets a die trap, so a failure deep in the
+ * backend comes back as SPOR_EFAIL with its message in place of an
+ * exit.  encryption writes format 2 ('a'), uncompressed, each message
+ * under a subkey of its own ('U'); decryption reads anything 'e'
+ * writes.  signatures are plain hashes, as 'g' makes them without
+ * SPOR_TREE.
+ */
+
+#include <pthread.h>
+
+#include "libspor.h"
+#include "lz.h"
+#include "pbkdf.h"
+#include "spor.h"
+#include "util.h"
+
+#define LIB_HASHSZ      64     /* the most s0_hash_size can be */
+
+struct spor_ctx {
+  struct die_trap trap;
+  int code;                    /* returned if the trap springs */
+  char err[sizeof(((struct die_trap *)0)->msg)];
+  unsigned char pw[BUFSZ];
+  unsigned pwsz;
+  struct asymkey *akey;        /* from spor_load_key */
+  /* the last key derived: encryptions share its salt, as a batch's
+   * do, each under its own subkey of it, and decryptions of streams
+   * with that salt skip the KDF */
+  unsigned char salt[SALTSZ];
+  struct s0_kdf kdf;
+  unsigned char key[KEYSZ_SYM];
+  int keyed;
+  /* what a call holds, released if it fails */
+  unsigned char *out, *tmp;
+  size_t outlen, outcap, tmpsz;
+  struct asymkey *newkey;
+  unsigned char keybuf[BUFSZ], kek[KEYSZ_SYM], mkey[KEYSZ_SYM];
+};
+
+struct ibuf {
+  const unsigned char *p;
+  size_t len, pos;
+};
+
+/* a call runs between TRY and done; FAIL leaves it with a code */
+#define TRY(c) \
+  if ( setjmp((c)->trap.env) ) return caught(c); \
+  (c)->code = SPOR_EFAIL; \
+  (c)->err[0] = 0; \
+  die_trap = &(c)->trap
+
+#define FAIL(c, err, msg) do { (c)->code = (err); die("%s", msg); } while (0)
+
+static void release(struct spor_ctx *c) {
+  if ( c->out ) {
+    zeromem(c->out, c->outcap);
+    free(c->out);
+  }
+  if ( c->tmp ) {
+    zeromem(c->tmp, c->tmpsz);
+    free(c->tmp);
+  }
+  s0_asym_free(c->newkey);
+  c->out = c->tmp = NULL;
+  c->outlen = c->outcap = c->tmpsz = 0;
+  c->newkey = NULL;
+  zeromem(c->keybuf, sizeof(c->keybuf));
+  zeromem(c->kek, sizeof(c->kek));
+  zeromem(c->mkey, sizeof(c->mkey));
+}
+
+static int caught(struct spor_ctx *c) {
+  /* die has cleared the trap */
+  memcpy(c->err, c->trap.msg, sizeof(c->err));
+  release(c);
+  return c->code;
+}
+
+static int done(struct spor_ctx *c, unsigned char **out, size_t *outlen) {
+  /* hands over the output, if the call makes any */
+  die_trap = NULL;
+  if ( out ) {
+    *out = c->out;
+    *outlen = c->outlen;
+    c->out = NULL;
+  }
+  release(c);
+  return SPOR_OK;
+}
+
+static unsigned char *lib_alloc(struct spor_ctx *c, const size_t sz) {
+  unsigned char *p;
+  if ( ! (p=malloc(sz ? sz : 1)) ) FAIL(c, SPOR_ENOMEM, "allocating buffer");
+  return p;
+}
+
+
+/**
+ ** Output
+ **/
+
+static void out_reserve(struct spor_ctx *c, const size_t n) {
+  /* grown by copying, so no stray copy of plaintext is left unwiped */
+  unsigned char *p;
+  size_t cap = c->outcap ? c->outcap : 256;
+
+  if ( c->outcap - c->outlen >= n ) return;
+  while ( cap - c->outlen < n ) {
+    if ( cap > (size_t)-1 / 2 ) FAIL(c, SPOR_ENOMEM, "output too large");
+    cap *= 2;
+  }
+  p = lib_alloc(c, cap);
+  if ( c->out ) {
+    memcpy(p, c->out, c->outlen);
+    zeromem(c->out, c->outcap);
+    free(c->out);
+  }
+  c->out = p;
+  c->outcap = cap;
+}
+
+static void out_put(struct spor_ctx *c, const unsigned char *buf, const size_t n) {
+  out_reserve(c, n);
+  memcpy(c->out + c->outlen, buf, n);
+  c->outlen += n;
+}
+
+static void out_magic(struct spor_ctx *c, const unsigned char type, const unsigned char version) {
+  unsigned char hdr[4] = { 's', '0', version, type };
+  out_put(c, hdr, sizeof(hdr));
+}
+
+static void out_header(struct spor_ctx *c, const unsigned char type,
+                       const unsigned char *buf, const unsigned char len) {
+  unsigned char hdr[2] = { type, len };
+  out_put(c, hdr, sizeof(hdr));
+  out_put(c, buf, len);
+}
+
+
+/**
+ ** Input
+ **/
+
+static int in_peek(struct ibuf *r) {
+  return (r->pos < r->len) ? r->p[r->pos] : -1;
+}
+
+static unsigned in_magic(struct spor_ctx *c, struct ibuf *r, const unsigned char type) {
+  /* returns the packet version */
+  const unsigned char *hdr = r->p + r->pos;
+
+  if ( r->len - r->pos < 4 || hdr[0] != 's' || hdr[1] != '0' ) FAIL(c, SPOR_EFORMAT, "bad magic");
+  if ( hdr[3] != type ) FAIL(c, SPOR_EFORMAT, "bad packet type");
+  if ( hdr[2] != SPOR_ONDISK_VERSION && ! (hdr[2] == SPOR_SEGMENTED_VERSION && type == 'S') )
+    FAIL(c, SPOR_EFORMAT, "bad packet version");
+  r->pos += 4;
+  return hdr[2];
+}
+
+static unsigned in_header(struct spor_ctx *c, struct ibuf *r, const unsigned char type,
+                          unsigned char *buf, const unsigned sz) {
+  unsigned len;
+
+  if ( r->len - r->pos < 2 || r->p[r->pos] != type ) FAIL(c, SPOR_EFORMAT, "bad header");
+  len = r->p[r->pos + 1];
+  if ( len > sz || r->len - r->pos - 2 < len ) FAIL(c, SPOR_EFORMAT, "bad header length");
+  memcpy(buf, r->p + r->pos + 2, len);
+  r->pos += 2 + len;
+  return len;
+}
+
+static void in_kdf(struct spor_ctx *c, struct ibuf *r, struct s0_kdf *kdf) {
+  unsigned char buf[KDF_HDRSZ];
+  unsigned len;
+  if ( in_peek(r) != 'P' ) {
+    s0_kdf_default(kdf);
+    return;
+  }
+  len = in_header(c, r, 'P', buf, sizeof(buf));
+  s0_kdf_decode(buf, len, kdf);
+}
+
+static unsigned in_type(struct spor_ctx *c, struct ibuf *r) {
+  unsigned char t;
+  if ( in_peek(r) != 'T' ) return ASYM_P521;
+  if ( in_header(c, r, 'T', &t, 1) != 1 ) FAIL(c, SPOR_EFORMAT, "bad key type header");
+  return t;
+}
+
+static unsigned long in_word(struct spor_ctx *c, struct ibuf *r, const unsigned char type) {
+  /* a header holding one 32 bit big endian value */
+  unsigned char buf[4];
+  if ( in_header(c, r, type, buf, sizeof(buf)) != sizeof(buf) ) FAIL(c, SPOR_EFORMAT, "bad header");
+  return (unsigned long)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+
+/**
+ ** Contexts
+ **/
+
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int setup_done;
+
+struct spor_ctx *spor_ctx_new(void) {
+  struct spor_ctx *c;
+
+  if ( ! (c=calloc(1, sizeof(*c))) ) return NULL;
+  if ( setjmp(c->trap.env) ) {
+    pthread_mutex_unlock(&setup_lock);
+    free(c);
+    return NULL;
+  }
+  die_trap = &c->trap;
+  pthread_mutex_lock(&setup_lock);
+  if ( ! setup_done ) s0_setup();
+  setup_done = 1;
+  pthread_mutex_unlock(&setup_lock);
+  die_trap = NULL;
+  return c;
+}
+
+void spor_ctx_free(struct spor_ctx *c) {
+  if ( ! c ) return;
+  release(c);
+  s0_asym_free(c->akey);
+  zeromem(c, sizeof(*c));
+  free(c);
+}
+
+const char *spor_error(struct spor_ctx *c) {
+  /* why the last call failed, if it did */
+  return c->err;
+}
+
+void spor_free(unsigned char *buf, const size_t len) {
+  if ( ! buf ) return;
+  zeromem(buf, len);
+  free(buf);
+}
+
+int spor_set_password(struct spor_ctx *c, const unsigned char *pw, const size_t len) {
+  if ( ! c || (! pw && len) || len > sizeof(c->pw) ) return SPOR_EINVAL;
+  zeromem(c->pw, sizeof(c->pw));
+  zeromem(c->key, sizeof(c->key));
+  c->keyed = 0;
+  if ( len ) memcpy(c->pw, pw, len);
+  c->pwsz = len;
+  return SPOR_OK;
+}
+
+int spor_load_key(struct spor_ctx *c, const unsigned char *buf, const size_t len) {
+  /* a 'B' packet, or a 'V' one sealed with the context's password */
+  unsigned char iv[KEYSZ_SYM], salt[SALTSZ];
+  struct ibuf r = { buf, len, 0 };
+  struct s0_kdf kdf;
+  unsigned type, sealed;
+  size_t n;
+
+  if ( ! c || ! buf ) return SPOR_EINVAL;
+  TRY(c);
+  c->code = SPOR_EFORMAT;
+  sealed = len >= 4 && buf[3] == 'V';
+  in_magic(c, &r, sealed ? 'V' : 'B');
+  type = in_type(c, &r);
+  if ( sealed ) {
+    in_kdf(c, &r, &kdf);
+    if ( in_header(c, &r, 'I', iv, sizeof(iv)) != sizeof(iv) ) FAIL(c, SPOR_EFORMAT, "bad iv header");
+    if ( in_header(c, &r, 'L', salt, sizeof(salt)) != sizeof(salt) ) FAIL(c, SPOR_EFORMAT, "bad salt header");
+  }
+  if ( (n=len - r.pos) > sizeof(c->keybuf) ) FAIL(c, SPOR_EFORMAT, "key too long");
+  memcpy(c->keybuf, buf + r.pos, n);
+
+  if ( sealed ) {
+    if ( ! c->pwsz ) FAIL(c, SPOR_EINVAL, "no passphrase");
+    c->code = SPOR_EFAIL;
+    s0_derive_key(c->kek, sizeof(c->kek), c->pw, c->pwsz, salt, sizeof(salt), &kdf);
+    s0_ctr_crypt(c->kek, iv, c->keybuf, n, 0);
+    /* a key that won't import was sealed with another password */
+    c->code = SPOR_EAUTH;
+  }
+  c->newkey = s0_asym_new();
+  s0_asym_import(c->keybuf, n, type, c->newkey);
+
+  s0_asym_free(c->akey);
+  c->akey = c->newkey;
+  c->newkey = NULL;
+  return done(c, NULL, NULL);
+}
+
+
+/**
+ ** Encryption
+ **/
+
+static void lib_key(struct spor_ctx *c, unsigned char *salt, const struct s0_kdf *kdf) {
+  /* c->key for this salt and kdf */
+  if ( c->keyed && ! memcmp(c->salt, salt, SALTSZ) && ! memcmp(&c->kdf, kdf, sizeof(*kdf)) )
+    return;
+  if ( ! c->pwsz ) FAIL(c, SPOR_EINVAL, "no passphrase");
+  c->keyed = 0;
+  s0_derive_key(c->key, sizeof(c->key), c->pw, c->pwsz, salt, SALTSZ, kdf);
+  memcpy(c->salt, salt, SALTSZ);
+  c->kdf = *kdf;
+  c->keyed = 1;
+}
+
+int spor_encrypt(struct spor_ctx *c, const unsigned char *in, const size_t inlen,
+                 unsigned char **out, size_t *outlen) {
+  /* an 'S' packet of authenticated segments, as "a e" writes */
+  unsigned char prefix[NONCE_PREFIXSZ], salt[SALTSZ], usalt[SALTSZ], buf[KDF_HDRSZ], *seg;
+  unsigned long segsz = SEGSZ;
+  unsigned long long idx = 0;
+  struct s0_kdf kdf;
+  size_t off = 0, n;
+
+  if ( ! c || (! in && inlen) || ! out || ! outlen ) return SPOR_EINVAL;
+  TRY(c);
+  if ( ! c->pwsz ) FAIL(c, SPOR_EINVAL, "no passphrase");
+  s0_kdf_current(&kdf);
+  if ( c->keyed && ! memcmp(&c->kdf, &kdf, sizeof(kdf)) ) {
+    memcpy(salt, c->salt, sizeof(salt));
+  } else {
+    s0_prng_getbytes(salt, sizeof(salt));
+  }
+  lib_key(c, salt, &kdf);
+  s0_prng_getbytes(usalt, sizeof(usalt));
+  s0_subkey(c->key, usalt, c->mkey);
+  s0_prng_getbytes(prefix, sizeof(prefix));
+
+  out_magic(c, 'S', SPOR_SEGMENTED_VERSION);
+  s0_kdf_encode(buf, &kdf);
+  out_header(c, 'P', buf, sizeof(buf));
+  out_header(c, 'U', usalt, sizeof(usalt));
+  out_header(c, 'I', prefix, sizeof(prefix));
+  out_header(c, 'L', salt, sizeof(salt));
+  buf[0] = segsz >> 24;
+  buf[1] = segsz >> 16;
+  buf[2] = segsz >> 8;
+  buf[3] = segsz;
+  out_header(c, 'Z', buf, 4);
+
+  /* empty input is one empty segment, a full last one is not followed by one */
+  out_reserve(c, inlen + (inlen / SEGSZ + 1) * AEAD_TAGSZ);
+  do {
+    n = (inlen - off < SEGSZ) ? inlen - off : SEGSZ;
+    seg = c->out + c->outlen;
+    memcpy(seg, in + off, n);
+    off += n;
+    s0_seg_crypt(c->mkey, prefix, seg, n, idx++, off == inlen, 0);
+    c->outlen += n + AEAD_TAGSZ;
+  } while ( off < inlen );
+
+  return done(c, out, outlen);
+}
+
+
+/**
+ ** Decryption
+ **/
+
+static size_t lib_open(struct spor_ctx *c, unsigned char *p, const size_t len,
+                       const unsigned char *prefix, const unsigned long segsz) {
+  /* opens the segments in p, leaving their plaintext at its start */
+  size_t stride = segsz + AEAD_TAGSZ, pos = 0, plain = 0, n;
+  unsigned long long idx = 0;
+
+  do {
+    n = (len - pos < stride) ? len - pos : stride;
+    if ( n < AEAD_TAGSZ ) FAIL(c, SPOR_EFORMAT, "truncated stream");
+    n -= AEAD_TAGSZ;
+    if ( ! s0_seg_crypt(c->mkey, prefix, p + pos, n, idx++, pos + n + AEAD_TAGSZ == len, 1) )
+      FAIL(c, SPOR_EAUTH, "authentication failed");
+    memmove(p + plain, p + pos, n);
+    plain += n;
+    pos += n + AEAD_TAGSZ;
+  } while ( pos < len );
+  return plain;
+}
+
+static void lib_unpack(struct spor_ctx *c, const unsigned char *p, const size_t len,
+                       const unsigned long blocksz) {
+  /* the frames of a compressed payload, decompressed to the output */
+  unsigned long word;
+  size_t pos = 0, need;
+  long n;
+
+  while ( pos < len ) {
+    if ( len - pos < CFRAMESZ ) FAIL(c, SPOR_EFORMAT, "truncated compressed stream");
+    word = (unsigned long)p[pos] << 24 | p[pos+1] << 16 | p[pos+2] << 8 | p[pos+3];
+    pos += CFRAMESZ;
+    need = word & 0x7fffffffUL;
+    if ( ! need || need > blocksz || need > len - pos ) FAIL(c, SPOR_EFORMAT, "bad compressed frame");
+    out_reserve(c, blocksz);
+    if ( word & 0x80000000UL ) {
+      memcpy(c->out + c->outlen, p + pos, need);
+      n = need;
+    } else if ( (n=lz_decompress(p + pos, need, c->out + c->outlen, blocksz)) < 0 ) {
+      FAIL(c, SPOR_EFORMAT, "corrupt compressed block");
+    }
+    c->outlen += n;
+    pos += need;
+  }
+}
+
+int spor_decrypt(struct spor_ctx *c, const unsigned char *in, const size_t inlen,
+                 unsigned char **out, size_t *outlen) {
+  /* an 'S' packet, in either format, compressed or not */
+  unsigned char iv[KEYSZ_SYM], salt[SALTSZ], usalt[SALTSZ], hdr[5], *p;
+  struct ibuf r = { in, inlen, 0 };
+  struct s0_kdf kdf;
+  unsigned version, ivsz, sub = 0;
+  unsigned long blocksz = 0, segsz = 0;
+  size_t len;
+
+  if ( ! c || (! in && inlen) || ! out || ! outlen ) return SPOR_EINVAL;
+  TRY(c);
+  c->code = SPOR_EFORMAT;
+  version = in_magic(c, &r, 'S');
+  in_kdf(c, &r, &kdf);
+  if ( in_peek(&r) == 'C' ) {
+    if ( in_header(c, &r, 'C', hdr, sizeof(hdr)) != sizeof(hdr) || hdr[0] != COMPRESS_LZ )
+      FAIL(c, SPOR_EFORMAT, "bad compression header");
+    blocksz = (unsigned long)hdr[1] << 24 | hdr[2] << 16 | hdr[3] << 8 | hdr[4];
+    if ( ! blocksz || blocksz > MAX_CBLOCKSZ ) FAIL(c, SPOR_EFORMAT, "bad compression block size");
+  }
+  if ( in_peek(&r) == 'U' ) {
+    if ( in_header(c, &r, 'U', usalt, sizeof(usalt)) != sizeof(usalt) ) FAIL(c, SPOR_EFORMAT, "bad key salt header");
+    sub = 1;
+  }
+  ivsz = in_header(c, &r, 'I', iv, sizeof(iv));
+  if ( in_header(c, &r, 'L', salt, sizeof(salt)) != sizeof(salt) ) FAIL(c, SPOR_EFORMAT, "bad salt header");
+  if ( version == SPOR_SEGMENTED_VERSION ) {
+    if ( ivsz != NONCE_PREFIXSZ ) FAIL(c, SPOR_EFORMAT, "bad nonce header");
+    segsz = in_word(c, &r, 'Z');
+    if ( ! segsz || segsz > MAX_SEGSZ ) FAIL(c, SPOR_EFORMAT, "bad segment size");
+  } else if ( ivsz != KEYSZ_SYM ) {
+    FAIL(c, SPOR_EFORMAT, "bad iv header");
+  }
+  c->code = SPOR_EFAIL;
+  lib_key(c, salt, &kdf);
+  if ( sub ) {
+    s0_subkey(c->key, usalt, c->mkey);
+  } else {
+    memcpy(c->mkey, c->key, sizeof(c->mkey));
+  }
+
+  /* uncompressed plaintext is made in the output, compressed in tmp */
+  len = inlen - r.pos;
+  if ( blocksz ) {
+    c->tmp = p = lib_alloc(c, len);
+    c->tmpsz = len;
+  } else {
+    out_reserve(c, len);
+    p = c->out;
+  }
+  memcpy(p, in + r.pos, len);
+  if ( version == SPOR_SEGMENTED_VERSION ) {
+    len = lib_open(c, p, len, iv, segsz);
+  } else {
+    s0_ctr_crypt(c->mkey, iv, p, len, 0);
+  }
+  if ( blocksz ) {
+    lib_unpack(c, p, len, blocksz);
+  } else {
+    c->outlen = len;
+  }
+  return done(c, out, outlen);
+}
+
+
+/**
+ ** Signatures
+ **/
+
+static void lib_hash(const unsigned char *in, const size_t inlen, unsigned char *hash,
+                     const unsigned sz) {
+  struct s0_digest *d = s0_digest_new();
+  s0_digest_update(d, in, inlen);
+  s0_digest_done(d, hash, sz);
+}
+
+int spor_sign(struct spor_ctx *c, const unsigned char *in, const size_t inlen,
+              unsigned char **sig, size_t *siglen) {
+  /* a 'G' packet, as 'g' writes */
+  unsigned char hash[LIB_HASHSZ], buf[BUFSZ], t;
+  unsigned long sigsz = sizeof(buf);
+  unsigned hsz = s0_hash_size();
+
+  if ( ! c || (! in && inlen) || ! sig || ! siglen ) return SPOR_EINVAL;
+  TRY(c);
+  if ( ! c->akey ) FAIL(c, SPOR_EINVAL, "no key loaded");
+  lib_hash(in, inlen, hash, hsz);
+  s0_asym_sign(c->akey, hash, hsz, buf, &sigsz);
+
+  out_magic(c, 'G', SPOR_ONDISK_VERSION);
+  if ( (t=s0_asym_type(c->akey)) != ASYM_P521 ) out_header(c, 'T', &t, 1);
+  out_put(c, buf, sigsz);
+  return done(c, sig, siglen);
+}
+
+int spor_verify(struct spor_ctx *c, const unsigned char *in, const size_t inlen,
+                const unsigned char *sig, const size_t siglen) {
+  /* SPOR_OK for a good signature, SPOR_EAUTH for a bad one */
+  unsigned char hash[LIB_HASHSZ];
+  struct ibuf r = { sig, siglen, 0 };
+  unsigned hsz = s0_hash_size();
+
+  if ( ! c || (! in && inlen) || ! sig ) return SPOR_EINVAL;
+  TRY(c);
+  if ( ! c->akey ) FAIL(c, SPOR_EINVAL, "no key loaded");
+  c->code = SPOR_EFORMAT;
+  in_magic(c, &r, 'G');
+  if ( in_peek(&r) == 'M' ) FAIL(c, SPOR_EFORMAT, "signature is of a tree hash");
+  if ( in_type(c, &r) != s0_asym_type(c->akey) ) FAIL(c, SPOR_EFORMAT, "signature is not for this key type");
+  if ( siglen - r.pos > BUFSZ ) FAIL(c, SPOR_EFORMAT, "signature too long");
+  c->code = SPOR_EFAIL;
+
+  lib_hash(in, inlen, hash, hsz);
+  if ( ! s0_asym_verify(c->akey, hash, hsz, sig + r.pos, siglen - r.pos) )
+    FAIL(c, SPOR_EAUTH, "verification failed");
+  return done(c, NULL, NULL);
+}
@@ -0,0 +1,83 @@
+/*
+ * spor/libspor.h
+ * spor in-process: buffers in, buffers out, error codes back
+ *
+ * all state lives in a struct spor_ctx.  a context is used by one
+ * thread at a time; any number of contexts may be used at once from
+ * different threads.  nothing here exits or touches a descriptor.
+ * buffers handed back are the caller's, to release with spor_free.
+ *
+ * spor_verify tables a key it sees often; the tables are built on
+ * curve constants shared by all contexts, for the first ECC curve
+ * verified (P-521 for any key spor made).  keys on another curve are
+ * verified without tables.
+ */
+#ifndef SPOR_LIBSPOR_H
+#define SPOR_LIBSPOR_H
+
+#include <stddef.h>
+
+#define SPOR_OK         0
+#define SPOR_EINVAL     -1     /* bad argument, or nothing set to do it with */
+#define SPOR_EFORMAT    -2     /* not a packet we can read */
+#define SPOR_EAUTH      -3     /* wrong password, tampered data or bad signature */
+#define SPOR_ENOMEM     -4
+#define SPOR_EFAIL      -5     /* anything else; see spor_error */
+
+struct spor_ctx;
+
+struct spor_ctx *spor_ctx_new(void);
+void spor_ctx_free(
+  struct spor_ctx *ctx
+);
+const char *spor_error(
+  struct spor_ctx *ctx
+);
+
+int spor_set_password(
+  struct spor_ctx *ctx,
+  const unsigned char *pw,
+  const size_t len
+);
+int spor_load_key(
+  struct spor_ctx *ctx,
+  const unsigned char *buf,
+  const size_t len
+);
+
+int spor_encrypt(
+  struct spor_ctx *ctx,
+  const unsigned char *in,
+  const size_t inlen,
+  unsigned char **out,
+  size_t *outlen
+);
+int spor_decrypt(
+  struct spor_ctx *ctx,
+  const unsigned char *in,
+  const size_t inlen,
+  unsigned char **out,
+  size_t *outlen
+);
+
+int spor_sign(
+  struct spor_ctx *ctx,
+  const unsigned char *in,
+  const size_t inlen,
+  unsigned char **sig,
+  size_t *siglen
+);
+int spor_verify(
+  struct spor_ctx *ctx,
+  const unsigned char *in,
+  const size_t inlen,
+  const unsigned char *sig,
+  const size_t siglen
+);
+
+void spor_free(
+  unsigned char *buf,
+  const size_t len
+);
+
+#endif
@@ -0,0 +1,171 @@
+/**
+ ** libtest.c
+ ** spor-libtest: libspor driven from the shell, for test.sh
+ **
+ ** one call on stdin, its output (if any) to stdout, and the call's
+ ** error code, negated, as the exit status: so files made by the
+ ** library can be checked by spor and the other way round.
+ **/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libspor.h"
+#include "pbkdf.h"
+
+#define EXE "spor-libtest"
+#define LIBTEST_ROUNDS  8
+
+#define USAGE() \
+fprintf(stderr, "Usage: " EXE " pwfile e|d|g key|v key sig|t n key\n"\
+  "    e, d: encrypt, decrypt stdin with the password in pwfile\n"\
+  "    g, v: sign stdin, verify stdin against sig, with key ('B' or 'V')\n"\
+  "    t: n threads, a context each, encrypting and decrypting stdin,\n"\
+  "       and signing and verifying it with key ('V')\n"\
+  "    SPOR_KDF: as for spor\n"\
+),exit(1)
+
+static unsigned char *slurp(const char *path, size_t *len) {
+  /* all of a file, or stdin for NULL */
+  unsigned char *buf = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  int fd = path ? open(path, O_RDONLY) : 0;
+
+  if ( fd < 0 ) {
+    perror(path);
+    exit(1);
+  }
+  *len = 0;
+  do {
+    if ( cap - *len < 65536 && ! (buf=realloc(buf, cap = cap*2 + 65536)) ) exit(1);
+    if ( (n=read(fd, buf + *len, cap - *len)) < 0 ) exit(1);
+    *len += n;
+  } while ( n );
+  if ( path ) close(fd);
+  return buf;
+}
+
+static int check(struct spor_ctx *ctx, const int ret) {
+  if ( ret != SPOR_OK ) {
+    fprintf(stderr, EXE ": %d %s\n", ret, spor_error(ctx));
+    exit(-ret);
+  }
+  return ret;
+}
+
+struct job {
+  const unsigned char *pw, *in, *key;
+  size_t pwsz, insz, keysz;
+  int bad;
+};
+
+static void *round_trip(void *arg) {
+  struct job *j = arg;
+  struct spor_ctx *ctx;
+  unsigned char *s0, *out, *sig;
+  size_t s0sz, outsz, sigsz;
+  int i;
+
+  if ( ! (ctx=spor_ctx_new()) || spor_set_password(ctx, j->pw, j->pwsz)
+       || spor_load_key(ctx, j->key, j->keysz) ) {
+    j->bad++;
+    return NULL;
+  }
+  for ( i=0; i<LIBTEST_ROUNDS; i++ ) {
+    if ( spor_encrypt(ctx, j->in, j->insz, &s0, &s0sz) ) {
+      j->bad++;
+      continue;
+    }
+    if ( spor_decrypt(ctx, s0, s0sz, &out, &outsz) ) {
+      j->bad++;
+    } else {
+      if ( outsz != j->insz || memcmp(out, j->in, outsz) ) j->bad++;
+      spor_free(out, outsz);
+    }
+    spor_free(s0, s0sz);
+    if ( spor_sign(ctx, j->in, j->insz, &sig, &sigsz) ) {
+      j->bad++;
+      continue;
+    }
+    if ( spor_verify(ctx, j->in, j->insz, sig, sigsz) ) j->bad++;
+    spor_free(sig, sigsz);
+  }
+  spor_ctx_free(ctx);
+  return NULL;
+}
+
+static int threads(const unsigned char *pw, const size_t pwsz,
+                   const unsigned char *in, const size_t insz,
+                   const unsigned char *key, const size_t keysz, const int n) {
+  pthread_t tid[n];
+  struct job jobs[n];
+  int i, bad = 0;
+
+  for ( i=0; i<n; i++ ) {
+    jobs[i] = (struct job){ pw, in, key, pwsz, insz, keysz, 0 };
+    if ( pthread_create(&tid[i], NULL, round_trip, &jobs[i]) ) exit(1);
+  }
+  for ( i=0; i<n; i++ ) {
+    pthread_join(tid[i], NULL);
+    bad += jobs[i].bad;
+  }
+  if ( bad ) fprintf(stderr, EXE ": %d round trips failed\n", bad);
+  return bad != 0;
+}
+
+int main(int argc, char **argv) {
+  struct spor_ctx *ctx;
+  unsigned char *pw, *in, *key, *sig, *out = NULL;
+  size_t pwsz, insz, keysz, sigsz, outsz = 0;
+  struct s0_kdf kdf;
+  char *env;
+
+  if ( argc < 3 || strlen(argv[2]) != 1 ) USAGE();
+  if ( (env=getenv("SPOR_KDF")) ) {
+    /* before any context, so no derivation sees it change */
+    if ( ! s0_kdf_parse(env, &kdf) ) USAGE();
+    s0_set_kdf(&kdf);
+  }
+  pw = slurp(argv[1], &pwsz);
+  in = slurp(NULL, &insz);
+  if ( argv[2][0] == 't' ) {
+    if ( argc != 5 || atoi(argv[3]) < 1 ) USAGE();
+    key = slurp(argv[4], &keysz);
+    return threads(pw, pwsz, in, insz, key, keysz, atoi(argv[3]));
+  }
+
+  if ( ! (ctx=spor_ctx_new()) ) return 1;
+  check(ctx, spor_set_password(ctx, pw, pwsz));
+  switch ( argv[2][0] ) {
+  case 'e':
+    check(ctx, spor_encrypt(ctx, in, insz, &out, &outsz));
+    break;
+  case 'd':
+    check(ctx, spor_decrypt(ctx, in, insz, &out, &outsz));
+    break;
+  case 'g':
+    if ( argc != 4 ) USAGE();
+    key = slurp(argv[3], &keysz);
+    check(ctx, spor_load_key(ctx, key, keysz));
+    check(ctx, spor_sign(ctx, in, insz, &out, &outsz));
+    break;
+  case 'v':
+    if ( argc != 5 ) USAGE();
+    key = slurp(argv[3], &keysz);
+    sig = slurp(argv[4], &sigsz);
+    check(ctx, spor_load_key(ctx, key, keysz));
+    check(ctx, spor_verify(ctx, in, insz, sig, sigsz));
+    break;
+  default:
+    USAGE();
+  }
+  if ( out && write(1, out, outsz) != (ssize_t)outsz ) return 1;
+  spor_free(out, outsz);
+  spor_ctx_free(ctx);
+  return 0;
+}
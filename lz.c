@@ -0,0 +1,158 @@
+/*
+ * spor/lz.c
+ * LZ4 block format compression
+ *
+ * a block is a run of sequences: a token (literal count in the high
+ * nibble, match length - 4 in the low one, 15 meaning more in the
+ * following bytes), the literals, and a 2 byte little-endian offset
+ * back into the output.  the last sequence is literals only.  the
+ * compressor is greedy with a single hash probe, as LZ4's fast mode;
+ * the decompressor checks every length and offset against both
+ * buffers, as the input may not be authenticated.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MINMATCH   4
+#define LZ_LASTLITS   5       /* the last bytes are always literals */
+#define LZ_MFLIMIT    12      /* and no match starts closer to the end */
+#define LZ_MAXDIST    65535
+#define LZ_HASHLOG    12
+#define LZ_SKIPTRIGGER 6      /* probe sparser the longer nothing matches */
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned hash(const uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+static unsigned char *put_len(unsigned char *op, size_t len) {
+  for ( ; len >= 255; len -= 255 ) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+static unsigned char *put_seq(unsigned char *op, const unsigned char *lits,
+                              const size_t nlits, const size_t off, const size_t mlen) {
+  /* mlen 0 for the closing literals */
+  unsigned char *token = op++;
+
+  if ( nlits >= 15 ) {
+    *token = 15 << 4;
+    op = put_len(op, nlits - 15);
+  } else {
+    *token = nlits << 4;
+  }
+  memcpy(op, lits, nlits);
+  op += nlits;
+  if ( ! mlen ) return op;
+
+  *op++ = off;
+  *op++ = off >> 8;
+  if ( mlen - LZ_MINMATCH >= 15 ) {
+    *token |= 15;
+    op = put_len(op, mlen - LZ_MINMATCH - 15);
+  } else {
+    *token |= mlen - LZ_MINMATCH;
+  }
+  return op;
+}
+
+size_t lz_compress(const unsigned char *in, const size_t n,
+                   unsigned char *out, const size_t cap) {
+  /* returns the compressed size, 0 if it would exceed cap */
+  uint32_t table[1 << LZ_HASHLOG];
+  const unsigned char *ip = in, *anchor = in, *end = in + n, *ref;
+  unsigned char *op = out;
+  size_t nlits, mlen, left;
+  unsigned h;
+
+  memset(table, 0, sizeof(table));
+  while ( n >= LZ_MFLIMIT && ip <= end - LZ_MFLIMIT ) {
+    h = hash(read32(ip));
+    ref = in + table[h];
+    table[h] = ip - in;
+    if ( ref >= ip || ip - ref > LZ_MAXDIST || read32(ref) != read32(ip) ) {
+      ip += 1 + ((ip - anchor) >> LZ_SKIPTRIGGER);
+      continue;
+    }
+
+    /* extend the match both ways, short of the closing literals */
+    while ( ip > anchor && ref > in && ip[-1] == ref[-1] ) {
+      ip--;
+      ref--;
+    }
+    mlen = LZ_MINMATCH;
+    while ( ip + mlen < end - LZ_LASTLITS && ip[mlen] == ref[mlen] ) mlen++;
+
+    nlits = ip - anchor;
+    left = cap - (op - out);
+    if ( left < nlits + nlits/255 + mlen/255 + 5 ) return 0;
+    op = put_seq(op, anchor, nlits, ip - ref, mlen);
+    ip += mlen;
+    anchor = ip;
+  }
+
+  nlits = end - anchor;
+  left = cap - (op - out);
+  if ( left < nlits + nlits/255 + 2 ) return 0;
+  op = put_seq(op, anchor, nlits, 0, 0);
+  return op - out;
+}
+
+static int get_len(const unsigned char **ipp, const unsigned char *end, size_t *len) {
+  unsigned char b;
+  do {
+    if ( *ipp >= end ) return 0;
+    b = *(*ipp)++;
+    *len += b;
+  } while ( b == 255 );
+  return 1;
+}
+
+long lz_decompress(const unsigned char *in, const size_t n,
+                   unsigned char *out, const size_t cap) {
+  /* returns the decompressed size, -1 if the block is malformed or
+   * would exceed cap */
+  const unsigned char *ip = in, *end = in + n, *ref;
+  unsigned char *op = out, *oend = out + cap;
+  size_t nlits, mlen, off, i;
+  unsigned token;
+
+  while ( ip < end ) {
+    token = *ip++;
+    nlits = token >> 4;
+    if ( nlits == 15 && ! get_len(&ip, end, &nlits) ) return -1;
+    if ( nlits > (size_t)(end - ip) || nlits > (size_t)(oend - op) ) return -1;
+    memcpy(op, ip, nlits);
+    ip += nlits;
+    op += nlits;
+    if ( ip == end ) break;
+
+    if ( end - ip < 2 ) return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if ( ! off || off > (size_t)(op - out) ) return -1;
+    mlen = token & 15;
+    if ( mlen == 15 && ! get_len(&ip, end, &mlen) ) return -1;
+    mlen += LZ_MINMATCH;
+    if ( mlen > (size_t)(oend - op) ) return -1;
+
+    /* an overlapping match repeats its last off bytes */
+    ref = op - off;
+    if ( off >= mlen ) {
+      memcpy(op, ref, mlen);
+    } else {
+      for ( i=0; i<mlen; i++ ) op[i] = ref[i];
+    }
+    op += mlen;
+  }
+  return op - out;
+}
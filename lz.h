@@ -0,0 +1,23 @@
+/*
+ * spor/lz.h
+ * LZ4 block format compression
+ */
+#ifndef SPOR_LZ_H
+#define SPOR_LZ_H
+
+#include <stddef.h>
+
+size_t lz_compress(
+  const unsigned char *in,
+  const size_t n,
+  unsigned char *out,
+  const size_t cap
+);
+long lz_decompress(
+  const unsigned char *in,
+  const size_t n,
+  unsigned char *out,
+  const size_t cap
+);
+
+#endif
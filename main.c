@@ -4,22 +4,35 @@
  **/
 
 /* TODO
- * - an optional outfd for a passthru hash? 
  * - use varargs in macros
  */
 
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "bufio.h"
+#include "metrics.h"
+#include "pbkdf.h"
 #include "spor.h"
 #include "spor_ltc.h"
+#include "uring.h"
 #include "util.h"
 
 #define EXE "spor"
+#define MAXARGS 4
 #define PWPROMPT  "Password: "
 #define PWCONFIRM "Confirm Password: "
 
+#ifdef LTC_CURVE25519
+#define USAGE_25519 \
+  "    k, [25519]k: generate new asymmetric key (P-521, Ed25519/X25519)\n"
+#else
+#define USAGE_25519 \
+  "    k: generate new asymmetric key (P-521)\n"
+#endif
+
 #define USAGE() \
 fprintf(stderr, "Usage: " EXE " cmdstring\n"\
   "    [0,1,3-9]: set active file descriptor\n"\
@@ -27,10 +40,29 @@ fprintf(stderr, "Usage: " EXE " cmdstring\n"\
   "    i,o: set (input, output) to active file descriptor\n"\
   "    e,d: symmetric (encrypt,decrypt) input to output\n"\
   "    E,D: asymmetric (encrypt,decrypt) input to output\n"\
+  "    n,N: (symmetric,asymmetric) encrypt input onto the end of the format 1 stream on output\n"\
+  "    a: (e,E) write the authenticated, segmented format\n"\
+  "    z: (e,E) compress the plaintext before encrypting it\n"\
+  "    [n,m]: numeric arguments for the next command\n"\
+  "    [off,len]d, [off,len]D: decrypt only len bytes from plaintext offset off\n"\
+  "    [n]R: write n random bytes to output\n"\
+  "    [ms,MiB]c: pick KDF parameters taking ms (1000) and at most MiB, write them to output\n"\
   "    g,f: asymmetric (sign,verify) input, signature to active descriptor\n"\
+  "    T, [n]T: g signs a tree hash of its input, in n byte leaves (1 MiB)\n"\
+  "    [off,len]q: proof for bytes off..off+len of input, tree signature on active descriptor, to output\n"\
+  "    s: the next e,E also signs its plaintext, signature to active descriptor\n"\
+  "    t: the next d,D also verifies its plaintext with this key, signature on active descriptor\n"\
+  "    h,H: the next e,d,E,D also writes a digest of its (plaintext,ciphertext) to active descriptor\n"\
+  "    F: verify the list on input (lines of: path sigpath), status to output\n"\
   "    b,v: asymmetric key type is (public,private)\n"\
   "    m,x: assymetric key (import from, export to) active descriptor\n"\
-  "    k: generate new asymmetric key\n"\
+  USAGE_25519\
+  "    r: add the asymmetric key to the recipients of E\n"\
+  "    l: list the recipient key ids of the asymmetric message on input\n"\
+  "    Y: build a keyring from the public key files listed on input, to output\n"\
+  "    y: load the keyring on input; [id]K: take the public key with this id from it\n"\
+  "    u: use the private key held by spor-agent at $SPOR_AGENT for g,D\n"\
+  "    M: run the manifest on input (lines of: op inpath outpath), status to output\n"\
   "spaces are ignored, active descriptor is reset to stdin/out when accessed.\n"\
   "passwords are are reset when used (i.e with e,d,vm, or vx).\n"\
   "PP forces password confirmation prompt\n"\
@@ -38,6 +70,7 @@ fprintf(stderr, "Usage: " EXE " cmdstring\n"\
   "    " EXE " 'k b3x PPvx 4g' 3>publickey >privatekey <file 4>file.sig\n"\
   "    " EXE " 'Pvm 3i 4f' <privatekey 3<file 4<file.sig\n"\
   "    " EXE " 'Pvm PPvx' <privatekey >privatekey.newpassphrase\n"\
+  "    " EXE " '3bm r P4vm 5s E' 3<theirkey 4<privatekey <file >file.s0 5>file.sig\n"\
   "     cat pwdfile | " EXE " 'p 3i 4o e' 3<clear 4>cipher\n"\
 ),exit(1)
 
@@ -45,6 +78,7 @@ fprintf(stderr, "Usage: " EXE " cmdstring\n"\
 /* global password buffers */
 unsigned char pwbuf[BUFSZ], pwbuf2[BUFSZ];
 struct asymkey akey;
+struct asymkey signer;
 
 
 void cleanup_atexit(void) {
@@ -54,10 +88,12 @@ void cleanup_atexit(void) {
    * the minimum stack size jumps
    * explicitly zero our password buffers
    */
+  metrics_report();
   s0_teardown();
   zeromem(pwbuf, sizeof(pwbuf));
   zeromem(pwbuf2, sizeof(pwbuf2));
   zeromem(&akey, sizeof(akey));
+  zeromem(&signer, sizeof(signer));
   burn_stack(1024*4);
 }
 
@@ -72,7 +108,13 @@ void cleanup_atexit(void) {
 
 int main(int argc, char **argv) {
   int infd = 0, outfd = 1, nextfd = -1, savfd;
-  char *cmd;
+  char *cmd, *env, *end;
+  unsigned long long args[MAXARGS];
+  int nargs = 0;
+  struct s0_kdf kdf;
+  char kdfstr[64];
+  unsigned char keyid[KEYIDSZ];
+  double progress = 0;
 
   unsigned char *pwptr = NULL;
   char *pwprompt = PWPROMPT;
@@ -86,11 +128,37 @@ int main(int argc, char **argv) {
   s0_asym_setup(&akey);
   atexit(cleanup_atexit);
 
+  /* tunables */
+  if ( (env=getenv("SPOR_CHUNKSZ")) ) bufio_set_chunksz(strtoul(env, NULL, 0));
+  if ( (env=getenv("SPOR_THREADS")) ) s0_set_threads(strtoul(env, NULL, 0));
+  if ( (env=getenv("SPOR_HWACCEL")) ) s0_set_hwaccel(atoi(env));
+  if ( (env=getenv("SPOR_IOURING")) ) uring_set_enabled(atoi(env));
+  if ( (env=getenv("SPOR_JOBS")) ) s0_set_jobs(strtoul(env, NULL, 0));
+  if ( (env=getenv("SPOR_PROGRESS")) ) progress = strtod(env, NULL);
+  if ( (env=getenv("SPOR_METRICS")) ) metrics_open(atoi(env), progress);
+  if ( (env=getenv("SPOR_KDF")) ) {
+    if ( ! s0_kdf_parse(env, &kdf) ) DIE("bad SPOR_KDF");
+    s0_set_kdf(&kdf);
+  }
+
   for (int i=0; cmd[i]; i++) {
+    if ( isalpha(cmd[i]) ) metrics_begin(cmd[i]);
     switch ( cmd[i] ) {
     case ' ':              /* ignored for input readability */
       break;
 
+    case '[':              /* numeric arguments for the next command */
+      nargs = 0;
+      for ( i++; cmd[i] && cmd[i] != ']'; i++ ) {
+        if ( cmd[i] == ',' ) continue;
+        if ( nargs == MAXARGS ) DIE("too many arguments");
+        args[nargs++] = strtoull(cmd+i, &end, 0);
+        if ( end == cmd+i ) DIEC("bad argument", cmd[i]);
+        i = end - cmd - 1;
+      }
+      if ( ! cmd[i] ) DIE("unterminated argument list");
+      break;
+
     case 'p':              /* get passphrase from a file descriptor */
       pwsz = read_or_die(NEXTIN(), pwbuf, sizeof(pwbuf), "reading passphrase");
       CLOSEIN();
@@ -125,19 +193,66 @@ int main(int argc, char **argv) {
       pwsz=0;
       CLOSEIN(); CLOSEOUT();
       break;
-    case 'd':              /* decrypt */
-      s0_decrypt_stream(infd, outfd, pwbuf, pwsz);
+    case 'd':              /* decrypt, maybe a range */
+      if ( nargs ) {
+        s0_decrypt_range(infd, outfd, pwbuf, pwsz,
+                         args[0], (nargs > 1) ? args[1] : S0_TO_END);
+        nargs = 0;
+      } else {
+        s0_decrypt_stream(infd, outfd, pwbuf, pwsz);
+      }
       zeromem(pwbuf, pwsz);
       pwsz=0;
       CLOSEIN(); CLOSEOUT();
       break;
 
+    case 'n':              /* append to a stream */
+      s0_append_stream(infd, outfd, pwbuf, pwsz);
+      zeromem(pwbuf, pwsz);
+      pwsz=0;
+      CLOSEIN(); CLOSEOUT();
+      break;
+
+    case 'c':              /* calibrate the KDF: [ms,MiB] */
+      s0_kdf_calibrate(nargs ? args[0] : 1000, (nargs > 1) ? args[1] << 20 : 0, &kdf);
+      nargs = 0;
+      s0_set_kdf(&kdf);
+      s0_kdf_format(kdfstr, sizeof(kdfstr), &kdf);
+      dprintf(NEXTOUT(), "%s\n", kdfstr);
+      CLOSEOUT();
+      break;
+
+    case 'R':              /* random bytes: [n] */
+      if ( nargs != 1 ) DIE("no byte count");
+      s0_random_stream(NEXTOUT(), args[0]);
+      nargs = 0;
+      CLOSEOUT();
+      break;
+
+    case 'a':              /* authenticated segments for e,E */
+      s0_set_format(SPOR_SEGMENTED_VERSION);
+      break;
+    case 'z':              /* compress for e,E */
+      s0_set_compress(COMPRESS_LZ);
+      break;
+
     case 'E':
       s0_asym_encrypt_stream(&akey, infd, outfd);
       CLOSEIN(); CLOSEOUT();
       break;
     case 'D':
-      s0_asym_decrypt_stream(&akey, infd, outfd);
+      if ( nargs ) {
+        s0_asym_decrypt_range(&akey, infd, outfd,
+                              args[0], (nargs > 1) ? args[1] : S0_TO_END);
+        nargs = 0;
+      } else {
+        s0_asym_decrypt_stream(&akey, infd, outfd);
+      }
+      CLOSEIN(); CLOSEOUT();
+      break;
+
+    case 'N':              /* append to an asymmetric stream */
+      s0_asym_append_stream(&akey, infd, outfd);
       CLOSEIN(); CLOSEOUT();
       break;
 
@@ -156,6 +271,45 @@ int main(int argc, char **argv) {
       CLOSEIN();
       break;
 
+    case 'T':              /* tree hash signatures: [leafsz] */
+      s0_set_tree(nargs ? args[0] : TREE_LEAFSZ);
+      nargs = 0;
+      break;
+    case 'q':              /* proof for a range of a tree-signed input: [off,len] */
+      if ( ! nargs ) DIE("no range");
+      savfd = infd;
+      s0_prove_range(savfd, NEXTIN(), outfd, args[0], (nargs > 1) ? args[1] : S0_TO_END);
+      nargs = 0;
+      CLOSEIN(); CLOSEOUT();
+      break;
+
+    case 's':              /* sign the plaintext of the next e,E */
+      if ( nextfd < 0 ) DIEC("no descriptor given for", cmd[i]);
+      s0_sign_next(&akey, &signer, nextfd);
+      nextfd = -1;
+      break;
+    case 't':              /* verify the plaintext of the next d,D */
+      if ( nextfd < 0 ) DIEC("no descriptor given for", cmd[i]);
+      s0_check_next(&akey, &signer, nextfd);
+      nextfd = -1;
+      break;
+
+    case 'h':              /* digest the plaintext of the next stream */
+      if ( nextfd < 0 ) DIEC("no descriptor given for", cmd[i]);
+      s0_tee_next(S0_TEE_PLAIN, nextfd);
+      nextfd = -1;
+      break;
+    case 'H':              /* digest the ciphertext of the next stream */
+      if ( nextfd < 0 ) DIEC("no descriptor given for", cmd[i]);
+      s0_tee_next(S0_TEE_CIPHER, nextfd);
+      nextfd = -1;
+      break;
+
+    case 'F':              /* verify a list of signatures in batches */
+      s0_verify_list(&akey, infd, outfd);
+      CLOSEIN(); CLOSEOUT();
+      break;
+
     case 'b':
       pwptr=NULL;
       break;
@@ -179,8 +333,40 @@ int main(int argc, char **argv) {
       }
       CLOSEOUT();
       break;
-    case 'k':              /* generate asymmetric key */
-      s0_create_key(&akey);
+    case 'k':              /* generate asymmetric key: [521] or [25519] */
+      if ( nargs && args[0] != 521 && args[0] != 25519 ) DIE("bad key type");
+      s0_create_key(&akey, (nargs && args[0] == 25519) ? ASYM_25519 : ASYM_P521);
+      nargs = 0;
+      break;
+    case 'r':              /* encrypt to this key too */
+      s0_add_recipient(&akey);
+      break;
+    case 'l':              /* list the recipients of an asymmetric message */
+      s0_list_recipients(infd, NEXTOUT());
+      CLOSEIN(); CLOSEOUT();
+      break;
+    case 'Y':              /* keyring from a list of public keys */
+      s0_keyring_build(infd, outfd);
+      CLOSEIN(); CLOSEOUT();
+      break;
+    case 'y':              /* map a keyring */
+      s0_keyring_open(NEXTIN());
+      CLOSEIN();
+      break;
+    case 'K':              /* public key from the keyring: [id] */
+      if ( nargs != 1 ) DIE("no key id");
+      for ( int j=0; j<KEYIDSZ; j++ ) keyid[j] = args[0] >> (8 * (KEYIDSZ-1-j));
+      if ( ! s0_keyring_find(keyid, &akey) ) DIE("no such key in keyring");
+      nargs = 0;
+      break;
+    case 'M':              /* batch of e,d,E,D,g,f from a manifest */
+      s0_batch(&akey, infd, outfd, pwbuf, pwsz);
+      zeromem(pwbuf, pwsz);
+      pwsz=0;
+      CLOSEIN(); CLOSEOUT();
+      break;
+    case 'u':              /* sign and unwrap keys through the agent */
+      s0_use_agent(&akey, getenv("SPOR_AGENT"));
       break;
 
 
@@ -201,6 +387,9 @@ int main(int argc, char **argv) {
       fprintf(stderr, "bad cmd: %c\n", cmd[i]);
       USAGE();
     }
+    /* numbers are for the command right after them */
+    if ( isalpha(cmd[i]) && nargs ) DIEC("no numeric arguments for", cmd[i]);
+    if ( isalpha(cmd[i]) ) metrics_end();
   }
 
   exit(0);
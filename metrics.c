@@ -0,0 +1,213 @@
+/*
+ * spor/metrics.c
+ * per-command timings and I/O counts, for SPOR_METRICS
+ *
+ * the counters are cumulative for the process and updated atomically,
+ * as the pipeline's reader, workers and writer run at once; a
+ * command's figures are their difference across it.  time waiting on
+ * input and output is summed over threads, so with the two overlapped
+ * it can add up to more than the command took.  CPU time is counted
+ * for the KDF and key operations, which have the process to
+ * themselves, and for each command as a whole.
+ *
+ * a DIE in a worker exits with the other threads still counting, so
+ * the report takes the descriptor first: from then on they count and
+ * print nothing, and the report is of the counters as they stood.
+ */
+
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "util.h"
+
+struct counters {
+  unsigned long long in, out;           /* bytes */
+  unsigned long long reads, writes;     /* read(), write() calls */
+  unsigned long long enters;            /* io_uring_enter() calls */
+  unsigned long long wall[PH_N], cpu[PH_N];
+};
+
+struct command {
+  char cmd;
+  int done;
+  unsigned long long wall, cpu;
+  long maxrss;
+  struct counters c;
+};
+
+static int mfd = -1;
+static unsigned long long t0, interval, next;   /* ns */
+static struct counters total;
+static struct command *cmds;
+static unsigned ncmds;
+
+static const char *phases[PH_N] = { "kdf", "pk", "read", "write" };
+
+#define ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static unsigned long long ns(const clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long maxrss(void) {
+  /* KiB */
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static void snapshot(struct counters *c) {
+  unsigned i;
+  c->in = GET(total.in);
+  c->out = GET(total.out);
+  c->reads = GET(total.reads);
+  c->writes = GET(total.writes);
+  c->enters = GET(total.enters);
+  for ( i=0; i<PH_N; i++ ) {
+    c->wall[i] = GET(total.wall[i]);
+    c->cpu[i] = GET(total.cpu[i]);
+  }
+}
+
+void metrics_open(const int fd, const double progress) {
+  /* progress: seconds between progress lines, 0 for none */
+  mfd = fd;
+  t0 = ns(CLOCK_MONOTONIC);
+  interval = progress * 1e9;
+  next = t0 + interval;
+}
+
+void metrics_forget(void) {
+  /* a forked child leaves the reporting to its parent */
+  __atomic_store_n(&mfd, -1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ ** Commands
+ **/
+
+void metrics_begin(const char cmd) {
+  struct command *c;
+  if ( mfd < 0 ) return;
+  if ( ! (cmds=realloc(cmds, (ncmds+1) * sizeof(*cmds))) ) DIE("allocating metrics");
+  c = &cmds[ncmds++];
+  memset(c, 0, sizeof(*c));
+  c->cmd = cmd;
+  c->wall = ns(CLOCK_MONOTONIC);
+  c->cpu = ns(CLOCK_PROCESS_CPUTIME_ID);
+  snapshot(&c->c);
+}
+
+static void command_end(struct command *c) {
+  struct counters now;
+  unsigned i;
+
+  snapshot(&now);
+  c->wall = ns(CLOCK_MONOTONIC) - c->wall;
+  c->cpu = ns(CLOCK_PROCESS_CPUTIME_ID) - c->cpu;
+  c->maxrss = maxrss();
+  c->c.in = now.in - c->c.in;
+  c->c.out = now.out - c->c.out;
+  c->c.reads = now.reads - c->c.reads;
+  c->c.writes = now.writes - c->c.writes;
+  c->c.enters = now.enters - c->c.enters;
+  for ( i=0; i<PH_N; i++ ) {
+    c->c.wall[i] = now.wall[i] - c->c.wall[i];
+    c->c.cpu[i] = now.cpu[i] - c->c.cpu[i];
+  }
+}
+
+void metrics_end(void) {
+  if ( mfd < 0 || ! ncmds ) return;
+  command_end(&cmds[ncmds-1]);
+  cmds[ncmds-1].done = 1;
+}
+
+void metrics_report(void) {
+  /* one JSON line for the run; a command that died is not done */
+  int fd = __atomic_exchange_n(&mfd, -1, __ATOMIC_ACQ_REL);
+  struct command *c;
+  unsigned i, j;
+
+  if ( fd < 0 ) return;
+  if ( ncmds && ! cmds[ncmds-1].done ) command_end(&cmds[ncmds-1]);
+
+  dprintf(fd, "{\"wall\":%.6f,\"cpu\":%.6f,\"maxrss_kib\":%ld,\"commands\":[",
+          (ns(CLOCK_MONOTONIC) - t0) / 1e9, ns(CLOCK_PROCESS_CPUTIME_ID) / 1e9, maxrss());
+  for ( i=0; i<ncmds; i++ ) {
+    c = &cmds[i];
+    dprintf(fd, "%s{\"cmd\":\"%c\",\"done\":%s,\"wall\":%.6f,\"cpu\":%.6f,"
+            "\"in\":%llu,\"out\":%llu,\"reads\":%llu,\"writes\":%llu,\"uring_enters\":%llu,"
+            "\"maxrss_kib\":%ld",
+            i ? "," : "", c->cmd, c->done ? "true" : "false", c->wall / 1e9, c->cpu / 1e9,
+            c->c.in, c->c.out, c->c.reads, c->c.writes, c->c.enters, c->maxrss);
+    for ( j=0; j<PH_N; j++ ) {
+      dprintf(fd, ",\"%s\":{\"wall\":%.6f", phases[j], c->c.wall[j] / 1e9);
+      if ( j < PH_READ ) dprintf(fd, ",\"cpu\":%.6f", c->c.cpu[j] / 1e9);
+      dprintf(fd, "}");
+    }
+    dprintf(fd, "}");
+  }
+  dprintf(fd, "]}\n");
+  /* cmds is left to exit: a worker may still be looking at it */
+}
+
+
+/**
+ ** Counting
+ **/
+
+void metrics_start(const int phase, struct metrics_mark *m) {
+  if ( GET(mfd) < 0 ) return;
+  m->wall = ns(CLOCK_MONOTONIC);
+  if ( phase < PH_READ ) m->cpu = ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void metrics_stop(const int phase, struct metrics_mark *m) {
+  if ( GET(mfd) < 0 ) return;
+  ADD(total.wall[phase], ns(CLOCK_MONOTONIC) - m->wall);
+  if ( phase < PH_READ ) ADD(total.cpu[phase], ns(CLOCK_PROCESS_CPUTIME_ID) - m->cpu);
+}
+
+static void progress(void) {
+  /* whichever thread is first past the deadline writes the line */
+  unsigned long long now = ns(CLOCK_MONOTONIC), due = GET(next), in, out;
+  struct command *c;
+  double secs;
+  int fd;
+
+  if ( now < due || ! ncmds ) return;
+  if ( ! __atomic_compare_exchange_n(&next, &due, now + interval, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) return;
+  if ( (fd=GET(mfd)) < 0 ) return;
+  c = &cmds[ncmds-1];
+  secs = (now - c->wall) / 1e9;
+  in = GET(total.in) - c->c.in;
+  out = GET(total.out) - c->c.out;
+  dprintf(fd, "{\"progress\":\"%c\",\"secs\":%.3f,\"in\":%llu,\"out\":%llu,\"mbps\":%.1f}\n",
+          c->cmd, secs, in, out, ((in > out) ? in : out) / secs / 1e6);
+}
+
+void metrics_io(const int write, const size_t bytes, const unsigned calls) {
+  /* calls: read() or write() calls, none for io_uring completions */
+  if ( GET(mfd) < 0 ) return;
+  if ( write ) {
+    ADD(total.out, bytes);
+    ADD(total.writes, calls);
+  } else {
+    ADD(total.in, bytes);
+    ADD(total.reads, calls);
+  }
+  if ( interval ) progress();
+}
+
+void metrics_uring(void) {
+  if ( GET(mfd) < 0 ) return;
+  ADD(total.enters, 1);
+}
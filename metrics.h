@@ -0,0 +1,49 @@
+/*
+ * spor/metrics.h
+ * per-command timings and I/O counts, for SPOR_METRICS
+ */
+#ifndef SPOR_METRICS_H
+#define SPOR_METRICS_H
+
+#include <stddef.h>
+
+/* where a command's time goes */
+#define PH_KDF          0
+#define PH_PK           1     /* asymmetric key operations */
+#define PH_READ         2     /* waiting on input */
+#define PH_WRITE        3     /* waiting on output */
+#define PH_N            4
+
+struct metrics_mark {
+  unsigned long long wall, cpu;   /* ns */
+};
+
+void metrics_open(
+  const int fd,
+  const double progress
+);
+void metrics_forget(void);
+
+void metrics_begin(
+  const char cmd
+);
+void metrics_end(void);
+void metrics_report(void);
+
+void metrics_start(
+  const int phase,
+  struct metrics_mark *m
+);
+void metrics_stop(
+  const int phase,
+  struct metrics_mark *m
+);
+
+void metrics_io(
+  const int write,
+  const size_t bytes,
+  const unsigned calls
+);
+void metrics_uring(void);
+
+#endif
@@ -4,13 +4,66 @@
 #ifndef SPOR_PBKDF_H
 #define SPOR_PBKDF_H
 
+/* password KDF parameters, recorded in the 'P' header */
+struct s0_kdf {
+  unsigned variant;     /* KDF_ARGON2D, KDF_ARGON2I, KDF_ARGON2ID */
+  unsigned tcost;       /* passes */
+  unsigned mcost;       /* KiB */
+  unsigned lanes;
+};
+
+#define KDF_ARGON2D     0
+#define KDF_ARGON2I     1
+#define KDF_ARGON2ID    2
+#define KDF_HDRSZ       13    /* variant, then t, m, lanes 32 bits big endian each */
+
+/* the most a 'P' header may ask of us, and of s0_set_kdf */
+#define KDF_MAX_TCOST   1024
+#define KDF_MAX_MCOST   (1U<<22)  /* KiB (=4G) */
+
 void s0_derive_key (
   unsigned char *skey,
   unsigned ssz,
   unsigned char *pwbuf,
   const unsigned pwsz,
   unsigned char *salt,
-  const unsigned saltsz
+  const unsigned saltsz,
+  const struct s0_kdf *kdf
+);
+
+void s0_kdf_release(void);
+
+void s0_kdf_default(
+  struct s0_kdf *kdf
+);
+void s0_kdf_current(
+  struct s0_kdf *kdf
+);
+void s0_set_kdf(
+  const struct s0_kdf *kdf
+);
+int s0_kdf_parse(
+  const char *str,
+  struct s0_kdf *kdf
+);
+void s0_kdf_format(
+  char *buf,
+  const unsigned sz,
+  const struct s0_kdf *kdf
+);
+void s0_kdf_encode(
+  unsigned char *buf,
+  const struct s0_kdf *kdf
+);
+void s0_kdf_decode(
+  const unsigned char *buf,
+  const unsigned len,
+  struct s0_kdf *kdf
+);
+void s0_kdf_calibrate(
+  const unsigned target_ms,
+  unsigned long long maxmem,
+  struct s0_kdf *kdf
 );
 
 #endif
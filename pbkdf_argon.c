@@ -1,18 +1,288 @@
+#define _GNU_SOURCE          /* sched_getaffinity */
+
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <argon2.h>
 
+#include "metrics.h"
 #include "spor.h"
 #include "pbkdf.h"
+#include "util.h"
+
+
+#define DIEA(err, msg) die("%s: %s", msg, argon2_error_message(err))
+
+static const char *variants[] = { "argon2d", "argon2i", "argon2id" };
+
+static struct s0_kdf current = {
+  KDF_ARGON2D, ARGON_TCOST, ARGON_MCOST, ARGON_PARALLEL
+};
+
+
+/**
+ ** Host resources, cgroup aware
+ **/
+
+static int has_ctrl(const char *list, const size_t len, const char *ctrl) {
+  /* ctrl is one of the comma separated controllers in list[0,len) */
+  size_t n = strlen(ctrl);
+  const char *p = list, *end = list + len;
+
+  while ( p < end ) {
+    if ( (size_t)(end - p) >= n && ! strncmp(p, ctrl, n) && (p + n == end || p[n] == ',') ) return 1;
+    if ( ! (p=memchr(p, ',', end - p)) ) break;
+    p++;
+  }
+  return 0;
+}
+
+static int cgroup_read(const char *ctrl, const char *name, char *buf, unsigned sz) {
+  /* read a cgroup (v2, or v1 controller ctrl) file of our own group.
+   * v1 controllers may share a hierarchy, "cpu,cpuacct", mounted
+   * under that name */
+  char line[512], path[768], *p, *q;
+  FILE *f;
+  int n = 0;
+
+  if ( ! (f=fopen("/proc/self/cgroup", "r")) ) return 0;
+  while ( fgets(line, sizeof(line), f) ) {
+    line[strcspn(line, "\n")] = '\0';
+    if ( ! (p=strchr(line, ':')) || ! (q=strchr(p+1, ':')) ) continue;
+    if ( q == p+1 ) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/%s", q+1, name);
+    } else if ( has_ctrl(p+1, q - (p+1), ctrl) ) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup/%.*s%s/%s", (int)(q - (p+1)), p+1, q+1, name);
+    } else {
+      continue;
+    }
+    fclose(f);
+    if ( ! (f=fopen(path, "r")) ) return 0;
+    n = fgets(buf, sz, f) != NULL;
+    break;
+  }
+  fclose(f);
+  return n;
+}
+
+static unsigned ncpus(void) {
+  /* our affinity mask, capped by any cgroup CPU quota */
+  static unsigned n;
+  char buf[64];
+  long long quota, period;
+  cpu_set_t set;
+
+  if ( n ) return n;
+  n = sched_getaffinity(0, sizeof(set), &set) ? sysconf(_SC_NPROCESSORS_ONLN) : CPU_COUNT(&set);
+  if ( cgroup_read("cpu", "cpu.max", buf, sizeof(buf)) &&
+       sscanf(buf, "%lld %lld", &quota, &period) == 2 && period > 0 ) {
+    if ( quota / period < n ) n = quota / period;
+  } else if ( cgroup_read("cpu", "cpu.cfs_quota_us", buf, sizeof(buf)) &&
+              (quota=atoll(buf)) > 0 &&
+              cgroup_read("cpu", "cpu.cfs_period_us", buf, sizeof(buf)) &&
+              (period=atoll(buf)) > 0 ) {
+    if ( quota / period < n ) n = quota / period;
+  }
+  if ( n < 1 ) n = 1;
+  return n;
+}
+
+static unsigned long long memavail(void) {
+  /* physical memory, capped by what our cgroup has left */
+  unsigned long long avail, limit, used;
+  char buf[64];
+
+  avail = (unsigned long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  if ( cgroup_read("memory", "memory.max", buf, sizeof(buf)) ||
+       cgroup_read("memory", "memory.limit_in_bytes", buf, sizeof(buf)) ) {
+    if ( (limit=strtoull(buf, NULL, 10)) > 0 && limit < avail ) {
+      used = 0;
+      if ( cgroup_read("memory", "memory.current", buf, sizeof(buf)) ||
+           cgroup_read("memory", "memory.usage_in_bytes", buf, sizeof(buf)) )
+        used = strtoull(buf, NULL, 10);
+      avail = (used < limit) ? limit - used : 0;
+    }
+  }
+  return avail;
+}
+
+
+/**
+ ** Memory
+ **/
+
+/*
+ * every derivation would otherwise map and fault in its 256 MiB
+ * afresh, 4 KiB at a time.  instead argon2 gets one mapping, kept
+ * and reused for the rest of the process (grown if a derivation
+ * needs more): explicit hugepages if any are reserved, otherwise
+ * transparent ones, locked if RLIMIT_MEMLOCK allows so it never
+ * reaches swap.  argon2 wipes its memory before handing it back.
+ * a derivation that finds the arena taken maps its own for the once.
+ */
+
+#define HUGEPAGESZ      (2UL<<20)
+
+static struct {
+  uint8_t *mem;
+  size_t sz;
+  int busy;
+} arena;
+
+static uint8_t *arena_map(const size_t sz) {
+  /* sz is a whole number of hugepages */
+  unsigned char *p;
+  size_t head;
+
+  p = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  if ( p == MAP_FAILED ) {
+    /* transparent hugepages need the region hugepage aligned */
+    p = mmap(NULL, sz + HUGEPAGESZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if ( p == MAP_FAILED ) return NULL;
+    head = -(uintptr_t)p & (HUGEPAGESZ - 1);
+    if ( head ) munmap(p, head);
+    munmap(p + head + sz, HUGEPAGESZ - head);
+    p += head;
+    madvise(p, sz, MADV_HUGEPAGE);
+  }
+  madvise(p, sz, MADV_DONTDUMP);
+#ifdef MADV_WIPEONFORK
+  /* batch workers get zero pages rather than copies */
+  madvise(p, sz, MADV_WIPEONFORK);
+#endif
+  mlock(p, sz);
+  return p;
+}
+
+void s0_kdf_release(void) {
+  /* give the memory back, e.g. before a long-lived process settles */
+  if ( arena.busy ) DIE("releasing KDF memory in use");
+  if ( arena.mem ) munmap(arena.mem, arena.sz);
+  arena.mem = NULL;
+  arena.sz = 0;
+}
+
+static int arena_alloc(uint8_t **memory, size_t bytes) {
+  size_t sz = (bytes + HUGEPAGESZ - 1) & ~(HUGEPAGESZ - 1);
 
+  *memory = NULL;
+  if ( __atomic_exchange_n(&arena.busy, 1, __ATOMIC_ACQUIRE) ) {
+    /* another thread (libspor) is deriving: it gets a mapping of its own */
+    return (*memory=arena_map(sz)) ? 0 : -1;
+  }
+  if ( sz > arena.sz ) {
+    if ( arena.mem ) munmap(arena.mem, arena.sz);
+    arena.sz = 0;
+    if ( ! (arena.mem=arena_map(sz)) ) {
+      __atomic_store_n(&arena.busy, 0, __ATOMIC_RELEASE);
+      return -1;
+    }
+    arena.sz = sz;
+  }
+  *memory = arena.mem;
+  return 0;
+}
+
+static void arena_free(uint8_t *memory, size_t bytes) {
+  if ( memory != arena.mem ) {
+    munmap(memory, (bytes + HUGEPAGESZ - 1) & ~(HUGEPAGESZ - 1));
+    return;
+  }
+  __atomic_store_n(&arena.busy, 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ ** Parameters
+ **/
+
+void s0_kdf_default(struct s0_kdf *kdf) {
+  /* what streams without a 'P' header were made with */
+  kdf->variant = KDF_ARGON2D;
+  kdf->tcost = ARGON_TCOST;
+  kdf->mcost = ARGON_MCOST;
+  kdf->lanes = ARGON_PARALLEL;
+}
+
+void s0_kdf_current(struct s0_kdf *kdf) {
+  *kdf = current;
+}
+
+void s0_set_kdf(const struct s0_kdf *kdf) {
+  if ( kdf->variant > KDF_ARGON2ID ) DIE("bad KDF variant");
+  if ( ! kdf->tcost || ! kdf->lanes || kdf->lanes > 0xffffff ) DIE("bad KDF parameters");
+  if ( kdf->mcost < 8 * kdf->lanes ) DIE("KDF memory below 8 KiB per lane");
+  if ( kdf->tcost > KDF_MAX_TCOST || kdf->mcost > KDF_MAX_MCOST ) DIE("KDF parameters too large");
+  current = *kdf;
+}
+
+int s0_kdf_parse(const char *str, struct s0_kdf *kdf) {
+  /* "argon2id,t=3,m=65536,p=4"; returns 0 if malformed */
+  char name[16];
+  unsigned v;
+
+  if ( sscanf(str, "%15[^,],t=%u,m=%u,p=%u", name, &kdf->tcost, &kdf->mcost, &kdf->lanes) != 4 )
+    return 0;
+  for ( v=0; v<=KDF_ARGON2ID; v++ ) {
+    if ( ! strcmp(name, variants[v]) ) {
+      kdf->variant = v;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void s0_kdf_format(char *buf, const unsigned sz, const struct s0_kdf *kdf) {
+  snprintf(buf, sz, "%s,t=%u,m=%u,p=%u",
+           variants[kdf->variant], kdf->tcost, kdf->mcost, kdf->lanes);
+}
+
+static void put32(unsigned char *p, unsigned v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static unsigned get32(const unsigned char *p) {
+  return (unsigned)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void s0_kdf_encode(unsigned char *buf, const struct s0_kdf *kdf) {
+  buf[0] = kdf->variant;
+  put32(buf+1, kdf->tcost);
+  put32(buf+5, kdf->mcost);
+  put32(buf+9, kdf->lanes);
+}
 
-#define DIEA(err, msg) fprintf(stderr, "died %s: %s\n", msg, argon2_error_message(err)),exit(1)
+void s0_kdf_decode(const unsigned char *buf, const unsigned len, struct s0_kdf *kdf) {
+  if ( len != KDF_HDRSZ || buf[0] > KDF_ARGON2ID ) DIE("bad KDF header");
+  kdf->variant = buf[0];
+  kdf->tcost = get32(buf+1);
+  kdf->mcost = get32(buf+5);
+  kdf->lanes = get32(buf+9);
+  if ( ! kdf->tcost || ! kdf->lanes || kdf->mcost < 8 * kdf->lanes ) DIE("bad KDF header");
+  /* the header isn't authenticated: don't let it make us spin or swap */
+  if ( kdf->tcost > KDF_MAX_TCOST || kdf->mcost > KDF_MAX_MCOST ) DIE("KDF parameters too large");
+}
 
 
+/**
+ ** Derivation
+ **/
+
 void s0_derive_key (unsigned char *skey, unsigned ssz,
                     unsigned char *passphrase, const unsigned pwlen,
-                    unsigned char *salt, const unsigned saltlen) {
+                    unsigned char *salt, const unsigned saltlen,
+                    const struct s0_kdf *kdf) {
+  /* lanes are fixed by the parameters, threads by this host */
+  unsigned threads = (kdf->lanes < ncpus()) ? kdf->lanes : ncpus();
+  struct metrics_mark m;
   int err;
 
   argon2_context context = {
@@ -21,13 +291,48 @@ void s0_derive_key (unsigned char *skey, unsigned ssz,
     salt, saltlen,
     NULL, 0,        /* secret data */
     NULL, 0,        /* associated data */
-    ARGON_TCOST, ARGON_MCOST,
-    ARGON_PARALLEL, ARGON_PARALLEL,
+    kdf->tcost, kdf->mcost,
+    kdf->lanes, threads,
     ARGON2_VERSION_NUMBER,
-    NULL, NULL,     /* memory de/allocation */
+    arena_alloc, arena_free,
     ARGON2_DEFAULT_FLAGS
   };
 
-  if ( (err=argon2d_ctx(&context)) != ARGON2_OK ) DIEA(err, "hashing passphrase");
+  metrics_start(PH_KDF, &m);
+  if ( (err=argon2_ctx(&context, (argon2_type)kdf->variant)) != ARGON2_OK ) DIEA(err, "hashing passphrase");
+  metrics_stop(PH_KDF, &m);
+}
+
+static double time_kdf(const struct s0_kdf *kdf) {
+  /* milliseconds for one derivation */
+  unsigned char key[KEYSZ_SYM], pw[] = "calibrate", salt[SALTSZ] = { 0 };
+  struct timespec t0, t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  s0_derive_key(key, sizeof(key), pw, sizeof(pw), salt, sizeof(salt), kdf);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
 }
 
+void s0_kdf_calibrate(const unsigned target_ms, unsigned long long maxmem,
+                      struct s0_kdf *kdf) {
+  /* argon2id with a lane per usable CPU and as much memory as the
+   * ceiling allows (at most half of what is available), shrunk until
+   * one pass fits the target, then as many passes as fit */
+  unsigned long long avail = memavail() / 2;
+  double ms;
+
+  if ( ! maxmem || maxmem > avail ) maxmem = avail;
+  kdf->variant = KDF_ARGON2ID;
+  kdf->lanes = ncpus();
+  kdf->tcost = 1;
+  kdf->mcost = ARGON_MCOST;
+  while ( (unsigned long long)kdf->mcost * 1024 < maxmem && kdf->mcost < KDF_MAX_MCOST ) kdf->mcost *= 2;
+  while ( (unsigned long long)kdf->mcost * 1024 > maxmem && kdf->mcost > 8 * kdf->lanes ) kdf->mcost /= 2;
+  if ( kdf->mcost < 8 * kdf->lanes ) DIE("not enough memory for the KDF");
+
+  while ( (ms=time_kdf(kdf)) > target_ms && kdf->mcost / 2 >= 8 * kdf->lanes ) kdf->mcost /= 2;
+  if ( ms < 1 ) ms = 1;
+  kdf->tcost = (target_ms / ms < KDF_MAX_TCOST) ? target_ms / ms : KDF_MAX_TCOST;
+  if ( kdf->tcost < 1 ) kdf->tcost = 1;
+}
@@ -0,0 +1,556 @@
+/*
+ * spor/pipeline.c
+ * overlapped read -> transform -> write stream engine
+ *
+ * a reader thread fills a ring of slots, worker threads transform
+ * them in any order, and the calling thread drains them in stream
+ * order.  the ring bounds memory and provides the backpressure: the
+ * reader blocks when every slot is full, the writer when the next
+ * slot isn't done.  with disk and CPU overlapped, a stream runs at
+ * the speed of the slower of the two rather than their sum.
+ *
+ * regular files go through io_uring when the kernel allows it: the
+ * input size is known up front, so the reader can queue reads for
+ * every free slot at once, and the writer queues a slot's writes and
+ * moves on, freeing the slot when they complete.  pipes, terminals,
+ * O_APPEND outputs and kernels without io_uring use read()/write().
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "pipeline.h"
+#include "uring.h"
+#include "util.h"
+
+#define SLOT_FREE    0
+#define SLOT_FILLED  1
+#define SLOT_BUSY    2
+#define SLOT_DONE    3
+#define SLOT_READING 4       /* reads queued on the ring */
+
+#define URING_MINDEPTH  64
+#define URING_MAXDEPTH  4096
+
+struct ring {
+  struct pipeline *p;
+  struct pipe_slot *slot;
+  unsigned nslots;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned long long nwork;   /* next slot for the workers */
+  unsigned long long ntap;    /* next slot for the input tap */
+  unsigned long long end;     /* slots in the stream, once known */
+
+  struct uring rio, wio;      /* fd < 0 if not in use */
+  unsigned *pend;             /* I/Os in flight per slot */
+  size_t *dirty;              /* bytes of each slot ever used */
+  unsigned maxio;             /* most I/Os one slot needs */
+  unsigned long long fbase;   /* input file offset of stream byte 0 */
+  unsigned long long size;    /* input bytes */
+  unsigned long long wbase;   /* output file offset of the first byte */
+};
+
+static void publish(struct ring *ring, struct pipe_slot *s, int state) {
+  pthread_mutex_lock(&ring->lock);
+  s->state = state;
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+static int slot_free(struct ring *ring, struct pipe_slot *s) {
+  int free;
+  pthread_mutex_lock(&ring->lock);
+  free = s->state == SLOT_FREE;
+  pthread_mutex_unlock(&ring->lock);
+  return free;
+}
+
+static void wait_free(struct ring *ring, struct pipe_slot *s) {
+  pthread_mutex_lock(&ring->lock);
+  while ( s->state != SLOT_FREE ) pthread_cond_wait(&ring->cond, &ring->lock);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+static void touch(struct ring *ring, struct pipe_slot *s) {
+  /* only the cells a slot has held need wiping at the end */
+  size_t used = s->n * ring->p->stride, *d = &ring->dirty[s - ring->slot];
+  if ( used > *d ) *d = used;
+}
+
+static void tap(struct bufio *b, struct pipeline *p, struct pipe_slot *s,
+                const size_t *len, unsigned n) {
+  /* what b would have seen, for cells that went around it */
+  unsigned i;
+  for ( i=0; i<n; i++ ) b->tap(b->tapctx, s->buf + i*p->stride, len[i]);
+}
+
+static void tap_unworked(struct ring *ring, struct pipe_slot *s) {
+  /* with no workers to tap io_uring input, the writer does, in order */
+  struct pipeline *p = ring->p;
+  if ( ! p->work && ring->rio.fd >= 0 && p->r->tap ) tap(p->r, p, s, s->inlen, s->n);
+}
+
+static void fail(struct pipeline *p, struct pipe_slot *s) {
+  DIED("authentication failed in segment", (int)(s->seq*p->units + s->bad));
+}
+
+
+/**
+ ** Blocking I/O
+ **/
+
+static void make_up(struct pipeline *p, struct pipe_slot *s) {
+  /* size the next cells of a generated stream */
+  unsigned long long at = s->seq * p->units * p->unit, left;
+  size_t len;
+  s->n = 0;
+  s->last = 0;
+  while ( s->n < p->units && ! s->last ) {
+    left = (at < p->size) ? p->size - at : 0;
+    len = (left < p->unit) ? left : p->unit;
+    s->inlen[s->n] = s->outlen[s->n] = len;
+    s->n++;
+    s->last = left <= p->unit;
+    at += len;
+  }
+  s->bad = s->n;
+}
+
+static void fill(struct pipeline *p, struct pipe_slot *s) {
+  /* read cells until the slot is full or the input ends */
+  size_t len;
+  s->n = 0;
+  s->last = 0;
+  while ( s->n < p->units && ! s->last ) {
+    len = bufio_read(p->r, s->buf + s->n*p->stride, p->unit, "reading");
+    s->inlen[s->n] = s->outlen[s->n] = len;
+    s->n++;
+    s->last = len < p->unit || bufio_peek(p->r, "reading") < 0;
+  }
+  s->bad = s->n;
+}
+
+static void read_blocking(struct ring *ring) {
+  struct pipe_slot *s;
+  unsigned long long seq;
+  int last = 0;
+
+  for ( seq=0; ! last; seq++ ) {
+    s = &ring->slot[seq % ring->nslots];
+    wait_free(ring, s);
+
+    s->seq = seq;
+    if ( ring->p->r ) {
+      fill(ring->p, s);
+    } else {
+      make_up(ring->p, s);
+    }
+    touch(ring, s);
+    last = s->last;
+
+    pthread_mutex_lock(&ring->lock);
+    s->state = ring->p->work ? SLOT_FILLED : SLOT_DONE;
+    if ( last ) ring->end = seq + 1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+static void drain(struct pipeline *p, struct pipe_slot *s) {
+  unsigned i;
+  if ( p->sink ) {
+    p->sink(p->ctx, s);
+  } else {
+    for ( i=0; i<s->bad; i++ )
+      bufio_write(p->w, s->buf + i*p->stride, s->outlen[i], "writing");
+  }
+  if ( s->bad < s->n ) {
+    if ( ! p->sink ) bufio_flush(p->w, "writing");
+    fail(p, s);
+  }
+}
+
+static void write_blocking(struct ring *ring) {
+  struct pipe_slot *s;
+  unsigned long long seq;
+  int last = 0;
+
+  for ( seq=0; ! last; seq++ ) {
+    s = &ring->slot[seq % ring->nslots];
+    pthread_mutex_lock(&ring->lock);
+    while ( s->state != SLOT_DONE || s->seq != seq ) pthread_cond_wait(&ring->cond, &ring->lock);
+    pthread_mutex_unlock(&ring->lock);
+
+    tap_unworked(ring, s);
+    drain(ring->p, s);
+    last = s->last;
+    publish(ring, s, SLOT_FREE);
+  }
+  if ( ! ring->p->sink ) bufio_flush(ring->p->w, "writing");
+}
+
+
+/**
+ ** io_uring
+ **/
+
+static unsigned queue_io(struct uring *u, const int write, const int fd,
+                         unsigned char *buf, size_t len,
+                         unsigned long long off, const unsigned idx) {
+  /* split into URING_IOSZ transfers tagged with their size and slot */
+  unsigned n = 0;
+  size_t sz;
+  while ( len ) {
+    sz = (len < URING_IOSZ) ? len : URING_IOSZ;
+    uring_prep(u, write, fd, buf, sz, off, idx, (unsigned long long)sz << 32 | idx);
+    buf += sz;
+    off += sz;
+    len -= sz;
+    n++;
+  }
+  return n;
+}
+
+static void wait_io(struct uring *u, const int write) {
+  /* submit, then block on the disk for a completion */
+  struct metrics_mark m;
+  metrics_start(write ? PH_WRITE : PH_READ, &m);
+  uring_submit(u, 1);
+  metrics_stop(write ? PH_WRITE : PH_READ, &m);
+}
+
+static unsigned reap_io(struct ring *ring, struct uring *u, const int write) {
+  /* returns the number of I/Os completed; finished slots move on */
+  unsigned long long data;
+  unsigned done = 0, idx;
+  int res;
+
+  while ( uring_reap(u, &data, &res) ) {
+    if ( res < 0 ) {
+      errno = -res;
+      DIES(write ? "writing" : "reading");
+    }
+    if ( (unsigned long long)res != data >> 32 ) DIE(write ? "short write" : "input changed while reading");
+    idx = data & 0xffffffff;
+    metrics_io(write, res, 0);
+    done++;
+    if ( --ring->pend[idx] ) continue;
+    if ( write ) {
+      publish(ring, &ring->slot[idx], SLOT_FREE);
+    } else {
+      publish(ring, &ring->slot[idx], ring->p->work ? SLOT_FILLED : SLOT_DONE);
+    }
+  }
+  return done;
+}
+
+static unsigned plan(struct ring *ring, struct pipe_slot *s, unsigned long long seq) {
+  /* the input size fixes every slot's cells in advance; queue their reads */
+  struct pipeline *p = ring->p;
+  struct bufio *r = p->r;
+  unsigned long long at = seq * p->units * p->unit, left;
+  size_t buffered = r->len - r->pos, len, have;
+  unsigned char *cell;
+  unsigned n = 0;
+
+  s->seq = seq;
+  s->n = 0;
+  s->last = seq + 1 == ring->end;
+  do {
+    left = (at < ring->size) ? ring->size - at : 0;
+    len = (left < p->unit) ? left : p->unit;
+    cell = s->buf + s->n*p->stride;
+    s->inlen[s->n] = s->outlen[s->n] = len;
+    s->n++;
+
+    /* bytes already in the read buffer, then the rest from the file */
+    have = (at < buffered) ? buffered - at : 0;
+    if ( have > len ) have = len;
+    memcpy(cell, r->buf + r->pos + at, have);
+    n += queue_io(&ring->rio, 0, r->fd, cell + have, len - have,
+                  ring->fbase + at + have, s - ring->slot);
+    at += len;
+  } while ( s->n < p->units && left > p->unit );
+  s->bad = s->n;
+  return n;
+}
+
+static void read_ahead(struct ring *ring) {
+  struct uring *u = &ring->rio;
+  struct pipe_slot *s;
+  unsigned long long seq = 0;
+  unsigned inflight = 0, n;
+
+  while ( seq < ring->end || inflight ) {
+    /* start on every free slot there is queue room for */
+    while ( seq < ring->end && inflight + ring->maxio <= u->entries ) {
+      s = &ring->slot[seq % ring->nslots];
+      if ( ! slot_free(ring, s) ) break;
+      publish(ring, s, SLOT_READING);
+      n = plan(ring, s, seq++);
+      touch(ring, s);
+      if ( n ) {
+        ring->pend[s - ring->slot] = n;
+        inflight += n;
+      } else {
+        publish(ring, s, ring->p->work ? SLOT_FILLED : SLOT_DONE);
+      }
+    }
+
+    if ( ! inflight ) {
+      if ( seq < ring->end ) wait_free(ring, &ring->slot[seq % ring->nslots]);
+      continue;
+    }
+    wait_io(u, 0);
+    inflight -= reap_io(ring, u, 0);
+  }
+}
+
+static void write_behind(struct ring *ring) {
+  struct pipeline *p = ring->p;
+  struct uring *u = &ring->wio;
+  struct pipe_slot *s;
+  unsigned long long seq, off = ring->wbase;
+  unsigned inflight = 0, n, i, idx;
+  int last = 0;
+
+  for ( seq=0; ! last; seq++ ) {
+    idx = seq % ring->nslots;
+    s = &ring->slot[idx];
+
+    /* completions free slots the reader may be waiting on */
+    pthread_mutex_lock(&ring->lock);
+    while ( s->state != SLOT_DONE || s->seq != seq ) {
+      if ( inflight ) {
+        pthread_mutex_unlock(&ring->lock);
+        wait_io(u, 1);
+        inflight -= reap_io(ring, u, 1);
+        pthread_mutex_lock(&ring->lock);
+        continue;
+      }
+      pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    while ( inflight + ring->maxio > u->entries ) {
+      wait_io(u, 1);
+      inflight -= reap_io(ring, u, 1);
+    }
+
+    tap_unworked(ring, s);
+    if ( p->w->tap ) tap(p->w, p, s, s->outlen, s->bad);
+    n = 0;
+    for ( i=0; i<s->bad; i++ ) {
+      n += queue_io(u, 1, p->w->fd, s->buf + i*p->stride, s->outlen[i], off, idx);
+      off += s->outlen[i];
+    }
+    last = s->last;
+    if ( s->bad < s->n ) last = 1;
+
+    if ( n ) {
+      ring->pend[idx] = n;
+      inflight += n;
+      uring_submit(u, 0);
+    } else {
+      publish(ring, s, SLOT_FREE);
+    }
+  }
+
+  /* everything before a failed segment still lands */
+  while ( inflight ) {
+    wait_io(u, 1);
+    inflight -= reap_io(ring, u, 1);
+  }
+  if ( lseek(p->w->fd, off, SEEK_SET) < 0 ) DIES("seeking output");
+  if ( s->bad < s->n ) fail(p, s);
+}
+
+static int uring_input(struct ring *ring) {
+  /* regular files only: the size must be known before reading */
+  struct bufio *r = ring->p->r;
+  struct stat st;
+  off_t cur;
+  unsigned long long cells;
+
+  if ( fstat(r->fd, &st) || ! S_ISREG(st.st_mode) ) return 0;
+  if ( (cur=lseek(r->fd, 0, SEEK_CUR)) < 0 || st.st_size < cur ) return 0;
+
+  ring->fbase = cur - (r->len - r->pos);
+  ring->size = st.st_size - ring->fbase;
+  cells = (ring->size + ring->p->unit - 1) / ring->p->unit;
+  if ( ! cells ) cells = 1;
+  ring->end = (cells + ring->p->units - 1) / ring->p->units;
+  return 1;
+}
+
+static int uring_output(struct ring *ring) {
+  /* O_APPEND would ignore the offsets and reorder completions */
+  struct bufio *w = ring->p->w;
+  struct stat st;
+  off_t cur;
+  int fl;
+
+  if ( ring->p->sink ) return 0;
+  if ( fstat(w->fd, &st) || ! S_ISREG(st.st_mode) ) return 0;
+  if ( (fl=fcntl(w->fd, F_GETFL)) < 0 || (fl & O_APPEND) ) return 0;
+
+  bufio_flush(w, "writing");
+  if ( (cur=lseek(w->fd, 0, SEEK_CUR)) < 0 ) return 0;
+  ring->wbase = cur;
+  return 1;
+}
+
+static void uring_setup(struct ring *ring) {
+  struct pipeline *p = ring->p;
+  struct iovec iov[ring->nslots];
+  unsigned depth = URING_MINDEPTH, i;
+
+  ring->rio.fd = ring->wio.fd = -1;
+  ring->maxio = p->units * ((p->stride + URING_IOSZ - 1) / URING_IOSZ);
+  while ( depth < 2*ring->maxio ) depth *= 2;
+  if ( depth > URING_MAXDEPTH ) return;
+
+  for ( i=0; i<ring->nslots; i++ ) {
+    iov[i].iov_base = ring->slot[i].buf;
+    iov[i].iov_len = p->units * p->stride;
+  }
+  if ( p->r && uring_input(ring) ) {
+    /* one slot's worth of input has nothing to overlap */
+    if ( ring->end < 2 ) {
+      ring->end = ~0ULL;
+      return;
+    }
+    if ( uring_open(&ring->rio, depth) ) {
+      uring_register(&ring->rio, iov, ring->nslots);
+    } else {
+      ring->end = ~0ULL;
+    }
+  }
+  if ( uring_output(ring) && uring_open(&ring->wio, depth) ) {
+    uring_register(&ring->wio, iov, ring->nslots);
+  }
+}
+
+
+/**
+ ** Threads
+ **/
+
+static void *reader(void *arg) {
+  struct ring *ring = arg;
+  if ( ring->rio.fd >= 0 ) {
+    read_ahead(ring);
+  } else {
+    read_blocking(ring);
+  }
+  return NULL;
+}
+
+static void *worker(void *arg) {
+  struct ring *ring = arg;
+  struct pipe_slot *s;
+
+  pthread_mutex_lock(&ring->lock);
+  while ( ring->nwork < ring->end ) {
+    s = &ring->slot[ring->nwork % ring->nslots];
+    if ( s->state != SLOT_FILLED || s->seq != ring->nwork ) {
+      pthread_cond_wait(&ring->cond, &ring->lock);
+      continue;
+    }
+    s->state = SLOT_BUSY;
+    ring->nwork++;
+
+    if ( ring->rio.fd >= 0 && ring->p->r->tap ) {
+      /* reads complete out of order: tap a slot at a time, in order,
+       * before its work.  the work itself still overlaps */
+      while ( ring->ntap != s->seq ) pthread_cond_wait(&ring->cond, &ring->lock);
+      pthread_mutex_unlock(&ring->lock);
+      tap(ring->p->r, ring->p, s, s->inlen, s->n);
+      pthread_mutex_lock(&ring->lock);
+      ring->ntap++;
+      pthread_cond_broadcast(&ring->cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    ring->p->work(ring->p->ctx, s);
+
+    pthread_mutex_lock(&ring->lock);
+    s->state = SLOT_DONE;
+    pthread_cond_broadcast(&ring->cond);
+  }
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+  return NULL;
+}
+
+void pipeline_run(struct pipeline *p) {
+  struct ring ring;
+  struct pipe_slot *s;
+  unsigned workers = p->work ? (p->workers ? p->workers : 1) : 0;
+  pthread_t rtid, wtid[workers ? workers : 1];
+  struct bufio *r = p->r;
+  void *buf;
+  unsigned i;
+
+  memset(&ring, 0, sizeof(ring));
+  ring.p = p;
+  ring.nslots = 2*workers + 2;
+  ring.end = ~0ULL;
+  pthread_mutex_init(&ring.lock, NULL);
+  pthread_cond_init(&ring.cond, NULL);
+
+  if ( ! (ring.slot=calloc(ring.nslots, sizeof(*ring.slot))) ) DIE("allocating ring");
+  if ( ! (ring.pend=calloc(ring.nslots, sizeof(*ring.pend))) ) DIE("allocating ring");
+  if ( ! (ring.dirty=calloc(ring.nslots, sizeof(*ring.dirty))) ) DIE("allocating ring");
+  for ( i=0; i<ring.nslots; i++ ) {
+    s = &ring.slot[i];
+    if ( posix_memalign(&buf, sysconf(_SC_PAGESIZE), p->units * p->stride) ) DIE("allocating ring");
+    s->buf = buf;
+    s->inlen = calloc(p->units, sizeof(size_t));
+    s->outlen = calloc(p->units, sizeof(size_t));
+    if ( ! s->inlen || ! s->outlen ) DIE("allocating ring");
+  }
+  uring_setup(&ring);
+
+  if ( pthread_create(&rtid, NULL, reader, &ring) ) DIE("starting reader");
+  for ( i=0; i<workers; i++ ) {
+    if ( pthread_create(&wtid[i], NULL, worker, &ring) ) DIE("starting worker");
+  }
+
+  /* the calling thread is the writer */
+  if ( ring.wio.fd >= 0 ) {
+    write_behind(&ring);
+  } else {
+    write_blocking(&ring);
+  }
+
+  pthread_join(rtid, NULL);
+  for ( i=0; i<workers; i++ ) pthread_join(wtid[i], NULL);
+
+  if ( ring.rio.fd >= 0 ) {
+    /* leave the reader where blocking reads would have */
+    r->pos = r->len;
+    r->eof = 1;
+    if ( lseek(r->fd, ring.fbase + ring.size, SEEK_SET) < 0 ) DIES("seeking input");
+  }
+  uring_close(&ring.rio);
+  uring_close(&ring.wio);
+
+  for ( i=0; i<ring.nslots; i++ ) {
+    s = &ring.slot[i];
+    zeromem(s->buf, ring.dirty[i]);
+    free(s->buf);
+    free(s->inlen);
+    free(s->outlen);
+  }
+  free(ring.slot);
+  free(ring.pend);
+  free(ring.dirty);
+  pthread_mutex_destroy(&ring.lock);
+  pthread_cond_destroy(&ring.cond);
+}
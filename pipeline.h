@@ -0,0 +1,47 @@
+/*
+ * spor/pipeline.h
+ * overlapped read -> transform -> write stream engine
+ */
+#ifndef SPOR_PIPELINE_H
+#define SPOR_PIPELINE_H
+
+#include "bufio.h"
+
+/*
+ * a slot is one unit of work: up to `units` pieces of input, each
+ * read into its own `stride` sized cell of buf.  the work function
+ * transforms the cells in place and sets outlen[]; the sink (or the
+ * writer, by default) then consumes them in stream order.  cells
+ * before a failed one (bad < n) are still written, then the stream
+ * aborts.  a tap on r or w sees the stream in order whether or not
+ * the bytes pass through the bufio (with a sink, w's is not used).
+ * with no r, the stream is `size` bytes the work function makes up:
+ * cells come to it sized but unfilled.
+ */
+struct pipe_slot {
+  unsigned char *buf;
+  size_t *inlen;
+  size_t *outlen;
+  unsigned n;                 /* cells in use */
+  unsigned long long seq;     /* slot number in the stream */
+  int last;                   /* holds the end of the input */
+  unsigned bad;               /* first cell that failed, n if none */
+  int state;
+};
+
+struct pipeline {
+  struct bufio *r;            /* NULL to generate size bytes */
+  struct bufio *w;            /* unused if sink is set */
+  size_t unit;                /* bytes read per cell */
+  size_t stride;              /* cell size, >= unit */
+  unsigned units;             /* cells per slot */
+  unsigned workers;           /* transform threads */
+  void (*work)(void *ctx, struct pipe_slot *s);
+  void (*sink)(void *ctx, struct pipe_slot *s);
+  void *ctx;
+  unsigned long long size;    /* used if r is NULL */
+};
+
+void pipeline_run(struct pipeline *p);
+
+#endif
@@ -3,8 +3,16 @@
  * stream interface and on-disk format
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "agent.h"
+#include "bufio.h"
+#include "lz.h"
+#include "metrics.h"
+#include "pipeline.h"
 #include "spor.h"
 #include "pbkdf.h"
 #include "util.h"
@@ -12,66 +20,126 @@
 /***
  *** header format is:
  ***  bytes 0,1: magic number "s0"
- ***      2,3,4: format version 0
- ***          5: packet type: V=private key,B=public key,S=symmetric message,G=signature,A=asymmetric message
+ ***          2: format version: 1, or 2 for segmented 'S'/'A'
+ ***          3: packet type: V=private key,B=public key,S=symmetric message,G=signature,A=asymmetric message,
+ ***             Y=keyring (below)
  *** followed by zero or more headers of the format:
- ***          n: header type: I=IV,L=salt,K=encrypted message key
+ ***          n: header type: I=IV (nonce prefix in version 2),L=salt,K=encrypted message key,
+ ***                          R=recipient key id ('A' with a recipient list, each
+ ***                            followed by its K, all before I),
+ ***                          Z=segment size (version 2, 4 bytes big endian),
+ ***                          P=KDF parameters ('S','V', before I; absent in older streams)
+ ***                          T=key type ('B','V','G','A', first; absent for P-521)
+ ***                          N=number of keys ('Y')
+ ***                          C=compression ('S','A', just before I; absent if
+ ***                            uncompressed): 1 byte algorithm, 4 byte block size
+ ***                          U=key salt ('S', just before I; absent unless
+ ***                            batched): the key is s0_subkey(KDF key, U)
  ***        n+1: header data length
  *** n+2,n+2+sz: header data
+ ***
+ *** in version 2 the payload is a sequence of segments, each segment
+ *** (Z bytes of plaintext, fewer in the last one) followed by its
+ *** AEAD_TAGSZ byte tag.
+ ***
+ *** after a C header the plaintext that is encrypted is a sequence of
+ *** frames, one per block: CFRAMESZ bytes of big-endian length, its top
+ *** bit set if the block is stored as is, then the compressed block.
  ***/
 
 /**
  ** Header access
  **/
 
-void s0_read_magic(int infd, unsigned char type) {
+unsigned s0_read_magic(struct bufio *r, unsigned char type) {
+  /* returns the packet version */
   unsigned char hdr[4];
-  int len;
 
-  len = read_or_die(infd, hdr, sizeof(hdr), "reading header");
-  if ( len < sizeof(hdr) ) DIED("short packet read fd", infd);
+  if ( bufio_read(r, hdr, sizeof(hdr), "reading header") < sizeof(hdr) )
+    DIED("short packet read fd", r->fd);
 
   if ( hdr[0] != 's' || hdr[1] != '0' ) DIEC2("bad magic", hdr[0], hdr[1]);
-  if ( hdr[2] != SPOR_ONDISK_VERSION ) DIE("bad packet version");
   if ( hdr[3] != type ) DIEC("bad packet type", hdr[3]);
+  if ( hdr[2] == SPOR_ONDISK_VERSION ) return hdr[2];
+  if ( hdr[2] == SPOR_SEGMENTED_VERSION && (type == 'S' || type == 'A') ) return hdr[2];
+  DIE("bad packet version");
 }
 
-void s0_write_magic(int outfd, unsigned char type) {
+void s0_write_magic_version(struct bufio *w, unsigned char type, unsigned char version) {
   unsigned char hdr[4];
   hdr[0] = 's';
   hdr[1] = '0';
-  hdr[2] = SPOR_ONDISK_VERSION;
+  hdr[2] = version;
   hdr[3] = type;
-  if ( write_or_die(outfd, hdr, 4, "writing magic") < 4 ) DIE("short write in magic");
+  bufio_write(w, hdr, sizeof(hdr), "writing magic");
 }
 
-unsigned s0_read_header(int infd, unsigned char type, unsigned char *buf, unsigned sz) {
+void s0_write_magic(struct bufio *w, unsigned char type) {
+  s0_write_magic_version(w, type, SPOR_ONDISK_VERSION);
+}
+
+unsigned s0_read_header(struct bufio *r, unsigned char type, unsigned char *buf, unsigned sz) {
   unsigned char hdr[2];
   unsigned len;
 
-  if ( read_or_die(infd, hdr, 2, "reading header") < 2 ) DIE("short read in header");
+  if ( bufio_read(r, hdr, 2, "reading header") < 2 ) DIE("short read in header");
   if ( hdr[0] != type ) DIEC("bad header type", hdr[0]);
   if ( sz < hdr[1] ) DIEC2("buffer overflow", sz, hdr[1]);
-  len = read_or_die(infd, buf, hdr[1], "reading header data");
+  len = bufio_read(r, buf, hdr[1], "reading header data");
   if ( len < hdr[1] ) DIE("short read in header data");
   return len;
 }
 
-void s0_write_header(int outfd, unsigned char type, unsigned char *buf, unsigned char len) {
+void s0_write_header(struct bufio *w, unsigned char type, unsigned char *buf, unsigned char len) {
   unsigned char hdr[2];
   hdr[0] = type;
   hdr[1] = len;
-  if ( write_or_die(outfd, hdr, 2, "writing header") < 2 ) DIE("short write in header");
-  len = write_or_die(outfd, buf, len, "writing header data");
-  if ( len != hdr[1] ) DIE("short write in header data");
+  bufio_write(w, hdr, 2, "writing header");
+  bufio_write(w, buf, len, "writing header data");
+}
+
+void s0_write_kdf(struct bufio *w, struct s0_kdf *kdf) {
+  /* the parameters for the next derivation, in a 'P' header */
+  unsigned char buf[KDF_HDRSZ];
+  s0_kdf_current(kdf);
+  s0_kdf_encode(buf, kdf);
+  s0_write_header(w, 'P', buf, sizeof(buf));
+}
+
+void s0_read_kdf(struct bufio *r, struct s0_kdf *kdf) {
+  /* streams from before the 'P' header used the defaults */
+  unsigned char buf[KDF_HDRSZ];
+  unsigned len;
+  if ( bufio_peek(r, "reading header") != 'P' ) {
+    s0_kdf_default(kdf);
+    return;
+  }
+  len = s0_read_header(r, 'P', buf, sizeof(buf));
+  s0_kdf_decode(buf, len, kdf);
+}
+
+void s0_write_type(struct bufio *w, const unsigned type) {
+  unsigned char t = type;
+  if ( type != ASYM_P521 ) s0_write_header(w, 'T', &t, 1);
+}
+
+unsigned s0_read_type(struct bufio *r) {
+  /* P-521 packets carry no 'T' header */
+  unsigned char t;
+  if ( bufio_peek(r, "reading header") != 'T' ) return ASYM_P521;
+  if ( s0_read_header(r, 'T', &t, 1) != 1 ) DIE("bad key type header");
+  return t;
 }
 
 /**
  ** Asymmetric key management
  **/
 
-void s0_create_key(struct asymkey *akeyp) {
-  s0_asym_keygen(akeyp);
+void s0_create_key(struct asymkey *akeyp, const unsigned type) {
+  struct metrics_mark m;
+  metrics_start(PH_PK, &m);
+  s0_asym_keygen(akeyp, type);
+  metrics_stop(PH_PK, &m);
 }
 
 void s0_import_key(struct asymkey* akeyp, const int infd,
@@ -81,28 +149,72 @@ void s0_import_key(struct asymkey* akeyp, const int infd,
   unsigned char iv[KEYSZ_SYM], salt[SALTSZ];
   unsigned char buf[BUFSZ];
   unsigned long len;
+  unsigned type;
+  struct s0_kdf kdf;
+  struct bufio r;
 
+  bufio_open(&r, infd);
   if ( pwbuf ) {
     if ( ! pwsz ) DIE("no passphrase");
-    s0_read_magic(infd, 'V');
-    s0_read_header(infd, 'I', iv, sizeof(iv));
-    s0_read_header(infd, 'L', salt, sizeof(salt));
+    s0_read_magic(&r, 'V');
+    type = s0_read_type(&r);
+    s0_read_kdf(&r, &kdf);
+    s0_read_header(&r, 'I', iv, sizeof(iv));
+    s0_read_header(&r, 'L', salt, sizeof(salt));
 
-    len = read_or_die(infd, buf, sizeof(buf), "reading key");
+    len = bufio_read(&r, buf, sizeof(buf), "reading key");
 
-    s0_derive_key(skey, sizeof(skey), pwbuf, pwsz, salt, sizeof(salt));
+    s0_derive_key(skey, sizeof(skey), pwbuf, pwsz, salt, sizeof(salt), &kdf);
     s0_cipher_init(skey, iv, sizeof(skey));
     s0_cipher_decrypt(buf, len);
     s0_cipher_done();
     zeromem(skey, sizeof(skey));
 
-    s0_asym_import(buf, len, akeyp);
+    s0_asym_import(buf, len, type, akeyp);
 
   } else {
-    s0_read_magic(infd, 'B');
-    len = read_or_die(infd, buf, sizeof(buf), "reading key");
-    s0_asym_import(buf, len, akeyp);
+    s0_read_magic(&r, 'B');
+    type = s0_read_type(&r);
+    len = bufio_read(&r, buf, sizeof(buf), "reading key");
+    s0_asym_import(buf, len, type, akeyp);
   }
+  bufio_close(&r);
+  zeromem(buf, sizeof(buf));
+}
+
+/*
+ * with an agent in use, the private key operations are sent to it
+ * and akey holds only the public half
+ */
+
+static int agentfd = -1;
+
+static const char *agentpath;
+
+void s0_use_agent(struct asymkey *akeyp, const char *path) {
+  unsigned char buf[BUFSZ];
+  unsigned long len = sizeof(buf);
+
+  agentpath = path;
+  agentfd = agent_connect(path);
+  agent_call(agentfd, AGENT_PUBKEY, NULL, 0, buf, &len);
+  if ( ! len ) DIE("bad key from agent");
+  s0_asym_import(buf+1, len-1, buf[0], akeyp);
+}
+
+static void s0_unwrap_key(struct asymkey *akeyp, unsigned char *skey,
+                          const unsigned char *cryptbuf, const unsigned long cryptsz) {
+  unsigned long len = KEYSZ_SYM;
+  struct metrics_mark m;
+
+  metrics_start(PH_PK, &m);
+  if ( agentfd < 0 ) {
+    s0_asym_decrypt_key(akeyp, skey, KEYSZ_SYM, cryptbuf, cryptsz);
+  } else {
+    agent_call(agentfd, AGENT_UNWRAP, cryptbuf, cryptsz, skey, &len);
+    if ( len != KEYSZ_SYM ) DIE("bad key from agent");
+  }
+  metrics_stop(PH_PK, &m);
 }
 
 void s0_export_key(struct asymkey *akeyp, const int outfd,
@@ -112,18 +224,23 @@ void s0_export_key(struct asymkey *akeyp, const int outfd,
   unsigned char iv[KEYSZ_SYM], salt[SALTSZ];
   unsigned char buf[BUFSZ];
   unsigned long sz = sizeof(buf);
+  struct s0_kdf kdf;
+  struct bufio w;
 
+  bufio_open(&w, outfd);
   if ( pwbuf ) {
     if ( ! pwsz ) DIE("no passphrase");
 
     s0_prng_getbytes(iv, sizeof(iv));
     s0_prng_getbytes(salt, sizeof(salt));
 
-    s0_write_magic(outfd, 'V');
-    s0_write_header(outfd, 'I', iv, sizeof(iv));
-    s0_write_header(outfd, 'L', salt, sizeof(salt));
+    s0_write_magic(&w, 'V');
+    s0_write_type(&w, s0_asym_type(akeyp));
+    s0_write_kdf(&w, &kdf);
+    s0_write_header(&w, 'I', iv, sizeof(iv));
+    s0_write_header(&w, 'L', salt, sizeof(salt));
 
-    s0_derive_key(skey, sizeof(skey), pwbuf, pwsz, salt, sizeof(salt));
+    s0_derive_key(skey, sizeof(skey), pwbuf, pwsz, salt, sizeof(salt), &kdf);
     s0_cipher_init(skey, iv, sizeof(skey));
 
     s0_asym_export(buf, &sz, 1, akeyp);
@@ -133,38 +250,1128 @@ void s0_export_key(struct asymkey *akeyp, const int outfd,
     zeromem(skey, sizeof(skey));
 
   } else {
-    s0_write_magic(outfd, 'B');
+    s0_write_magic(&w, 'B');
+    s0_write_type(&w, s0_asym_type(akeyp));
     s0_asym_export(buf, &sz, 0, akeyp);
   }
 
-  write_or_die(outfd, buf, sz, "writing key");
+  bufio_write(&w, buf, sz, "writing key");
+  bufio_flush(&w, "writing key");
+  bufio_close(&w);
+  zeromem(buf, sizeof(buf));
 }
 
 /*
  * stream interfaces
+ * every stream runs on the pipeline: a reader thread, nthreads
+ * workers and the calling thread writing, so disk and CPU overlap.
  */
 
-void s0_filter_stream(const int infd, const int outfd,
-                      void (filter)(unsigned char *, unsigned)) {
-  unsigned char buf[BUFSZ];
-  unsigned len;
-  while ( (len=read(infd, buf, sizeof(buf))) > 0 ) {
-    filter(buf, len);
-    write_or_die(outfd, buf, len, "writing");
+static unsigned nthreads = 1;
+
+/* decrypted payloads of compressed streams go to a sink, below */
+struct unpack;
+static void unpack_slot(struct unpack *u, struct pipe_slot *s, const size_t stride);
+
+void s0_set_threads(const unsigned n) {
+  long ncpu;
+  if ( n ) {
+    nthreads = n;
+  } else {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (ncpu > 0) ? ncpu : 1;
+  }
+}
+
+/*
+ * CTR keystream at any offset is computable from the IV, so each
+ * chunk is crypted by whichever worker takes it, seeking its own
+ * counter to the chunk's offset.  an appended stream starts its
+ * counter where the payload on disk ends.
+ */
+
+struct crypt {
+  unsigned long long base;    /* stream offset of the first byte */
+  struct unpack *u;
+};
+
+static void crypt_work(void *ctx, struct pipe_slot *s) {
+  struct crypt *c = ctx;
+  size_t chunk = bufio_chunksz();
+  s0_cipher_crypt_at(s->buf, s->inlen[0], c->base + s->seq * chunk);
+}
+
+static void crypt_sink(void *ctx, struct pipe_slot *s) {
+  struct crypt *c = ctx;
+  unpack_slot(c->u, s, bufio_chunksz());
+}
+
+void s0_cipher_stream(struct bufio *r, struct bufio *w, struct unpack *u,
+                      const unsigned long long base) {
+  /* CTR en/decryption are the same.  u, if not NULL, unpacks the
+   * output of a decryption on its way to w */
+  struct pipeline p = { 0 };
+  struct crypt c = { base, u };
+  p.r = r;
+  p.w = w;
+  p.unit = p.stride = bufio_chunksz();
+  p.units = 1;
+  p.workers = nthreads;
+  p.work = crypt_work;
+  p.ctx = &c;
+  if ( u ) p.sink = crypt_sink;
+  pipeline_run(&p);
+}
+
+/*
+ * random bytes
+ * the AES-CTR keystream under a key drawn from the PRNG, which only
+ * seeds it: each chunk is a separate stretch of counters, made by
+ * whichever worker takes it, so the stream runs as fast as CTR
+ * encryption with nothing to read.  every RANDOM_RESEED bytes the
+ * PRNG is reseeded from ENTROPY_SOURCE and a fresh key drawn.
+ */
+
+static void random_work(void *ctx, struct pipe_slot *s) {
+  size_t chunk = bufio_chunksz();
+  (void)ctx;
+  memset(s->buf, 0, s->inlen[0]);
+  s0_cipher_crypt_at(s->buf, s->inlen[0], s->seq * chunk);
+}
+
+void s0_random_stream(const int outfd, unsigned long long n) {
+  unsigned char skey[KEYSZ_SYM];
+  unsigned char iv[sizeof(skey)];
+  struct pipeline p = { 0 };
+  struct bufio w;
+
+  bufio_open(&w, outfd);
+  p.w = &w;
+  p.unit = p.stride = bufio_chunksz();
+  p.units = 1;
+  p.workers = nthreads;
+  p.work = random_work;
+
+  do {
+    s0_prng_getbytes(skey, sizeof(skey));
+    s0_prng_getbytes(iv, sizeof(iv));
+    s0_cipher_init(skey, iv, sizeof(skey));
+    zeromem(skey, sizeof(skey));
+
+    p.size = (n < RANDOM_RESEED) ? n : RANDOM_RESEED;
+    pipeline_run(&p);
+    s0_cipher_done();
+    n -= p.size;
+    if ( n ) s0_prng_done();
+  } while ( n );
+  bufio_close(&w);
+}
+
+/*
+ * authenticated segments (format version 2)
+ * each segment is sealed with nonce = prefix || segment number ||
+ * last-segment flag, as in the STREAM construction, so segments
+ * cannot be reordered, dropped or truncated without failing to open.
+ * a pipeline slot holds about a chunk of segments; memory stays
+ * bounded by the ring whatever the stream length.
+ */
+
+static unsigned format = SPOR_ONDISK_VERSION;
+
+void s0_set_format(const unsigned version) {
+  if ( version != SPOR_ONDISK_VERSION && version != SPOR_SEGMENTED_VERSION )
+    DIED("unknown format version", version);
+  format = version;
+}
+
+int s0_seg_crypt(const unsigned char *key, const unsigned char *prefix,
+                 unsigned char *buf, unsigned long len,
+                 unsigned long long idx, int last, int open) {
+  /* buf holds len bytes of segment data, then its tag */
+  unsigned char nonce[AEAD_NONCESZ];
+
+  if ( idx > 0xffffffffULL ) DIE("too many segments");
+  memcpy(nonce, prefix, NONCE_PREFIXSZ);
+  nonce[7] = idx >> 24;
+  nonce[8] = idx >> 16;
+  nonce[9] = idx >> 8;
+  nonce[10] = idx;
+  nonce[11] = last;
+
+  if ( open ) return s0_aead_open(key, KEYSZ_SYM, nonce, buf, len, buf + len);
+  s0_aead_seal(key, KEYSZ_SYM, nonce, buf, len, buf + len);
+  return 1;
+}
+
+struct seg_ctx {
+  const unsigned char *key;
+  const unsigned char *prefix;
+  size_t stride;
+  unsigned units;
+  struct unpack *unpack;
+};
+
+static void seal_work(void *ctx, struct pipe_slot *s) {
+  struct seg_ctx *c = ctx;
+  unsigned i;
+  for ( i=0; i<s->n; i++ ) {
+    s0_seg_crypt(c->key, c->prefix, s->buf + i*c->stride, s->inlen[i],
+                 s->seq*c->units + i, s->last && i == s->n-1, 0);
+    s->outlen[i] = s->inlen[i] + AEAD_TAGSZ;
+  }
+}
+
+static void open_work(void *ctx, struct pipe_slot *s) {
+  /* stop at the first bad segment: nothing after it is written */
+  struct seg_ctx *c = ctx;
+  unsigned i;
+  for ( i=0; i<s->n; i++ ) {
+    if ( s->inlen[i] < AEAD_TAGSZ ) DIE("truncated stream");
+    s->outlen[i] = s->inlen[i] - AEAD_TAGSZ;
+    if ( ! s0_seg_crypt(c->key, c->prefix, s->buf + i*c->stride, s->outlen[i],
+                        s->seq*c->units + i, s->last && i == s->n-1, 1) ) {
+      s->bad = i;
+      return;
+    }
+  }
+}
+
+static void open_sink(void *ctx, struct pipe_slot *s) {
+  struct seg_ctx *c = ctx;
+  unpack_slot(c->unpack, s, c->stride);
+}
+
+static unsigned seg_units(const size_t segsz) {
+  /* segments per slot: about one chunk */
+  unsigned n = bufio_chunksz() / segsz;
+  return n ? n : 1;
+}
+
+void s0_write_segsz(struct bufio *w, const unsigned long segsz) {
+  unsigned char buf[4];
+  buf[0] = segsz >> 24;
+  buf[1] = segsz >> 16;
+  buf[2] = segsz >> 8;
+  buf[3] = segsz;
+  s0_write_header(w, 'Z', buf, sizeof(buf));
+}
+
+unsigned long s0_read_segsz(struct bufio *r) {
+  unsigned char buf[4];
+  unsigned long segsz;
+  if ( s0_read_header(r, 'Z', buf, sizeof(buf)) != sizeof(buf) ) DIE("bad segment size header");
+  segsz = (unsigned long)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+  if ( ! segsz || segsz > MAX_SEGSZ ) DIE("bad segment size");
+  return segsz;
+}
+
+static void s0_seg_stream(struct bufio *r, struct bufio *w, const unsigned char *key,
+                          const unsigned char *prefix, const size_t segsz, const int open,
+                          struct unpack *u) {
+  struct seg_ctx c;
+  struct pipeline p = { 0 };
+
+  c.key = key;
+  c.prefix = prefix;
+  c.stride = segsz + AEAD_TAGSZ;
+  c.units = seg_units(segsz);
+  c.unpack = u;
+
+  p.r = r;
+  p.w = w;
+  p.unit = open ? c.stride : segsz;
+  p.stride = c.stride;
+  p.units = c.units;
+  p.workers = nthreads;
+  p.work = open ? open_work : seal_work;
+  if ( u ) p.sink = open_sink;
+  p.ctx = &c;
+  pipeline_run(&p);
+}
+
+void s0_seal_stream(struct bufio *r, struct bufio *w, const unsigned char *key,
+                    const unsigned char *prefix, const size_t segsz) {
+  s0_seg_stream(r, w, key, prefix, segsz, 0, NULL);
+}
+
+void s0_open_stream(struct bufio *r, struct bufio *w, const unsigned char *key,
+                    const unsigned char *prefix, const size_t segsz, struct unpack *u) {
+  /* only authenticated segments are written; the first bad one aborts */
+  s0_seg_stream(r, w, key, prefix, segsz, 1, u);
+}
+
+
+/*
+ * compressed streams
+ * after s0_set_compress, e and E compress their plaintext in
+ * independent CBLOCKSZ blocks ahead of the cipher.  the workers
+ * compress a slot's blocks in parallel; the writer frames them and
+ * encrypts the frames in order, as where a block lands in the
+ * ciphertext depends on the size of every block before it.  d and D
+ * decrypt on the pipeline as usual and the writer unframes and
+ * decompresses.  a block that doesn't shrink is stored as is.
+ */
+
+static unsigned compress = COMPRESS_NONE;
+
+void s0_set_compress(const unsigned alg) {
+  if ( alg != COMPRESS_NONE && alg != COMPRESS_LZ ) DIED("unknown compression", alg);
+  compress = alg;
+}
+
+static void s0_write_compress(struct bufio *w, const unsigned long blocksz) {
+  unsigned char buf[5];
+  if ( compress == COMPRESS_NONE ) return;
+  buf[0] = compress;
+  buf[1] = blocksz >> 24;
+  buf[2] = blocksz >> 16;
+  buf[3] = blocksz >> 8;
+  buf[4] = blocksz;
+  s0_write_header(w, 'C', buf, sizeof(buf));
+}
+
+static unsigned long s0_read_compress(struct bufio *r) {
+  /* the block size of a compressed stream, 0 if it isn't one */
+  unsigned char buf[5];
+  unsigned long blocksz;
+  if ( bufio_peek(r, "reading header") != 'C' ) return 0;
+  if ( s0_read_header(r, 'C', buf, sizeof(buf)) != sizeof(buf) ) DIE("bad compression header");
+  if ( buf[0] != COMPRESS_LZ ) DIED("unknown compression", buf[0]);
+  blocksz = (unsigned long)buf[1] << 24 | buf[2] << 16 | buf[3] << 8 | buf[4];
+  if ( ! blocksz || blocksz > MAX_CBLOCKSZ ) DIE("bad compression block size");
+  return blocksz;
+}
+
+struct seal {
+  /* encrypts a payload handed over in order, in pieces of any size */
+  struct bufio *w;
+  const unsigned char *key;
+  const unsigned char *prefix;
+  unsigned long long off;     /* version 1: keystream offset */
+  unsigned char *seg;         /* version 2: segment being filled, and its tag */
+  size_t len;
+  unsigned long long idx;
+};
+
+static void seal_segment(struct seal *c, const int last) {
+  s0_seg_crypt(c->key, c->prefix, c->seg, c->len, c->idx++, last, 0);
+  bufio_write(c->w, c->seg, c->len + AEAD_TAGSZ, "writing");
+  c->len = 0;
+}
+
+static void seal_write(struct seal *c, unsigned char *buf, size_t len) {
+  /* version 1 encrypts buf in place */
+  size_t n;
+
+  if ( ! c->seg ) {
+    s0_cipher_crypt_at(buf, len, c->off);
+    bufio_write(c->w, buf, len, "writing");
+    c->off += len;
+    return;
+  }
+  while ( len ) {
+    /* a full segment is sealed once there is more to come */
+    if ( c->len == SEGSZ ) seal_segment(c, 0);
+    n = (len < SEGSZ - c->len) ? len : SEGSZ - c->len;
+    memcpy(c->seg + c->len, buf, n);
+    c->len += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+struct pack_ctx {
+  struct seal seal;
+  size_t stride;
+};
+
+static void pack_work(void *ctx, struct pipe_slot *s) {
+  /* each cell becomes a frame in place */
+  struct pack_ctx *c = ctx;
+  unsigned char *cell, *out;
+  unsigned long word;
+  size_t len, sz;
+  unsigned i;
+
+  if ( ! (out=malloc(CBLOCKSZ)) ) DIE("allocating buffer");
+  for ( i=0; i<s->n; i++ ) {
+    cell = s->buf + i*c->stride;
+    len = s->inlen[i];
+    if ( ! len ) {
+      s->outlen[i] = 0;
+      continue;
+    }
+    if ( (sz=lz_compress(cell, len, out, len - 1)) ) {
+      memcpy(cell + CFRAMESZ, out, sz);
+      word = sz;
+    } else {
+      memmove(cell + CFRAMESZ, cell, len);
+      sz = len;
+      word = sz | 0x80000000UL;
+    }
+    cell[0] = word >> 24;
+    cell[1] = word >> 16;
+    cell[2] = word >> 8;
+    cell[3] = word;
+    s->outlen[i] = CFRAMESZ + sz;
+  }
+  zeromem(out, CBLOCKSZ);
+  free(out);
+}
+
+static void pack_sink(void *ctx, struct pipe_slot *s) {
+  struct pack_ctx *c = ctx;
+  unsigned i;
+  for ( i=0; i<s->n; i++ ) seal_write(&c->seal, s->buf + i*c->stride, s->outlen[i]);
+}
+
+static void s0_pack_stream(struct bufio *r, struct bufio *w, const unsigned char *key,
+                           const unsigned char *iv) {
+  /* compress r and encrypt it to w in the current format */
+  struct pack_ctx c;
+  struct pipeline p = { 0 };
+
+  memset(&c, 0, sizeof(c));
+  c.seal.w = w;
+  c.seal.key = key;
+  c.seal.prefix = iv;
+  c.stride = CBLOCKSZ + CFRAMESZ;
+  if ( format == SPOR_SEGMENTED_VERSION ) {
+    if ( ! (c.seal.seg=malloc(SEGSZ + AEAD_TAGSZ)) ) DIE("allocating buffer");
+  } else {
+    s0_cipher_init(key, iv, KEYSZ_SYM);
+  }
+
+  p.r = r;
+  p.w = w;
+  p.unit = CBLOCKSZ;
+  p.stride = c.stride;
+  p.units = seg_units(CBLOCKSZ);
+  p.workers = nthreads;
+  p.work = pack_work;
+  p.sink = pack_sink;
+  p.ctx = &c;
+  pipeline_run(&p);
+
+  if ( c.seal.seg ) {
+    seal_segment(&c.seal, 1);
+    zeromem(c.seal.seg, SEGSZ + AEAD_TAGSZ);
+    free(c.seal.seg);
+  } else {
+    s0_cipher_done();
   }
-  if ( len < 0 ) DIES("reading");
+  bufio_flush(w, "writing");
+}
+
+struct unpack {
+  /* decompresses a payload handed over in order, in pieces of any size */
+  struct bufio *w;
+  size_t blocksz;
+  unsigned char hdr[CFRAMESZ];
+  unsigned hlen;              /* CFRAMESZ once the header is in */
+  size_t need, have;          /* frame body */
+  int stored;
+  unsigned char *in;          /* a body split across pieces */
+  unsigned char *out;         /* the block */
+};
+
+static void unpack_open(struct unpack *u, struct bufio *w, const size_t blocksz) {
+  memset(u, 0, sizeof(*u));
+  u->w = w;
+  u->blocksz = blocksz;
+  if ( ! (u->in=malloc(blocksz)) || ! (u->out=malloc(blocksz)) ) DIE("allocating buffer");
+}
+
+static void unpack_frame(struct unpack *u, const unsigned char *body) {
+  long n;
+  if ( u->stored ) {
+    bufio_write(u->w, body, u->need, "writing");
+  } else {
+    if ( (n=lz_decompress(body, u->need, u->out, u->blocksz)) < 0 ) DIE("corrupt compressed block");
+    bufio_write(u->w, u->out, n, "writing");
+  }
+  u->hlen = 0;
+}
+
+static void unpack_write(struct unpack *u, const unsigned char *buf, size_t len) {
+  unsigned long word;
+  size_t n;
+
+  while ( len ) {
+    if ( u->hlen < CFRAMESZ ) {
+      u->hdr[u->hlen++] = *buf++;
+      len--;
+      if ( u->hlen < CFRAMESZ ) continue;
+      word = (unsigned long)u->hdr[0] << 24 | u->hdr[1] << 16 | u->hdr[2] << 8 | u->hdr[3];
+      u->stored = (word & 0x80000000UL) != 0;
+      u->need = word & 0x7fffffffUL;
+      u->have = 0;
+      if ( ! u->need || u->need > u->blocksz ) DIE("bad compressed frame");
+      continue;
+    }
+    if ( ! u->have && len >= u->need ) {
+      /* the whole body is here; no need to copy it */
+      unpack_frame(u, buf);
+      buf += u->need;
+      len -= u->need;
+      continue;
+    }
+    n = (len < u->need - u->have) ? len : u->need - u->have;
+    memcpy(u->in + u->have, buf, n);
+    u->have += n;
+    buf += n;
+    len -= n;
+    if ( u->have == u->need ) unpack_frame(u, u->in);
+  }
+}
+
+static void unpack_slot(struct unpack *u, struct pipe_slot *s, const size_t stride) {
+  /* the cells before a failed one still go out */
+  unsigned i;
+  for ( i=0; i<s->bad; i++ ) unpack_write(u, s->buf + i*stride, s->outlen[i]);
+  if ( s->bad < s->n ) bufio_flush(u->w, "writing");
+}
+
+static void unpack_done(struct unpack *u) {
+  if ( u->hlen ) DIE("truncated compressed stream");
+  bufio_flush(u->w, "writing");
+  zeromem(u->in, u->blocksz);
+  zeromem(u->out, u->blocksz);
+  free(u->in);
+  free(u->out);
+}
+
+static void hash_sink(void *ctx, struct pipe_slot *s) {
+  (void)ctx;
+  s0_hash_update(s->buf, s->inlen[0]);
+}
+
+void s0_hash_bufio(struct bufio *r, unsigned char *hash, unsigned sz) {
+  /* reading overlaps hashing; there is nothing to transform */
+  struct pipeline p = { 0 };
+  p.r = r;
+  p.unit = p.stride = bufio_chunksz();
+  p.units = 1;
+  p.sink = hash_sink;
+  s0_hash_init();
+  pipeline_run(&p);
+  s0_hash_done(hash, sz);
 }
 
 void s0_hash_stream(const int infd, unsigned char *hash, unsigned sz) {
+  struct bufio r;
+  bufio_open(&r, infd);
+  s0_hash_bufio(&r, hash, sz);
+  bufio_close(&r);
+}
+
+
+/*
+ * tree hashes
+ * the input is cut into leaves of a fixed size, hashed in parallel by
+ * the pipeline's workers, and the leaf hashes are combined as in RFC
+ * 6962: a leaf is H(0 || data), a node H(1 || left || right), and a
+ * tree of n > 1 leaves splits at the largest power of two below n.
+ * what is signed is H(2 || 'M' header || root), so the leaf size and
+ * length are signed too.  a proof for a run of leaves holds, in tree
+ * order, the root of every subtree that lies wholly outside it: a
+ * verifier holding only those leaves' bytes rebuilds the root from
+ * them and the proof.
+ */
+
+#define TREE_HDRSZ   12      /* leaf size 4 bytes, length 8 bytes */
+#define TREE_MAXPROOF 128    /* two nodes per level at most */
+
+struct tree {
+  unsigned long leafsz;
+  unsigned long long length;
+  unsigned char *leaves;     /* leaf hashes */
+  unsigned long n, cap;
+};
+
+static unsigned long treeleaf;   /* 0: sign a plain hash */
+
+void s0_set_tree(const unsigned long leafsz) {
+  if ( leafsz && (leafsz < MIN_TREE_LEAFSZ || leafsz > MAX_TREE_LEAFSZ) ) DIE("bad leaf size");
+  treeleaf = leafsz;
+}
+
+static void tree_leaf(const unsigned char *buf, const size_t len, unsigned char *hash) {
+  unsigned char tag = 0;
+  struct s0_digest *d = s0_digest_new();
+  s0_digest_update(d, &tag, 1);
+  s0_digest_update(d, buf, len);
+  s0_digest_done(d, hash, s0_hash_size());
+}
+
+static void tree_work(void *ctx, struct pipe_slot *s) {
+  /* each cell is a leaf: its hash replaces it */
+  struct tree *t = ctx;
+  unsigned i;
+  for ( i=0; i<s->n; i++ ) {
+    tree_leaf(s->buf + i*t->leafsz, s->inlen[i], s->buf + i*t->leafsz);
+    s->outlen[i] = s0_hash_size();
+  }
+}
+
+static void tree_sink(void *ctx, struct pipe_slot *s) {
+  struct tree *t = ctx;
+  unsigned i, hsz = s0_hash_size();
+  for ( i=0; i<s->n; i++ ) {
+    if ( ! s->inlen[i] ) continue;
+    if ( t->n == t->cap ) {
+      t->cap = t->cap ? 2*t->cap : 1024;
+      if ( ! (t->leaves=realloc(t->leaves, t->cap * hsz)) ) DIE("allocating tree");
+    }
+    memcpy(t->leaves + t->n++ * hsz, s->buf + i*t->leafsz, hsz);
+    t->length += s->inlen[i];
+  }
+}
+
+static void tree_leaves(struct bufio *r, struct tree *t, const unsigned long leafsz) {
+  /* an empty input is one empty leaf */
+  struct pipeline p = { 0 };
+  unsigned hsz = s0_hash_size();
+
+  memset(t, 0, sizeof(*t));
+  t->leafsz = leafsz;
+  p.r = r;
+  p.unit = p.stride = leafsz;
+  p.units = (bufio_chunksz() > leafsz) ? bufio_chunksz() / leafsz : 1;
+  p.workers = nthreads;
+  p.work = tree_work;
+  p.sink = tree_sink;
+  p.ctx = t;
+  pipeline_run(&p);
+  if ( ! t->n ) {
+    if ( ! (t->leaves=malloc(hsz)) ) DIE("allocating tree");
+    tree_leaf(NULL, 0, t->leaves);
+    t->n = 1;
+  }
+}
+
+static unsigned long tree_split(const unsigned long n) {
+  /* the largest power of two below n > 1 */
+  unsigned long k = 1;
+  while ( 2*k < n ) k *= 2;
+  return k;
+}
+
+static void tree_join(const unsigned char *left, const unsigned char *right, unsigned char *out) {
+  unsigned char tag = 1;
+  unsigned hsz = s0_hash_size();
+  struct s0_digest *d = s0_digest_new();
+  s0_digest_update(d, &tag, 1);
+  s0_digest_update(d, left, hsz);
+  s0_digest_update(d, right, hsz);
+  s0_digest_done(d, out, hsz);
+}
+
+static void tree_node(const unsigned char *leaves, const unsigned long n, unsigned char *out) {
+  unsigned hsz = s0_hash_size();
+  unsigned char left[hsz], right[hsz];
+  unsigned long k;
+
+  if ( n == 1 ) {
+    memcpy(out, leaves, hsz);
+    return;
+  }
+  k = tree_split(n);
+  tree_node(leaves, k, left);
+  tree_node(leaves + k*hsz, n - k, right);
+  tree_join(left, right, out);
+}
+
+static void tree_encode(unsigned char *buf, const unsigned long leafsz,
+                        const unsigned long long length) {
+  int i;
+  buf[0] = leafsz >> 24;
+  buf[1] = leafsz >> 16;
+  buf[2] = leafsz >> 8;
+  buf[3] = leafsz;
+  for ( i=0; i<8; i++ ) buf[4+i] = length >> (56 - 8*i);
+}
+
+static void tree_digest(const unsigned long leafsz, const unsigned long long length,
+                        const unsigned char *root, unsigned char *hash, const unsigned sz) {
+  unsigned char buf[1 + TREE_HDRSZ];
+  struct s0_digest *d = s0_digest_new();
+  buf[0] = 2;
+  tree_encode(buf + 1, leafsz, length);
+  s0_digest_update(d, buf, sizeof(buf));
+  s0_digest_update(d, root, s0_hash_size());
+  s0_digest_done(d, hash, sz);
+}
+
+static void tree_prove(const unsigned char *leaves, const unsigned long lo, const unsigned long hi,
+                       const unsigned long a, const unsigned long b, struct bufio *w) {
+  /* an 'H' header for each subtree of [lo,hi) outside leaves [a,b) */
+  unsigned hsz = s0_hash_size();
+  unsigned char node[hsz];
+  unsigned long k;
+
+  if ( a <= lo && hi <= b ) return;
+  if ( hi <= a || b <= lo ) {
+    tree_node(leaves + lo*hsz, hi - lo, node);
+    s0_write_header(w, 'H', node, hsz);
+    return;
+  }
+  k = tree_split(hi - lo);
+  tree_prove(leaves, lo, lo + k, a, b, w);
+  tree_prove(leaves, lo + k, hi, a, b, w);
+}
+
+struct proof {
+  unsigned long long off, len;   /* the bytes it covers */
+  unsigned char *nodes;
+  unsigned n, used;
+};
+
+static int tree_check(const struct tree *piece, const unsigned long lo, const unsigned long hi,
+                      const unsigned long a, struct proof *pf, unsigned char *out) {
+  /* the root of [lo,hi) from the piece's leaves, from a onwards, and
+   * the proof; 0 if the proof runs short */
+  unsigned hsz = s0_hash_size();
+  unsigned char left[hsz], right[hsz];
+  unsigned long b = a + piece->n, k;
+
+  if ( a <= lo && hi <= b ) {
+    tree_node(piece->leaves + (lo - a)*hsz, hi - lo, out);
+    return 1;
+  }
+  if ( hi <= a || b <= lo ) {
+    if ( pf->used == pf->n ) return 0;
+    memcpy(out, pf->nodes + pf->used++ * hsz, hsz);
+    return 1;
+  }
+  k = tree_split(hi - lo);
+  if ( ! tree_check(piece, lo, lo + k, a, pf, left) ) return 0;
+  if ( ! tree_check(piece, lo + k, hi, a, pf, right) ) return 0;
+  tree_join(left, right, out);
+  return 1;
+}
+
+void s0_tree_stream(const int infd, const unsigned long leafsz, unsigned char *hash, unsigned sz) {
+  unsigned char root[s0_hash_size()];
+  struct tree t;
+  struct bufio r;
+
+  bufio_open(&r, infd);
+  tree_leaves(&r, &t, leafsz);
+  bufio_close(&r);
+  tree_node(t.leaves, t.n, root);
+  tree_digest(leafsz, t.length, root, hash, sz);
+  free(t.leaves);
+}
+
+
+/*
+ * signed and digested streams
+ * after s0_sign_next the next encryption also signs its plaintext,
+ * and after s0_check_next the next decryption checks its plaintext
+ * against a 'G' packet.  after s0_tee_next the next encryption or
+ * decryption also writes the digest of its plaintext, or of the whole
+ * encrypted stream, as sha256sum prints it.  the hashing is done by
+ * taps on the stream's bufios, in the same pass over the data.  a
+ * checked stream's plaintext is written before the signature can be
+ * checked; a bad signature still fails the command.
+ */
+
+#define SIG_NONE  0
+#define SIG_SIGN  1
+#define SIG_CHECK 2
+
+static struct asymkey *sigkey;
+static int sigdesc = -1, sigmode;
+static int teefd[2] = { -1, -1 };     /* S0_TEE_PLAIN, S0_TEE_CIPHER */
+
+struct tap {
+  struct s0_digest *d[2];
+  unsigned n;
+};
+
+static struct tap taps[2];
+static struct s0_digest *sigdigest, *teedigest[2];
+
+void s0_sign_next(struct asymkey *akeyp, struct asymkey *signer, const int fd) {
+  /* signer keeps a copy of akeyp, so loading another key before the
+   * encryption doesn't change who signs.  with an agent the agent
+   * signs, and akeyp holds only the public half */
   unsigned char buf[BUFSZ];
-  int len;
-  s0_hash_init();
-  while ( (len=read(infd, buf, sizeof(buf))) > 0 ) {
-    s0_hash_update(buf, len);
+  unsigned long sz = sizeof(buf);
+
+  s0_asym_export(buf, &sz, agentfd < 0, akeyp);
+  s0_asym_import(buf, sz, s0_asym_type(akeyp), signer);
+  zeromem(buf, sizeof(buf));
+  sigkey = signer;
+  sigdesc = fd;
+  sigmode = SIG_SIGN;
+}
+
+void s0_check_next(struct asymkey *akeyp, struct asymkey *signer, const int fd) {
+  /* signer keeps a copy of the public half of akeyp */
+  unsigned char buf[BUFSZ];
+  unsigned long sz = sizeof(buf);
+
+  s0_asym_export(buf, &sz, 0, akeyp);
+  s0_asym_import(buf, sz, s0_asym_type(akeyp), signer);
+  sigkey = signer;
+  sigdesc = fd;
+  sigmode = SIG_CHECK;
+}
+
+void s0_tee_next(const unsigned which, const int fd) {
+  if ( which > S0_TEE_CIPHER ) DIED("bad digest", which);
+  teefd[which] = fd;
+}
+
+static void s0_write_sig(struct asymkey *akeyp, const unsigned char *hash,
+                         const unsigned hashsz, const unsigned char *tree, const int fd) {
+  /* tree: the 'M' header of a tree hash, NULL for a plain one */
+  unsigned char sig[BUFSZ];
+  unsigned long sigsz = sizeof(sig);
+  struct metrics_mark m;
+  struct bufio w;
+
+  metrics_start(PH_PK, &m);
+  if ( agentfd < 0 ) {
+    s0_asym_sign(akeyp, hash, hashsz, sig, &sigsz);
+  } else {
+    agent_call(agentfd, AGENT_SIGN, hash, hashsz, sig, &sigsz);
   }
-  s0_hash_done(hash, sz);
+  metrics_stop(PH_PK, &m);
+
+  bufio_open(&w, fd);
+  s0_write_magic(&w, 'G');
+  if ( tree ) s0_write_header(&w, 'M', (unsigned char *)tree, TREE_HDRSZ);
+  s0_write_type(&w, s0_asym_type(akeyp));
+  bufio_write(&w, sig, sigsz, "writing signature");
+  bufio_flush(&w, "writing signature");
+  bufio_close(&w);
+}
+
+static unsigned long s0_read_tree(struct bufio *r, unsigned long long *length, struct proof *pf) {
+  /* the leaf size of a tree signature, 0 if it isn't one; a proof's
+   * nodes are allocated in pf, if it has any */
+  unsigned char buf[2*8];
+  unsigned long leafsz;
+  unsigned hsz = s0_hash_size(), i;
+
+  memset(pf, 0, sizeof(*pf));
+  if ( bufio_peek(r, "reading header") != 'M' ) return 0;
+  if ( s0_read_header(r, 'M', buf, sizeof(buf)) != TREE_HDRSZ ) DIE("bad tree header");
+  leafsz = (unsigned long)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+  if ( leafsz < MIN_TREE_LEAFSZ || leafsz > MAX_TREE_LEAFSZ ) DIE("bad leaf size");
+  for ( *length=0, i=0; i<8; i++ ) *length = *length << 8 | buf[4+i];
+  if ( bufio_peek(r, "reading header") != 'Q' ) return leafsz;
+
+  if ( s0_read_header(r, 'Q', buf, sizeof(buf)) != sizeof(buf) ) DIE("bad proof header");
+  for ( i=0; i<8; i++ ) {
+    pf->off = pf->off << 8 | buf[i];
+    pf->len = pf->len << 8 | buf[8+i];
+  }
+  if ( ! (pf->nodes=malloc(TREE_MAXPROOF * hsz)) ) DIE("allocating proof");
+  while ( bufio_peek(r, "reading header") == 'H' ) {
+    if ( pf->n == TREE_MAXPROOF ) DIE("proof too long");
+    if ( s0_read_header(r, 'H', pf->nodes + pf->n++ * hsz, hsz) != hsz ) DIE("bad proof node");
+  }
+  return leafsz;
 }
 
+static void s0_check_hash(struct asymkey *akeyp, const unsigned char *hash, const unsigned hashsz,
+                          const unsigned char *sig, const unsigned long sigsz) {
+  struct metrics_mark m;
+  int ok;
+
+  metrics_start(PH_PK, &m);
+  ok = s0_asym_verify(akeyp, hash, hashsz, sig, sigsz);
+  metrics_stop(PH_PK, &m);
+  if ( ! ok ) DIE("verification failed");
+}
+
+static void s0_check_sig(struct asymkey *akeyp, const unsigned char *hash,
+                         const unsigned hashsz, const int fd) {
+  unsigned char sig[BUFSZ];
+  unsigned long sigsz = sizeof(sig);
+  unsigned long long length;
+  struct proof pf;
+  struct bufio r;
+
+  bufio_open(&r, fd);
+  s0_read_magic(&r, 'G');
+  if ( s0_read_tree(&r, &length, &pf) ) DIE("signature is of a tree hash");
+  if ( s0_read_type(&r) != s0_asym_type(akeyp) ) DIE("signature is not for this key type");
+  sigsz = bufio_read(&r, sig, sigsz, "reading signature");
+  bufio_close(&r);
+
+  s0_check_hash(akeyp, hash, hashsz, sig, sigsz);
+}
+
+static void digest_tap(void *ctx, const unsigned char *buf, size_t len) {
+  struct tap *t = ctx;
+  unsigned i;
+  for ( i=0; i<t->n; i++ ) s0_digest_update(t->d[i], buf, len);
+}
+
+static void s0_tap_open(struct bufio *plain, struct bufio *cipher, const int mode) {
+  /* start whatever hashes are pending for this stream; call before
+   * any header goes through cipher */
+  struct bufio *b[2];
+  unsigned i;
+
+  b[S0_TEE_PLAIN] = plain;
+  b[S0_TEE_CIPHER] = cipher;
+  for ( i=0; i<2; i++ ) {
+    if ( (sigmode == mode && sigdesc == b[i]->fd) ||
+         teefd[S0_TEE_PLAIN] == b[i]->fd || teefd[S0_TEE_CIPHER] == b[i]->fd )
+      DIE("digest or signature descriptor is the stream's own");
+  }
+  memset(taps, 0, sizeof(taps));
+  if ( sigmode == mode ) {
+    sigdigest = s0_digest_new();
+    taps[S0_TEE_PLAIN].d[taps[S0_TEE_PLAIN].n++] = sigdigest;
+  }
+  for ( i=0; i<2; i++ ) {
+    if ( teefd[i] >= 0 ) {
+      teedigest[i] = s0_digest_new();
+      taps[i].d[taps[i].n++] = teedigest[i];
+    }
+    if ( taps[i].n ) {
+      b[i]->tap = digest_tap;
+      b[i]->tapctx = &taps[i];
+    }
+  }
+}
+
+static void s0_tap_close(const int fd) {
+  /* done with fd, unless a digest still to be written goes there too */
+  if ( fd == teefd[S0_TEE_PLAIN] || fd == teefd[S0_TEE_CIPHER] ) return;
+  if ( sigdigest && fd == sigdesc ) return;
+  close(fd);
+}
+
+static void s0_tap_done(void) {
+  /* write the digests, then sign or check, closing their descriptors */
+  unsigned char hash[s0_hash_size()];
+  unsigned i, j;
+  int mode = sigmode, fd;
+
+  for ( i=0; i<2; i++ ) {
+    if ( ! teedigest[i] ) continue;
+    s0_digest_done(teedigest[i], hash, sizeof(hash));
+    teedigest[i] = NULL;
+    fd = teefd[i];
+    teefd[i] = -1;
+    for ( j=0; j<sizeof(hash); j++ ) dprintf(fd, "%02x", hash[j]);
+    dprintf(fd, "  -\n");
+    s0_tap_close(fd);
+  }
+  memset(taps, 0, sizeof(taps));
+  if ( ! sigdigest ) return;
+
+  s0_digest_done(sigdigest, hash, sizeof(hash));
+  sigdigest = NULL;
+  sigmode = SIG_NONE;
+  if ( mode == SIG_SIGN ) {
+    s0_write_sig(sigkey, hash, sizeof(hash), NULL, sigdesc);
+  } else {
+    s0_check_sig(sigkey, hash, sizeof(hash), sigdesc);
+  }
+  s0_tap_close(sigdesc);
+  sigdesc = -1;
+}
+
+static void s0_tap_forget(void) {
+  /* a forked child leaves the pending hashes to its parent */
+  sigmode = SIG_NONE;
+  teefd[S0_TEE_PLAIN] = teefd[S0_TEE_CIPHER] = -1;
+}
+
+
+static void s0_encrypt_payload(struct bufio *r, struct bufio *w,
+                               const unsigned char *skey, const unsigned char *iv) {
+  /* the caller has written every header but the segment size */
+  if ( format == SPOR_SEGMENTED_VERSION ) s0_write_segsz(w, SEGSZ);
+  if ( compress != COMPRESS_NONE ) {
+    s0_pack_stream(r, w, skey, iv);
+  } else if ( format == SPOR_SEGMENTED_VERSION ) {
+    s0_seal_stream(r, w, skey, iv, SEGSZ);
+  } else {
+    s0_cipher_init(skey, iv, KEYSZ_SYM);
+    s0_cipher_stream(r, w, NULL, 0);
+    s0_cipher_done();
+  }
+}
+
+static void s0_ctr_range(struct bufio *r, struct bufio *w,
+                         const unsigned char *skey, const unsigned char *iv,
+                         unsigned long long offset, unsigned long long length) {
+  /* seek past offset bytes of ciphertext and start the counter there */
+  unsigned char *buf;
+  size_t chunk = bufio_chunksz(), len;
+
+  if ( ! (buf=malloc(chunk)) ) DIE("allocating buffer");
+  bufio_skip(r, offset, "seeking");
+  if ( length && offset && bufio_peek(r, "reading") < 0 ) DIE("range beyond end of stream");
+
+  s0_cipher_init(skey, iv, KEYSZ_SYM);
+  while ( length &&
+          (len=bufio_read(r, buf, (length < chunk) ? length : chunk, "reading")) > 0 ) {
+    s0_cipher_crypt_at(buf, len, offset);
+    bufio_write(w, buf, len, "writing");
+    offset += len;
+    length -= len;
+  }
+  bufio_flush(w, "writing");
+  s0_cipher_done();
+
+  zeromem(buf, chunk);
+  free(buf);
+}
+
+static void s0_open_range(struct bufio *r, struct bufio *w,
+                          const unsigned char *key, const unsigned char *prefix,
+                          const size_t segsz,
+                          unsigned long long offset, unsigned long long length) {
+  /* open only the segments covering the range */
+  unsigned char *buf;
+  unsigned long long idx = offset / segsz;
+  size_t skip = offset % segsz, len;
+  int last = 0;
+
+  if ( ! (buf=malloc(segsz + AEAD_TAGSZ)) ) DIE("allocating buffer");
+  bufio_skip(r, idx * (segsz + AEAD_TAGSZ), "seeking");
+
+  while ( length && ! last ) {
+    len = bufio_read(r, buf, segsz + AEAD_TAGSZ, "reading");
+    if ( len < AEAD_TAGSZ ) DIE("range beyond end of stream");
+    len -= AEAD_TAGSZ;
+    last = len < segsz || bufio_peek(r, "reading") < 0;
+    if ( ! s0_seg_crypt(key, prefix, buf, len, idx, last, 1) )
+      DIED("authentication failed in segment", (int)idx);
+
+    len = (skip < len) ? len - skip : 0;
+    if ( len > length ) len = length;
+    bufio_write(w, buf + skip, len, "writing");
+    length -= len;
+    skip = 0;
+    idx++;
+  }
+  bufio_flush(w, "writing");
+
+  zeromem(buf, segsz + AEAD_TAGSZ);
+  free(buf);
+}
+
+static void s0_decrypt_payload(struct bufio *r, struct bufio *w, const unsigned version,
+                               const unsigned long blocksz,
+                               const unsigned char *skey, const unsigned char *iv,
+                               const unsigned ivsz,
+                               unsigned long long offset, unsigned long long length) {
+  /* the whole stream, or length bytes of plaintext from offset.
+   * blocksz is from the C header, 0 if there was none */
+  int whole = (offset == 0 && length == S0_TO_END);
+  unsigned long segsz;
+  struct unpack u, *up = NULL;
+
+  if ( ! whole && (taps[0].n || taps[1].n) ) DIE("cannot hash a range");
+  if ( ! whole && blocksz ) DIE("cannot decrypt a range of a compressed stream");
+  if ( blocksz ) {
+    unpack_open(&u, w, blocksz);
+    up = &u;
+  }
+  if ( version == SPOR_SEGMENTED_VERSION ) {
+    if ( ivsz != NONCE_PREFIXSZ ) DIE("bad nonce header");
+    segsz = s0_read_segsz(r);
+    if ( whole ) {
+      s0_open_stream(r, w, skey, iv, segsz, up);
+    } else {
+      s0_open_range(r, w, skey, iv, segsz, offset, length);
+    }
+  } else if ( whole ) {
+    s0_cipher_init(skey, iv, KEYSZ_SYM);
+    s0_cipher_stream(r, w, up, 0);
+    s0_cipher_done();
+  } else {
+    s0_ctr_range(r, w, skey, iv, offset, length);
+  }
+  if ( up ) unpack_done(up);
+}
+
+static unsigned s0_iv_size(void) {
+  /* segmented streams carry a nonce prefix in the IV header */
+  return (format == SPOR_SEGMENTED_VERSION) ? NONCE_PREFIXSZ : KEYSZ_SYM;
+}
+
+
+/*
+ * derived key cache
+ * normally every stream pays for the KDF.  a batch unlocks many
+ * files with one password, so it turns the cache on: encryption
+ * then shares one salt across the batch, and decryption derives once
+ * per distinct salt.  no two files share a cipher key, though: each
+ * gets a random 'U' salt and is encrypted under s0_subkey of the
+ * derived key and it.  the IV stays random per file.
+ */
+
+#define KEYCACHESZ 16
+
+static struct {
+  unsigned char salt[SALTSZ];
+  struct s0_kdf kdf;
+  unsigned char key[KEYSZ_SYM];
+} keycache[KEYCACHESZ];
+static unsigned keycache_on, keycache_n;
+static unsigned char batch_salt[SALTSZ];
+
+static void s0_get_key(unsigned char *skey, unsigned char *pwbuf, const unsigned pwsz,
+                       unsigned char *salt, const struct s0_kdf *kdf) {
+  unsigned i;
+
+  if ( ! keycache_on ) {
+    s0_derive_key(skey, KEYSZ_SYM, pwbuf, pwsz, salt, SALTSZ, kdf);
+    return;
+  }
+  for ( i=0; i<keycache_n && i<KEYCACHESZ; i++ ) {
+    if ( ! memcmp(keycache[i].salt, salt, SALTSZ) &&
+         ! memcmp(&keycache[i].kdf, kdf, sizeof(*kdf)) ) {
+      memcpy(skey, keycache[i].key, KEYSZ_SYM);
+      return;
+    }
+  }
+  s0_derive_key(skey, KEYSZ_SYM, pwbuf, pwsz, salt, SALTSZ, kdf);
+  i = keycache_n++ % KEYCACHESZ;
+  memcpy(keycache[i].salt, salt, SALTSZ);
+  keycache[i].kdf = *kdf;
+  memcpy(keycache[i].key, skey, KEYSZ_SYM);
+}
+
+void s0_set_keycache(const unsigned on, unsigned char *pwbuf, const unsigned pwsz) {
+  /* turning it off forgets every key; turning it on with a password
+   * derives the batch encryption key up front */
+  unsigned char skey[KEYSZ_SYM];
+  struct s0_kdf kdf;
+
+  zeromem(keycache, sizeof(keycache));
+  keycache_n = 0;
+  keycache_on = on;
+  if ( ! on ) return;
+  s0_prng_getbytes(batch_salt, sizeof(batch_salt));
+  s0_kdf_current(&kdf);
+  if ( pwsz ) s0_get_key(skey, pwbuf, pwsz, batch_salt, &kdf);
+  zeromem(skey, sizeof(skey));
+}
+
+void s0_after_fork(void) {
+  /* a child must not share PRNG state or an agent connection */
+  s0_prng_done();
+  s0_tap_forget();
+  metrics_forget();
+  if ( agentfd >= 0 ) {
+    close(agentfd);
+    agentfd = agent_connect(agentpath);
+  }
+}
 
 
 void s0_encrypt_stream (const int infd, const int outfd,
@@ -173,22 +1380,90 @@ void s0_encrypt_stream (const int infd, const int outfd,
    */
   unsigned char skey[KEYSZ_SYM];
   unsigned char iv[sizeof(skey)];
-  unsigned char salt[SALTSZ];
+  unsigned char salt[SALTSZ], usalt[SALTSZ];
+  struct s0_kdf kdf;
+  struct bufio r, w;
 
   if ( ! pwsz ) DIE("no passphrase");
 
   s0_prng_getbytes(iv, sizeof(iv));
-  s0_prng_getbytes(salt, sizeof(salt));
-  s0_derive_key(skey, sizeof(skey), pwbuf, pwsz, salt, sizeof(salt));
+  if ( keycache_on ) {
+    memcpy(salt, batch_salt, sizeof(salt));
+    s0_prng_getbytes(usalt, sizeof(usalt));
+  } else {
+    s0_prng_getbytes(salt, sizeof(salt));
+  }
 
-  s0_write_magic(outfd, 'S');
-  s0_write_header(outfd, 'I', iv, sizeof(iv));
-  s0_write_header(outfd, 'L', salt, sizeof(salt));
+  bufio_open(&r, infd);
+  bufio_open(&w, outfd);
+  s0_tap_open(&r, &w, SIG_SIGN);
+  s0_write_magic_version(&w, 'S', format);
+  s0_write_kdf(&w, &kdf);
+  s0_get_key(skey, pwbuf, pwsz, salt, &kdf);
+  s0_write_compress(&w, CBLOCKSZ);
+  if ( keycache_on ) {
+    s0_write_header(&w, 'U', usalt, sizeof(usalt));
+    s0_subkey(skey, usalt, skey);
+  }
+  s0_write_header(&w, 'I', iv, s0_iv_size());
+  s0_write_header(&w, 'L', salt, sizeof(salt));
 
-  s0_cipher_init(skey, iv, sizeof(skey));
-  s0_filter_stream(infd, outfd, s0_cipher_encrypt);
-  s0_cipher_done();
+  s0_encrypt_payload(&r, &w, skey, iv);
+  s0_tap_done();
+
+  bufio_close(&r);
+  bufio_close(&w);
+  zeromem(skey, sizeof(skey));
+}
+
+static unsigned s0_read_sym_header(struct bufio *r, unsigned char *pwbuf, const unsigned pwsz,
+                                   unsigned char *skey, unsigned char *iv,
+                                   unsigned *ivsz, unsigned long *blocksz) {
+  /* an 'S' packet's headers, and its key; returns the version */
+  unsigned char salt[SALTSZ], usalt[SALTSZ];
+  unsigned version, sub = 0;
+  struct s0_kdf kdf;
+
+  version = s0_read_magic(r, 'S');
+  s0_read_kdf(r, &kdf);
+  *blocksz = s0_read_compress(r);
+  if ( bufio_peek(r, "reading header") == 'U' ) {
+    if ( s0_read_header(r, 'U', usalt, sizeof(usalt)) != sizeof(usalt) ) DIE("bad key salt header");
+    sub = 1;
+  }
+  *ivsz = s0_read_header(r, 'I', iv, KEYSZ_SYM);
+  s0_read_header(r, 'L', salt, sizeof(salt));
+
+  s0_get_key(skey, pwbuf, pwsz, salt, &kdf);
+  if ( sub ) s0_subkey(skey, usalt, skey);
+  return version;
+}
+
+void s0_decrypt_range(const int infd, const int outfd,
+                      unsigned char *pwbuf, const unsigned pwsz,
+                      const unsigned long long offset,
+                      const unsigned long long length) {
+  /* read header and ciphertext, write length bytes of plaintext
+   * starting at offset.  seekable input is seeked, not read.
+   */
+  unsigned char skey[KEYSZ_SYM];
+  unsigned char iv[sizeof(skey)];
+  unsigned version, ivsz;
+  unsigned long blocksz;
+  struct bufio r, w;
+
+  if ( ! pwsz ) DIE("no passphrase");
+
+  bufio_open(&r, infd);
+  bufio_open(&w, outfd);
+  s0_tap_open(&w, &r, SIG_CHECK);
+  version = s0_read_sym_header(&r, pwbuf, pwsz, skey, iv, &ivsz, &blocksz);
 
+  s0_decrypt_payload(&r, &w, version, blocksz, skey, iv, ivsz, offset, length);
+  s0_tap_done();
+
+  bufio_close(&r);
+  bufio_close(&w);
   zeromem(skey, sizeof(skey));
 }
 
@@ -196,86 +1471,566 @@ void s0_decrypt_stream(const int infd, const int outfd,
                        unsigned char *pwbuf, const unsigned pwsz) {
   /* read header and ciphertext, write plaintext
    */
-  unsigned char skey[KEYSZ_SYM];
-  unsigned char iv[sizeof(skey)], salt[SALTSZ];
+  s0_decrypt_range(infd, outfd, pwbuf, pwsz, 0, S0_TO_END);
+}
 
-  if ( ! pwsz ) DIE("no passphrase");
 
-  s0_read_magic(infd, 'S');
-  s0_read_header(infd, 'I', iv, sizeof(iv));
-  s0_read_header(infd, 'L', salt, sizeof(salt));
+/*
+ * appending
+ * a format 1 payload is CTR at a running offset, so more plaintext
+ * can be encrypted onto the end of a stream given its key: the
+ * counter picks up at the length of the ciphertext already there.
+ * segmented streams seal their last segment and compressed ones end
+ * on a frame, so neither can grow.  the stream is read for its
+ * headers and written at its end, so it must be a file open for both.
+ */
 
-  s0_derive_key(skey, sizeof(skey), pwbuf, pwsz, salt, sizeof(salt));
+static void s0_append_check(void) {
+  /* a digest or signature would cover the new data alone */
+  if ( sigmode != SIG_NONE || teefd[S0_TEE_PLAIN] >= 0 || teefd[S0_TEE_CIPHER] >= 0 )
+    DIE("cannot sign or hash an appended stream");
+}
 
-  s0_cipher_init(skey, iv, sizeof(skey));
-  s0_filter_stream(infd, outfd, s0_cipher_decrypt);
+static void s0_append_payload(struct bufio *hr, const int infd, const unsigned version,
+                              const unsigned long blocksz,
+                              const unsigned char *skey, const unsigned char *iv) {
+  /* hr has read the stream's headers */
+  struct bufio r, w;
+  struct stat st;
+  off_t payload;
+
+  if ( version != SPOR_ONDISK_VERSION ) DIE("cannot append to a segmented stream");
+  if ( blocksz ) DIE("cannot append to a compressed stream");
+  if ( fstat(hr->fd, &st) || ! S_ISREG(st.st_mode) ) DIE("can only append to a file");
+  if ( (payload=lseek(hr->fd, 0, SEEK_CUR)) < 0 ) DIES("seeking stream");
+  payload = st.st_size - (payload - (off_t)(hr->len - hr->pos));
+  if ( lseek(hr->fd, 0, SEEK_END) < 0 ) DIES("seeking stream");
+
+  bufio_open(&r, infd);
+  bufio_open(&w, hr->fd);
+  s0_cipher_init(skey, iv, KEYSZ_SYM);
+  s0_cipher_stream(&r, &w, NULL, payload);
   s0_cipher_done();
+  bufio_close(&r);
+  bufio_close(&w);
+}
+
+void s0_append_stream(const int infd, const int fd,
+                      unsigned char *pwbuf, const unsigned pwsz) {
+  /* encrypt the input onto the end of the 'S' stream on fd */
+  unsigned char skey[KEYSZ_SYM];
+  unsigned char iv[sizeof(skey)];
+  unsigned version, ivsz;
+  unsigned long blocksz;
+  struct bufio hr;
+
+  if ( ! pwsz ) DIE("no passphrase");
+  s0_append_check();
 
+  bufio_open(&hr, fd);
+  version = s0_read_sym_header(&hr, pwbuf, pwsz, skey, iv, &ivsz, &blocksz);
+  s0_append_payload(&hr, infd, version, blocksz, skey, iv);
+  bufio_close(&hr);
   zeromem(skey, sizeof(skey));
 }
 
 
 void s0_sign_stream(struct asymkey *akeyp, const int infd, const int sigfd) {
-  unsigned char hash[s0_hash_size()], sig[BUFSZ];
-  unsigned long sigsz = sizeof(sig);
-  s0_hash_stream(infd, hash, sizeof(hash));
-  s0_asym_sign(akeyp, hash, sizeof(hash), sig, &sigsz);
-  s0_write_magic(sigfd, 'G');
-  write_or_die(sigfd, sig, sigsz, "writing signature");
+  unsigned char hash[s0_hash_size()], root[sizeof(hash)], hdr[TREE_HDRSZ];
+  struct tree t;
+  struct bufio r;
+
+  if ( ! treeleaf ) {
+    s0_hash_stream(infd, hash, sizeof(hash));
+    s0_write_sig(akeyp, hash, sizeof(hash), NULL, sigfd);
+    return;
+  }
+  bufio_open(&r, infd);
+  tree_leaves(&r, &t, treeleaf);
+  bufio_close(&r);
+  tree_node(t.leaves, t.n, root);
+  tree_digest(t.leafsz, t.length, root, hash, sizeof(hash));
+  tree_encode(hdr, t.leafsz, t.length);
+  free(t.leaves);
+  s0_write_sig(akeyp, hash, sizeof(hash), hdr, sigfd);
+}
+
+unsigned s0_read_sig(const int sigfd, const unsigned type, unsigned char *sig, const unsigned sz,
+                     unsigned long *leafsz) {
+  /* the signature from a 'G' packet by a key of this type, 0 if it
+   * isn't one or is a proof.  leafsz is set for a tree hash */
+  unsigned char hdr[4];
+  unsigned long long length;
+  unsigned len;
+  struct proof pf;
+  struct bufio r;
+
+  bufio_open(&r, sigfd);
+  len = bufio_read(&r, hdr, sizeof(hdr), "reading signature");
+  if ( len < sizeof(hdr) || hdr[0] != 's' || hdr[1] != '0' ||
+       hdr[2] != SPOR_ONDISK_VERSION || hdr[3] != 'G' ) {
+    len = 0;
+  } else {
+    *leafsz = s0_read_tree(&r, &length, &pf);
+    if ( pf.nodes || s0_read_type(&r) != type ) {
+      len = 0;
+    } else {
+      len = bufio_read(&r, sig, sz, "reading signature");
+    }
+    free(pf.nodes);
+  }
+  bufio_close(&r);
+  return len;
 }
 
 void s0_verify_stream(struct asymkey *akeyp, const int infd, const int sigfd) {
-  unsigned char hash[s0_hash_size()], sig[BUFSZ];
-  unsigned long sigsz = sizeof(sig);
-  unsigned success;
+  /* a plain or tree signature of the input, or a proof for a piece
+   * of a tree-signed input with the input the piece alone */
+  unsigned char hash[s0_hash_size()], root[sizeof(hash)], sig[BUFSZ];
+  unsigned long sigsz = sizeof(sig), leafsz;
+  unsigned long long length;
+  struct proof pf;
+  struct tree t;
+  struct bufio r;
+
+  bufio_open(&r, sigfd);
+  s0_read_magic(&r, 'G');
+  leafsz = s0_read_tree(&r, &length, &pf);
+  if ( s0_read_type(&r) != s0_asym_type(akeyp) ) DIE("signature is not for this key type");
+  sigsz = bufio_read(&r, sig, sigsz, "reading signature");
+  bufio_close(&r);
+
+  if ( ! leafsz ) {
+    s0_hash_stream(infd, hash, sizeof(hash));
+  } else if ( ! pf.nodes ) {
+    s0_tree_stream(infd, leafsz, hash, sizeof(hash));
+  } else {
+    bufio_open(&r, infd);
+    tree_leaves(&r, &t, leafsz);
+    bufio_close(&r);
+    if ( t.length != pf.len || pf.off % leafsz || pf.off + pf.len > length ) DIE("verification failed");
+    if ( ! tree_check(&t, 0, length ? (length + leafsz - 1) / leafsz : 1, pf.off / leafsz, &pf, root) ||
+         pf.used != pf.n ) DIE("verification failed");
+    tree_digest(leafsz, length, root, hash, sizeof(hash));
+    free(t.leaves);
+    free(pf.nodes);
+  }
+  s0_check_hash(akeyp, hash, sizeof(hash), sig, sigsz);
+}
 
-  s0_hash_stream(infd, hash, sizeof(hash));
+void s0_prove_range(const int infd, const int sigfd, const int outfd,
+                    unsigned long long offset, unsigned long long length) {
+  /* cut the proof for the leaves holding offset..offset+length out of
+   * a tree signature of the input */
+  unsigned char hdr[TREE_HDRSZ], buf[2*8], sig[BUFSZ];
+  unsigned long sigsz = sizeof(sig), leafsz, a, b;
+  unsigned long long total, end;
+  unsigned type, i;
+  struct proof pf;
+  struct tree t;
+  struct bufio r, w;
+
+  bufio_open(&r, sigfd);
+  s0_read_magic(&r, 'G');
+  if ( ! (leafsz=s0_read_tree(&r, &total, &pf)) || pf.nodes ) DIE("not a tree signature");
+  type = s0_read_type(&r);
+  sigsz = bufio_read(&r, sig, sigsz, "reading signature");
+  bufio_close(&r);
+
+  bufio_open(&r, infd);
+  tree_leaves(&r, &t, leafsz);
+  bufio_close(&r);
+  if ( t.length != total ) DIE("input is not the signed length");
+  if ( offset % leafsz || offset >= total || ! length ) DIE("bad range");
+  end = (length > total - offset) ? total : offset + length;
+  a = offset / leafsz;
+  b = (end + leafsz - 1) / leafsz;
+  end = (b * leafsz < total) ? b * leafsz : total;
+
+  tree_encode(hdr, leafsz, total);
+  for ( i=0; i<8; i++ ) {
+    buf[i] = offset >> (56 - 8*i);
+    buf[8+i] = (end - offset) >> (56 - 8*i);
+  }
+  bufio_open(&w, outfd);
+  s0_write_magic(&w, 'G');
+  s0_write_header(&w, 'M', hdr, sizeof(hdr));
+  s0_write_header(&w, 'Q', buf, sizeof(buf));
+  tree_prove(t.leaves, 0, t.n, a, b, &w);
+  s0_write_type(&w, type);
+  bufio_write(&w, sig, sigsz, "writing signature");
+  bufio_flush(&w, "writing signature");
+  bufio_close(&w);
+  free(t.leaves);
+}
 
-  s0_read_magic(sigfd, 'G');
-  sigsz = read_or_die(sigfd, sig, sigsz, "reading signature");
 
-  success = s0_asym_verify(akeyp, hash, sizeof(hash), sig, sigsz);
-  if ( ! success ) DIE("verification failed");
+/*
+ * recipients
+ * 'A' streams written after s0_add_recipient carry one R,K pair per
+ * recipient ahead of I, so the payload is encrypted once for all of
+ * them and a reader unwraps only the K under its own key id.
+ * with no recipients listed, the key in memory is the only one and
+ * the stream keeps the single-K layout, after a 'T' header for any
+ * key but P-521.  listed recipients may mix key types.
+ */
+
+static struct asymkey *recips[MAXRECIPS];
+static unsigned nrecips;
+
+void s0_key_id(struct asymkey *akeyp, unsigned char *id) {
+  /* leading bytes of the hash of the public key */
+  unsigned char buf[BUFSZ], hash[s0_hash_size()];
+  unsigned long sz = sizeof(buf);
+
+  s0_asym_export(buf, &sz, 0, akeyp);
+  s0_hash_init();
+  s0_hash_update(buf, sz);
+  s0_hash_done(hash, sizeof(hash));
+  memcpy(id, hash, KEYIDSZ);
 }
 
+void s0_add_recipient(struct asymkey *akeyp) {
+  /* the list keeps a copy of the public half of akeyp */
+  unsigned char buf[BUFSZ];
+  unsigned long sz = sizeof(buf);
+
+  if ( nrecips == MAXRECIPS ) DIED("too many recipients", MAXRECIPS);
+  s0_asym_export(buf, &sz, 0, akeyp);
+  recips[nrecips] = s0_asym_new();
+  s0_asym_import(buf, sz, s0_asym_type(akeyp), recips[nrecips++]);
+}
 
 void s0_asym_encrypt_stream(struct asymkey *akeyp, const int infd, const int outfd) {
   unsigned char skey[KEYSZ_SYM];
-  unsigned char iv[sizeof(skey)], skey_crypt[BUFSZ];
+  unsigned char iv[sizeof(skey)], skey_crypt[BUFSZ], id[KEYIDSZ];
   unsigned long cryptlen = sizeof(skey_crypt);
+  struct metrics_mark m;
+  struct bufio r, w;
 
   s0_prng_getbytes(skey, sizeof(skey));
   s0_prng_getbytes(iv, sizeof(iv));
 
-  s0_asym_encrypt_key(akeyp, skey, sizeof(skey), skey_crypt, &cryptlen);
+  bufio_open(&r, infd);
+  bufio_open(&w, outfd);
+  s0_tap_open(&r, &w, SIG_SIGN);
+  s0_write_magic_version(&w, 'A', format);
+  if ( ! nrecips ) s0_write_type(&w, s0_asym_type(akeyp));
+  for ( unsigned i=0; i<nrecips; i++ ) {
+    cryptlen = sizeof(skey_crypt);
+    metrics_start(PH_PK, &m);
+    s0_asym_encrypt_key(recips[i], skey, sizeof(skey), skey_crypt, &cryptlen);
+    metrics_stop(PH_PK, &m);
+    s0_key_id(recips[i], id);
+    s0_write_header(&w, 'R', id, sizeof(id));
+    s0_write_header(&w, 'K', skey_crypt, cryptlen);
+  }
+  s0_write_compress(&w, CBLOCKSZ);
+  s0_write_header(&w, 'I', iv, s0_iv_size());
+  if ( ! nrecips ) {
+    metrics_start(PH_PK, &m);
+    s0_asym_encrypt_key(akeyp, skey, sizeof(skey), skey_crypt, &cryptlen);
+    metrics_stop(PH_PK, &m);
+    s0_write_header(&w, 'K', skey_crypt, cryptlen);
+  }
 
-  s0_write_magic(outfd, 'A');
-  s0_write_header(outfd, 'I', iv, sizeof(iv));
-  s0_write_header(outfd, 'K', skey_crypt, cryptlen);
+  s0_encrypt_payload(&r, &w, skey, iv);
+  s0_tap_done();
 
-  s0_cipher_init(skey, iv, sizeof(skey));
-  s0_filter_stream(infd, outfd, s0_cipher_encrypt);
-  s0_cipher_done();
+  bufio_close(&r);
+  bufio_close(&w);
+  zeromem(skey, sizeof(skey));
+}
+
+static unsigned long s0_read_recipients(struct bufio *r, unsigned char *id,
+                                        unsigned char *skey_crypt, unsigned *found) {
+  /* read every R,K pair, keeping the K under id.
+   * returns its length; *found counts the pairs read */
+  unsigned char rid[KEYIDSZ], buf[BUFSZ];
+  unsigned long len, cryptlen = 0;
+  unsigned n = 0;
+
+  while ( bufio_peek(r, "reading header") == 'R' ) {
+    if ( s0_read_header(r, 'R', rid, sizeof(rid)) != sizeof(rid) ) DIE("bad recipient id");
+    len = s0_read_header(r, 'K', buf, sizeof(buf));
+    if ( ! cryptlen && ! memcmp(rid, id, sizeof(rid)) ) {
+      memcpy(skey_crypt, buf, len);
+      cryptlen = len;
+    }
+    n++;
+  }
+  *found = n;
+  return cryptlen;
+}
 
+static unsigned s0_read_asym_header(struct bufio *r, struct asymkey *akeyp,
+                                    unsigned char *skey, unsigned char *iv,
+                                    unsigned *ivsz, unsigned long *blocksz) {
+  /* an 'A' packet's headers, and the key akeyp unwraps; returns the version */
+  unsigned char skey_crypt[BUFSZ], id[KEYIDSZ];
+  unsigned long cryptlen;
+  unsigned version, n, type;
+
+  version = s0_read_magic(r, 'A');
+  type = s0_read_type(r);
+  s0_key_id(akeyp, id);
+  cryptlen = s0_read_recipients(r, id, skey_crypt, &n);
+  *blocksz = s0_read_compress(r);
+  *ivsz = s0_read_header(r, 'I', iv, KEYSZ_SYM);
+  if ( ! n ) {
+    if ( type != s0_asym_type(akeyp) ) DIE("message is not for this key type");
+    cryptlen = s0_read_header(r, 'K', skey_crypt, sizeof(skey_crypt));
+  } else if ( ! cryptlen ) {
+    DIE("not a recipient of this stream");
+  }
+
+  s0_unwrap_key(akeyp, skey, skey_crypt, cryptlen);
+  return version;
+}
+
+void s0_asym_decrypt_range(struct asymkey *akeyp, const int infd, const int outfd,
+                           const unsigned long long offset,
+                           const unsigned long long length) {
+  unsigned char skey[KEYSZ_SYM];
+  unsigned char iv[sizeof(skey)];
+  unsigned long blocksz;
+  unsigned version, ivsz;
+  struct bufio r, w;
+
+  bufio_open(&r, infd);
+  bufio_open(&w, outfd);
+  s0_tap_open(&w, &r, SIG_CHECK);
+  version = s0_read_asym_header(&r, akeyp, skey, iv, &ivsz, &blocksz);
+
+  s0_decrypt_payload(&r, &w, version, blocksz, skey, iv, ivsz, offset, length);
+  s0_tap_done();
+
+  bufio_close(&r);
+  bufio_close(&w);
   zeromem(skey, sizeof(skey));
 }
 
 void s0_asym_decrypt_stream(struct asymkey *akeyp, const int infd, const int outfd) {
+  s0_asym_decrypt_range(akeyp, infd, outfd, 0, S0_TO_END);
+}
+
+void s0_asym_append_stream(struct asymkey *akeyp, const int infd, const int fd) {
+  /* encrypt the input onto the end of the 'A' stream on fd, whose
+   * key akeyp unwraps */
   unsigned char skey[KEYSZ_SYM];
-  unsigned char skey_crypt[BUFSZ], iv[sizeof(skey)];
-  unsigned long cryptlen;
+  unsigned char iv[sizeof(skey)];
+  unsigned long blocksz;
+  unsigned version, ivsz;
+  struct bufio hr;
 
-  s0_read_magic(infd, 'A');
-  s0_read_header(infd, 'I', iv, sizeof(iv));
-  cryptlen = s0_read_header(infd, 'K', skey_crypt, sizeof(skey_crypt));
+  s0_append_check();
 
-  s0_asym_decrypt_key(akeyp, skey, sizeof(skey), skey_crypt, cryptlen);
+  bufio_open(&hr, fd);
+  version = s0_read_asym_header(&hr, akeyp, skey, iv, &ivsz, &blocksz);
+  s0_append_payload(&hr, infd, version, blocksz, skey, iv);
+  bufio_close(&hr);
+  zeromem(skey, sizeof(skey));
+}
 
-  s0_cipher_init(skey, iv, sizeof(skey));
-  s0_filter_stream(infd, outfd, s0_cipher_decrypt);
-  s0_cipher_done();
+void s0_list_recipients(const int infd, const int outfd) {
+  /* one hex key id per line; none for a single-K stream */
+  unsigned char rid[KEYIDSZ], buf[BUFSZ];
+  struct bufio r;
+
+  bufio_open(&r, infd);
+  s0_read_magic(&r, 'A');
+  s0_read_type(&r);
+  while ( bufio_peek(&r, "reading header") == 'R' ) {
+    if ( s0_read_header(&r, 'R', rid, sizeof(rid)) != sizeof(rid) ) DIE("bad recipient id");
+    s0_read_header(&r, 'K', buf, sizeof(buf));
+    for ( unsigned i=0; i<sizeof(rid); i++ ) dprintf(outfd, "%02x", rid[i]);
+    dprintf(outfd, "\n");
+  }
+  bufio_close(&r);
+}
 
-  zeromem(skey, sizeof(skey));
+
+/*
+ * keyrings
+ * a 'Y' packet holds many public keys behind an index sorted by key
+ * id, so finding one is a binary search of the mapped file and only
+ * the key found is parsed.  after the magic, an 'N' header gives the
+ * number of keys (4 bytes big endian), then come that many
+ * KEYRING_ENTSZ byte index entries: key id, offset of the key from
+ * the start of the packet (4 bytes big endian), its length (2 bytes
+ * big endian), its type and a zero byte.  the keys follow, as a 'B'
+ * packet holds them after its headers.
+ */
+
+#define KEYRING_HDRSZ   10
+#define KEYRING_ENTSZ   16
+
+struct ringkey {
+  unsigned char id[KEYIDSZ];
+  unsigned char type;
+  unsigned len;
+  unsigned char key[BUFSZ];
+};
+
+static struct {
+  unsigned char *map;
+  size_t sz;
+  unsigned long n;
+} ring;
+
+static int ringkey_cmp(const void *a, const void *b) {
+  return memcmp(((const struct ringkey *)a)->id, ((const struct ringkey *)b)->id, KEYIDSZ);
 }
 
+static char *read_list(const int fd) {
+  /* the whole of fd, NUL terminated */
+  struct bufio r;
+  char *text = NULL;
+  size_t len = 0, got;
+
+  bufio_open(&r, fd);
+  do {
+    if ( ! (text=realloc(text, len + bufio_chunksz() + 1)) ) DIE("allocating list");
+    got = bufio_read(&r, (unsigned char *)text + len, bufio_chunksz(), "reading list");
+    len += got;
+  } while ( got );
+  bufio_close(&r);
+  text[len] = '\0';
+  return text;
+}
 
+static void s0_read_ringkey(const char *path, struct asymkey *akeyp, struct ringkey *k) {
+  /* a public key file; importing it checks it */
+  unsigned long sz = sizeof(k->key);
+  struct bufio r;
+  int fd;
+
+  if ( (fd=open(path, O_RDONLY)) < 0 ) DIES2("opening", path);
+  bufio_open(&r, fd);
+  s0_read_magic(&r, 'B');
+  k->type = s0_read_type(&r);
+  k->len = bufio_read(&r, k->key, sizeof(k->key), "reading key");
+  bufio_close(&r);
+  close(fd);
+
+  s0_asym_import(k->key, k->len, k->type, akeyp);
+  s0_asym_export(k->key, &sz, 0, akeyp);
+  k->len = sz;
+  s0_key_id(akeyp, k->id);
+}
+
+void s0_keyring_build(const int listfd, const int outfd) {
+  /* lines of public key paths in, a keyring out.  a key listed
+   * twice is stored once */
+  struct asymkey *akeyp = s0_asym_new();
+  struct ringkey *keys = NULL;
+  unsigned long n = 0, cap = 0, i, j, off;
+  unsigned char ent[KEYRING_ENTSZ], count[4];
+  char *text, *p, *next;
+  struct bufio w;
+
+  text = read_list(listfd);
+  for ( p=text; p && *p; p=next ) {
+    if ( (next=strchr(p, '\n')) ) *next++ = '\0';
+    p += strspn(p, " \t\r");
+    p[strcspn(p, "\r")] = '\0';
+    if ( ! *p || *p == '#' ) continue;
+    if ( n == cap ) {
+      cap = cap ? 2*cap : 1024;
+      if ( ! (keys=realloc(keys, cap * sizeof(*keys))) ) DIE("allocating keyring");
+    }
+    s0_read_ringkey(p, akeyp, &keys[n++]);
+  }
+  s0_asym_free(akeyp);
+  free(text);
+
+  qsort(keys, n, sizeof(*keys), ringkey_cmp);
+  for ( i=j=0; i<n; i++ ) {
+    if ( j && ! ringkey_cmp(&keys[j-1], &keys[i]) ) {
+      if ( keys[j-1].len != keys[i].len || memcmp(keys[j-1].key, keys[i].key, keys[i].len) )
+        DIE("key id collision");
+      continue;
+    }
+    keys[j++] = keys[i];
+  }
+  n = j;
+  if ( n > 0xffffffffUL ) DIE("too many keys");
+
+  bufio_open(&w, outfd);
+  s0_write_magic(&w, 'Y');
+  count[0] = n >> 24;
+  count[1] = n >> 16;
+  count[2] = n >> 8;
+  count[3] = n;
+  s0_write_header(&w, 'N', count, sizeof(count));
+  off = KEYRING_HDRSZ + n * KEYRING_ENTSZ;
+  for ( i=0; i<n; i++ ) {
+    if ( off > 0xffffffffUL ) DIE("keyring too large");
+    memcpy(ent, keys[i].id, KEYIDSZ);
+    ent[8] = off >> 24;
+    ent[9] = off >> 16;
+    ent[10] = off >> 8;
+    ent[11] = off;
+    ent[12] = keys[i].len >> 8;
+    ent[13] = keys[i].len;
+    ent[14] = keys[i].type;
+    ent[15] = 0;
+    bufio_write(&w, ent, sizeof(ent), "writing keyring");
+    off += keys[i].len;
+  }
+  for ( i=0; i<n; i++ ) bufio_write(&w, keys[i].key, keys[i].len, "writing keyring");
+  bufio_flush(&w, "writing keyring");
+  bufio_close(&w);
+  free(keys);
+}
+
+void s0_keyring_open(const int fd) {
+  /* map a keyring for s0_keyring_find; it stays mapped after fd closes */
+  unsigned char *map;
+  struct stat st;
+
+  if ( fstat(fd, &st) ) DIES("reading keyring");
+  if ( ! S_ISREG(st.st_mode) ) DIE("keyring must be a regular file");
+  if ( st.st_size < KEYRING_HDRSZ ) DIE("short keyring");
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if ( map == MAP_FAILED ) DIES("mapping keyring");
+
+  if ( map[0] != 's' || map[1] != '0' ) DIEC2("bad magic", map[0], map[1]);
+  if ( map[2] != SPOR_ONDISK_VERSION || map[3] != 'Y' ) DIE("not a keyring");
+  if ( map[4] != 'N' || map[5] != 4 ) DIE("bad keyring header");
+
+  if ( ring.map ) munmap(ring.map, ring.sz);
+  ring.map = map;
+  ring.sz = st.st_size;
+  ring.n = (unsigned long)map[6] << 24 | map[7] << 16 | map[8] << 8 | map[9];
+  if ( ring.n > (ring.sz - KEYRING_HDRSZ) / KEYRING_ENTSZ ) DIE("short keyring");
+}
+
+int s0_keyring_find(const unsigned char *id, struct asymkey *akeyp) {
+  /* import the key with this id into akeyp; 0 if there is none */
+  const unsigned char *ent;
+  unsigned char keyid[KEYIDSZ];
+  unsigned long lo = 0, hi = ring.n, mid, off, len;
+  int c;
+
+  if ( ! ring.map ) DIE("no keyring loaded");
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    ent = ring.map + KEYRING_HDRSZ + mid * KEYRING_ENTSZ;
+    if ( ! (c=memcmp(id, ent, KEYIDSZ)) ) {
+      off = (unsigned long)ent[8] << 24 | ent[9] << 16 | ent[10] << 8 | ent[11];
+      len = ent[12] << 8 | ent[13];
+      if ( off > ring.sz || len > ring.sz - off || len > BUFSZ ) DIE("bad keyring entry");
+      s0_asym_import(ring.map + off, len, ent[14], akeyp);
+      s0_key_id(akeyp, keyid);
+      if ( memcmp(id, keyid, KEYIDSZ) ) DIE("keyring entry does not match its id");
+      return 1;
+    }
+    if ( c < 0 ) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return 0;
+}
@@ -10,7 +10,9 @@
 
 //#if BACKEND == ltc_argon
 /* use this math library */
+#ifndef MATH
 #define MATH            tfm_desc
+#endif
 
 /* entropy minimums */
 #define ENTROPY_SOURCE  "/dev/urandom"
@@ -22,6 +24,7 @@
 #define CIPHER          aes_desc
 #define HASH            sha256_desc
 
+/* KDF defaults; streams record their own in a 'P' header */
 #define ARGON_TCOST     10
 #define ARGON_MCOST     1<<18  /* (=256M) */
 #define ARGON_PARALLEL  4
@@ -29,16 +32,56 @@
 /* must match algorithm block sizes above */
 #define KEYSZ_SYM       32     /* 256 bits */
 #define KEYSZ_PK        65     /* 521 bits */
+#define KEYSZ_25519     32
+
+/* asymmetric key types; packets name any but P-521 in a 'T' header */
+#define ASYM_P521       0
+#define ASYM_25519      1      /* Ed25519 signatures, X25519 key wrapping */
 
 /* on-disk format */
 #define MAGIC "s0"
 #define SPOR_ONDISK_VERSION 0x01
+#define SPOR_SEGMENTED_VERSION 0x02  /* 'S','A' with authenticated segments */
+
+/* authenticated segments */
+#define SEGSZ           (1<<16)  /* plaintext bytes per segment */
+#define MAX_SEGSZ       (1<<24)
+#define AEAD_NONCESZ    12
+#define AEAD_TAGSZ      16
+#define NONCE_PREFIXSZ  7
+
+/* multi-recipient 'A' streams */
+#define KEYIDSZ         8
+#define MAXRECIPS       64
+
+/* compressed 'S','A' payloads */
+#define COMPRESS_NONE   0
+#define COMPRESS_LZ     1      /* LZ4 block format */
+#define CBLOCKSZ        (1<<16)  /* plaintext bytes per compressed block */
+#define MAX_CBLOCKSZ    (1<<24)
+#define CFRAMESZ        4      /* block length, top bit set if stored */
+
+/* 'R' random bytes */
+#define RANDOM_RESEED   (1ULL<<30)  /* bytes per key, then reseed */
+
+/* tree hash signatures */
+#define TREE_LEAFSZ     (1<<20)  /* default bytes per leaf */
+#define MIN_TREE_LEAFSZ (1<<10)
+#define MAX_TREE_LEAFSZ (1<<26)
+
+/* digests written alongside a stream, see s0_tee_next */
+#define S0_TEE_PLAIN    0
+#define S0_TEE_CIPHER   1
 
 struct asymkey;
+struct s0_digest;
 
 //#endif
 
 
+/* range length meaning "to the end of the stream" */
+#define S0_TO_END       (~0ULL)
+
 /* miscellany */
 #define BUFSZ           224    /* encrypted keys, password and key m/xports */
 #define STACK_BURN_KB   20     /* determined with test_stack.sh */
@@ -62,12 +105,64 @@ void s0_decrypt_stream(
   unsigned char *pwbuf,
   const unsigned len
 );
+void s0_decrypt_range(
+  const int infd,
+  const int outfd,
+  unsigned char *pwbuf,
+  const unsigned len,
+  const unsigned long long offset,
+  const unsigned long long length
+);
+void s0_append_stream(
+  const int infd,
+  const int fd,
+  unsigned char *pwbuf,
+  const unsigned len
+);
+void s0_random_stream(
+  const int outfd,
+  unsigned long long n
+);
+
+void s0_set_threads(
+  const unsigned n
+);
+void s0_set_keycache(
+  const unsigned on,
+  unsigned char *pwbuf,
+  const unsigned pwsz
+);
+void s0_after_fork(void);
+void s0_set_format(
+  const unsigned version
+);
+int s0_seg_crypt(
+  const unsigned char *key,
+  const unsigned char *prefix,
+  unsigned char *buf,
+  unsigned long len,
+  unsigned long long idx,
+  int last,
+  int open
+);
+void s0_set_compress(
+  const unsigned alg
+);
 
 void s0_hash_stream(
   const int infd,
   unsigned char *hash,
   unsigned sz
 );
+void s0_tree_stream(
+  const int infd,
+  const unsigned long leafsz,
+  unsigned char *hash,
+  unsigned sz
+);
+void s0_set_tree(
+  const unsigned long leafsz
+);
 
 void s0_sign_stream(
   struct asymkey *akey,
@@ -80,6 +175,37 @@ void s0_verify_stream(
   const int infd,
   const int sigfd
 );
+void s0_prove_range(
+  const int infd,
+  const int sigfd,
+  const int outfd,
+  unsigned long long offset,
+  unsigned long long length
+);
+
+void s0_sign_next(
+  struct asymkey *akey,
+  struct asymkey *signer,
+  const int sigfd
+);
+
+void s0_check_next(
+  struct asymkey *akey,
+  struct asymkey *signer,
+  const int sigfd
+);
+
+void s0_tee_next(
+  const unsigned which,
+  const int fd
+);
+unsigned s0_read_sig(
+  const int sigfd,
+  const unsigned type,
+  unsigned char *sig,
+  const unsigned sz,
+  unsigned long *leafsz
+);
 
 void s0_asym_setup(
   struct asymkey *akey
@@ -96,10 +222,46 @@ void s0_asym_decrypt_stream(
   const int infd,
   const int outfd
 );
+void s0_asym_decrypt_range(
+  struct asymkey *akey,
+  const int infd,
+  const int outfd,
+  const unsigned long long offset,
+  const unsigned long long length
+);
+void s0_asym_append_stream(
+  struct asymkey *akey,
+  const int infd,
+  const int fd
+);
+void s0_add_recipient(
+  struct asymkey *akeyp
+);
+void s0_key_id(
+  struct asymkey *akeyp,
+  unsigned char *id
+);
+void s0_list_recipients(
+  const int infd,
+  const int outfd
+);
 
-void s0_create_key(
+void s0_keyring_build(
+  const int listfd,
+  const int outfd
+);
+void s0_keyring_open(
+  const int fd
+);
+int s0_keyring_find(
+  const unsigned char *id,
   struct asymkey *akeyp
 );
+
+void s0_create_key(
+  struct asymkey *akeyp,
+  const unsigned type
+);
 void s0_import_key(
   struct asymkey *akeyp,
   const int infd,
@@ -112,6 +274,26 @@ void s0_export_key(
   unsigned char *pwbuf,
   const unsigned len
 );
+void s0_use_agent(
+  struct asymkey *akeyp,
+  const char *path
+);
+
+void s0_set_jobs(
+  const unsigned n
+);
+void s0_verify_list(
+  struct asymkey *akeyp,
+  const int listfd,
+  const int statusfd
+);
+void s0_batch(
+  struct asymkey *akeyp,
+  const int manifestfd,
+  const int statusfd,
+  unsigned char *pwbuf,
+  const unsigned pwsz
+);
 
 /**
  ** backend-specific code (in spor_*.c)
@@ -119,6 +301,9 @@ void s0_export_key(
 
 void s0_setup (void);
 void s0_teardown(void);
+void s0_set_hwaccel(
+  const int on
+);
 
 void s0_prng_init(void);
 void s0_prng_getbytes (
@@ -140,7 +325,42 @@ void s0_cipher_decrypt(
   unsigned char *buf,
   const unsigned sz
 );
+void s0_cipher_crypt_at(
+  unsigned char *buf,
+  const unsigned long sz,
+  const unsigned long long offset
+);
 void s0_cipher_done(void);
+void s0_ctr_crypt(
+  const unsigned char *key,
+  const unsigned char *iv,
+  unsigned char *buf,
+  const unsigned long sz,
+  const unsigned long long offset
+);
+
+void s0_aead_seal(
+  const unsigned char *key,
+  const unsigned keysz,
+  const unsigned char *nonce,
+  unsigned char *buf,
+  const unsigned long sz,
+  unsigned char *tag
+);
+int s0_aead_open(
+  const unsigned char *key,
+  const unsigned keysz,
+  const unsigned char *nonce,
+  unsigned char *buf,
+  const unsigned long sz,
+  const unsigned char *tag
+);
+
+void s0_subkey(
+  const unsigned char *key,
+  const unsigned char *salt,
+  unsigned char *subkey
+);
 
 void s0_hash_init(void);
 void s0_hash_update(
@@ -153,12 +373,33 @@ void s0_hash_done(
 );
 unsigned s0_hash_size(void);
 
-void s0_asym_keygen(
+struct s0_digest *s0_digest_new(void);
+void s0_digest_update(
+  struct s0_digest *d,
+  const unsigned char *buf,
+  const unsigned long sz
+);
+void s0_digest_done(
+  struct s0_digest *d,
+  unsigned char *buf,
+  const unsigned sz
+);
+
+struct asymkey *s0_asym_new(void);
+void s0_asym_free(
   struct asymkey *akeyp
 );
+void s0_asym_keygen(
+  struct asymkey *akeyp,
+  const unsigned type
+);
 void s0_asym_import(
   const unsigned char *buf,
   const unsigned len,
+  const unsigned type,
+  struct asymkey *akeyp
+);
+unsigned s0_asym_type(
   struct asymkey *akeyp
 );
 void s0_asym_export(
@@ -182,6 +423,15 @@ int s0_asym_verify(
   const unsigned char *sig,
   const unsigned sigsz
 );
+void s0_asym_verify_batch(
+  struct asymkey *akeyp,
+  const unsigned char *hashes,
+  const int hashsz,
+  const unsigned char **sigs,
+  const unsigned *sigszs,
+  const unsigned n,
+  int *stat
+);
 
 void s0_asym_encrypt_key(
   struct asymkey *akeyp,
@@ -0,0 +1,416 @@
+/*
+ * spor_aesni.c
+ * native AES-CTR using the x86 AES instructions
+ *
+ * produces the same keystream as libtomcrypt's ctr_start() with
+ * CTR_COUNTER_LITTLE_ENDIAN: block i is E(iv + i), the whole 16 byte
+ * block being one little endian counter.  several counter blocks are
+ * kept in flight to hide the latency of aesenc.
+ */
+
+#include <string.h>
+
+#include "spor_aesni.h"
+
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse4.1")))
+#define VAES_TARGET  __attribute__((target("aes,sse4.1,avx512f,vaes")))
+
+
+/**
+ ** CPU detection
+ **/
+
+static unsigned long long xgetbv0(void) {
+  unsigned lo, hi;
+  __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((unsigned long long)hi << 32) | lo;
+}
+
+int aesni_probe(void) {
+  unsigned a, b, c, d;
+  int level = AESNI_NONE;
+
+  if ( ! __get_cpuid(1, &a, &b, &c, &d) ) return level;
+  if ( ! (c & bit_AES) || ! (c & bit_SSE4_1) ) return level;
+  level = AESNI_AES;
+
+  /* VAES needs AVX-512 and an OS that saves the zmm registers */
+  if ( ! (c & bit_OSXSAVE) ) return level;
+  if ( (xgetbv0() & 0xe6) != 0xe6 ) return level;
+  if ( ! __get_cpuid_count(7, 0, &a, &b, &c, &d) ) return level;
+  if ( (b & bit_AVX512F) && (c & bit_VAES) ) level = AESNI_VAES;
+  return level;
+}
+
+
+/**
+ ** Key schedule
+ **/
+
+AESNI_TARGET
+static __m128i expand_step(__m128i k, __m128i kg) {
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  return _mm_xor_si128(k, kg);
+}
+
+#define EXPAND128(rc) \
+  k0 = expand_step(k0, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k0, rc), 0xff)); \
+  _mm_store_si128((__m128i *)rk[i++], k0);
+
+#define EXPAND256(rc) \
+  k0 = expand_step(k0, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k1, rc), 0xff)); \
+  _mm_store_si128((__m128i *)rk[i++], k0); \
+  if ( i < 15 ) { \
+    k1 = expand_step(k1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k0, 0), 0xaa)); \
+    _mm_store_si128((__m128i *)rk[i++], k1); \
+  }
+
+AESNI_TARGET
+static void expand_key128(unsigned char rk[][16], const unsigned char *key) {
+  __m128i k0 = _mm_loadu_si128((const __m128i *)key);
+  int i = 0;
+  _mm_store_si128((__m128i *)rk[i++], k0);
+  EXPAND128(0x01) EXPAND128(0x02) EXPAND128(0x04) EXPAND128(0x08)
+  EXPAND128(0x10) EXPAND128(0x20) EXPAND128(0x40) EXPAND128(0x80)
+  EXPAND128(0x1b) EXPAND128(0x36)
+}
+
+AESNI_TARGET
+static void expand_key256(unsigned char rk[][16], const unsigned char *key) {
+  __m128i k0 = _mm_loadu_si128((const __m128i *)key);
+  __m128i k1 = _mm_loadu_si128((const __m128i *)(key+16));
+  int i = 0;
+  _mm_store_si128((__m128i *)rk[i++], k0);
+  _mm_store_si128((__m128i *)rk[i++], k1);
+  EXPAND256(0x01) EXPAND256(0x02) EXPAND256(0x04) EXPAND256(0x08)
+  EXPAND256(0x10) EXPAND256(0x20) EXPAND256(0x40)
+}
+
+
+/**
+ ** Counter handling
+ **/
+
+static void ctr_add(struct aesni_ctr *c, unsigned long long n) {
+  c->lo += n;
+  if ( c->lo < n ) c->hi++;
+}
+
+int aesni_ctr_init(struct aesni_ctr *c, const int level,
+                   const unsigned char *key, const int keysz,
+                   const unsigned char *iv) {
+  if ( level == AESNI_NONE ) return 0;
+  if ( keysz == 16 ) {
+    expand_key128(c->rk, key);
+    c->rounds = 10;
+  } else if ( keysz == 32 ) {
+    expand_key256(c->rk, key);
+    c->rounds = 14;
+  } else {
+    return 0;
+  }
+  c->level = level;
+  aesni_ctr_seek(c, iv, 0);
+  return 1;
+}
+
+
+/**
+ ** Encryption
+ **/
+
+AESNI_TARGET
+static __m128i encrypt1(const struct aesni_ctr *c, __m128i b) {
+  int r;
+  b = _mm_xor_si128(b, _mm_load_si128((const __m128i *)c->rk[0]));
+  for ( r=1; r<c->rounds; r++ )
+    b = _mm_aesenc_si128(b, _mm_load_si128((const __m128i *)c->rk[r]));
+  return _mm_aesenclast_si128(b, _mm_load_si128((const __m128i *)c->rk[r]));
+}
+
+AESNI_TARGET
+static void next_pad(struct aesni_ctr *c) {
+  __m128i b = _mm_set_epi64x(c->hi, c->lo);
+  _mm_storeu_si128((__m128i *)c->pad, encrypt1(c, b));
+  ctr_add(c, 1);
+  c->padlen = 0;
+}
+
+void aesni_ctr_seek(struct aesni_ctr *c, const unsigned char *iv,
+                    const unsigned long long offset) {
+  memcpy(&c->lo, iv, 8);
+  memcpy(&c->hi, iv+8, 8);
+  ctr_add(c, offset / 16);
+  c->padlen = 16;
+  if ( offset % 16 ) {
+    next_pad(c);
+    c->padlen = offset % 16;
+  }
+}
+
+AESNI_TARGET
+static void crypt8(struct aesni_ctr *c, unsigned char *buf) {
+  /* 8 independent blocks keep the aesenc pipeline full */
+  __m128i b[8], k, one = _mm_set_epi64x(0, 1);
+  int i, r;
+
+  b[0] = _mm_set_epi64x(c->hi, c->lo);
+  for ( i=1; i<8; i++ ) b[i] = _mm_add_epi64(b[i-1], one);
+
+  k = _mm_load_si128((const __m128i *)c->rk[0]);
+  for ( i=0; i<8; i++ ) b[i] = _mm_xor_si128(b[i], k);
+  for ( r=1; r<c->rounds; r++ ) {
+    k = _mm_load_si128((const __m128i *)c->rk[r]);
+    for ( i=0; i<8; i++ ) b[i] = _mm_aesenc_si128(b[i], k);
+  }
+  k = _mm_load_si128((const __m128i *)c->rk[r]);
+  for ( i=0; i<8; i++ ) {
+    b[i] = _mm_aesenclast_si128(b[i], k);
+    b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)(buf+16*i)));
+    _mm_storeu_si128((__m128i *)(buf+16*i), b[i]);
+  }
+  c->lo += 8;
+}
+
+VAES_TARGET
+static void crypt32(struct aesni_ctr *c, unsigned char *buf) {
+  /* 8 zmm registers of 4 blocks each */
+  __m512i b[8], k;
+  __m512i step = _mm512_set_epi64(0, 4, 0, 4, 0, 4, 0, 4);
+  int i, r;
+
+  b[0] = _mm512_add_epi64(
+           _mm512_broadcast_i32x4(_mm_set_epi64x(c->hi, c->lo)),
+           _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0));
+  for ( i=1; i<8; i++ ) b[i] = _mm512_add_epi64(b[i-1], step);
+
+  k = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)c->rk[0]));
+  for ( i=0; i<8; i++ ) b[i] = _mm512_xor_si512(b[i], k);
+  for ( r=1; r<c->rounds; r++ ) {
+    k = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)c->rk[r]));
+    for ( i=0; i<8; i++ ) b[i] = _mm512_aesenc_epi128(b[i], k);
+  }
+  k = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)c->rk[r]));
+  for ( i=0; i<8; i++ ) {
+    b[i] = _mm512_aesenclast_epi128(b[i], k);
+    b[i] = _mm512_xor_si512(b[i], _mm512_loadu_si512(buf+64*i));
+    _mm512_storeu_si512(buf+64*i, b[i]);
+  }
+  c->lo += 32;
+}
+
+void aesni_ctr_crypt(struct aesni_ctr *c, unsigned char *buf, unsigned long len) {
+  unsigned i;
+
+  /* finish a partially used block */
+  while ( len && c->padlen < 16 ) {
+    *buf++ ^= c->pad[c->padlen++];
+    len--;
+  }
+
+  /* wide batches, as long as the low counter word doesn't wrap inside one */
+  if ( c->level >= AESNI_VAES ) {
+    while ( len >= 32*16 && c->lo <= ~0ULL - 32 ) {
+      crypt32(c, buf);
+      buf += 32*16;
+      len -= 32*16;
+    }
+  }
+  while ( len >= 8*16 && c->lo <= ~0ULL - 8 ) {
+    crypt8(c, buf);
+    buf += 8*16;
+    len -= 8*16;
+  }
+
+  /* whatever is left goes one block at a time */
+  while ( len ) {
+    next_pad(c);
+    for ( i=0; i<16 && len; i++, len-- ) *buf++ ^= c->pad[c->padlen++];
+  }
+}
+
+
+/**
+ ** AES-GCM with a 96 bit nonce and no associated data
+ **/
+
+#define GCM_TARGET __attribute__((target("aes,sse4.1,pclmul")))
+
+int aesni_gcm_probe(void) {
+  unsigned a, b, c, d;
+  if ( aesni_probe() == AESNI_NONE ) return 0;
+  if ( ! __get_cpuid(1, &a, &b, &c, &d) ) return 0;
+  return (c & bit_PCLMUL) != 0;
+}
+
+GCM_TARGET
+static __m128i gfmul(__m128i a, __m128i b) {
+  /* multiply in GF(2^128), operands and result byte-reflected
+   * (Gueron & Kounavis, Intel carry-less multiplication white paper)
+   */
+  __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+  t3 = _mm_clmulepi64_si128(a, b, 0x00);
+  t4 = _mm_clmulepi64_si128(a, b, 0x10);
+  t5 = _mm_clmulepi64_si128(a, b, 0x01);
+  t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+  t4 = _mm_xor_si128(t4, t5);
+  t5 = _mm_slli_si128(t4, 8);
+  t4 = _mm_srli_si128(t4, 8);
+  t3 = _mm_xor_si128(t3, t5);
+  t6 = _mm_xor_si128(t6, t4);
+
+  /* shift the 256 bit product left by one */
+  t7 = _mm_srli_epi32(t3, 31);
+  t8 = _mm_srli_epi32(t6, 31);
+  t3 = _mm_slli_epi32(t3, 1);
+  t6 = _mm_slli_epi32(t6, 1);
+  t9 = _mm_srli_si128(t7, 12);
+  t8 = _mm_slli_si128(t8, 4);
+  t7 = _mm_slli_si128(t7, 4);
+  t3 = _mm_or_si128(t3, t7);
+  t6 = _mm_or_si128(t6, t8);
+  t6 = _mm_or_si128(t6, t9);
+
+  /* reduce modulo x^128 + x^7 + x^2 + x + 1 */
+  t7 = _mm_slli_epi32(t3, 31);
+  t8 = _mm_slli_epi32(t3, 30);
+  t9 = _mm_slli_epi32(t3, 25);
+  t7 = _mm_xor_si128(t7, t8);
+  t7 = _mm_xor_si128(t7, t9);
+  t8 = _mm_srli_si128(t7, 4);
+  t7 = _mm_slli_si128(t7, 12);
+  t3 = _mm_xor_si128(t3, t7);
+
+  t2 = _mm_srli_epi32(t3, 1);
+  t4 = _mm_srli_epi32(t3, 2);
+  t5 = _mm_srli_epi32(t3, 7);
+  t2 = _mm_xor_si128(t2, t4);
+  t2 = _mm_xor_si128(t2, t5);
+  t2 = _mm_xor_si128(t2, t8);
+  t3 = _mm_xor_si128(t3, t2);
+  return _mm_xor_si128(t6, t3);
+}
+
+GCM_TARGET
+static __m128i gcm_block(__m128i j, unsigned ctr) {
+  /* nonce || big endian 32 bit counter */
+  return _mm_insert_epi32(j, __builtin_bswap32(ctr), 3);
+}
+
+GCM_TARGET
+static __m128i ghash_blocks(__m128i x, __m128i h, const unsigned char *buf,
+                            unsigned long len) {
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  unsigned char last[16];
+  __m128i b;
+
+  for ( ; len >= 16; buf += 16, len -= 16 ) {
+    b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), bswap);
+    x = gfmul(_mm_xor_si128(x, b), h);
+  }
+  if ( len ) {
+    memset(last, 0, sizeof(last));
+    memcpy(last, buf, len);
+    b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)last), bswap);
+    x = gfmul(_mm_xor_si128(x, b), h);
+  }
+  return x;
+}
+
+GCM_TARGET
+static void gcm_ctr(const struct aesni_ctr *c, __m128i j, unsigned ctr,
+                    unsigned char *buf, unsigned long len) {
+  __m128i b[8], k;
+  unsigned char pad[16];
+  int i, r;
+
+  for ( ; len >= 8*16; buf += 8*16, len -= 8*16, ctr += 8 ) {
+    for ( i=0; i<8; i++ ) b[i] = gcm_block(j, ctr+i);
+    k = _mm_load_si128((const __m128i *)c->rk[0]);
+    for ( i=0; i<8; i++ ) b[i] = _mm_xor_si128(b[i], k);
+    for ( r=1; r<c->rounds; r++ ) {
+      k = _mm_load_si128((const __m128i *)c->rk[r]);
+      for ( i=0; i<8; i++ ) b[i] = _mm_aesenc_si128(b[i], k);
+    }
+    k = _mm_load_si128((const __m128i *)c->rk[r]);
+    for ( i=0; i<8; i++ ) {
+      b[i] = _mm_aesenclast_si128(b[i], k);
+      b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)(buf+16*i)));
+      _mm_storeu_si128((__m128i *)(buf+16*i), b[i]);
+    }
+  }
+  for ( ; len; ctr++ ) {
+    _mm_storeu_si128((__m128i *)pad, encrypt1(c, gcm_block(j, ctr)));
+    for ( i=0; i<16 && len; i++, len-- ) *buf++ ^= pad[i];
+  }
+}
+
+GCM_TARGET
+int aesni_gcm(const unsigned char *key, const int keysz,
+               const unsigned char *nonce, unsigned char *buf,
+               unsigned long len, unsigned char *tag, const int decrypt) {
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  struct aesni_ctr c;
+  unsigned char j0[16];
+  __m128i j, h, x;
+
+  memcpy(j0, nonce, 12);
+  memset(j0+12, 0, 4);
+  if ( ! aesni_ctr_init(&c, AESNI_AES, key, keysz, j0) ) return 0;
+
+  j = _mm_loadu_si128((const __m128i *)j0);
+  h = _mm_shuffle_epi8(encrypt1(&c, _mm_setzero_si128()), bswap);
+  x = _mm_setzero_si128();
+
+  if ( decrypt ) x = ghash_blocks(x, h, buf, len);
+  gcm_ctr(&c, j, 2, buf, len);
+  if ( ! decrypt ) x = ghash_blocks(x, h, buf, len);
+
+  /* lengths block: no associated data, ciphertext bits */
+  x = gfmul(_mm_xor_si128(x, _mm_set_epi64x(0, (long long)len * 8)), h);
+  x = _mm_xor_si128(_mm_shuffle_epi8(x, bswap), encrypt1(&c, gcm_block(j, 1)));
+  _mm_storeu_si128((__m128i *)tag, x);
+
+  memset(&c, 0, sizeof(c));
+  return 1;
+}
+
+#else  /* no x86: always use the portable cipher */
+
+int aesni_probe(void) {
+  return AESNI_NONE;
+}
+
+int aesni_ctr_init(struct aesni_ctr *c, const int level,
+                   const unsigned char *key, const int keysz,
+                   const unsigned char *iv) {
+  return 0;
+}
+
+void aesni_ctr_seek(struct aesni_ctr *c, const unsigned char *iv,
+                    const unsigned long long offset) {
+}
+
+void aesni_ctr_crypt(struct aesni_ctr *c, unsigned char *buf, unsigned long len) {
+}
+
+int aesni_gcm_probe(void) {
+  return 0;
+}
+
+int aesni_gcm(const unsigned char *key, const int keysz,
+               const unsigned char *nonce, unsigned char *buf,
+               unsigned long len, unsigned char *tag, const int decrypt) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * spor_aesni.h
+ * native AES-CTR using the x86 AES instructions
+ */
+
+#ifndef SPOR_AESNI_H
+#define SPOR_AESNI_H
+
+#define AESNI_NONE   0
+#define AESNI_AES    1     /* AES-NI, 8 blocks in flight */
+#define AESNI_VAES   2     /* VAES on AVX-512, 32 blocks in flight */
+
+struct aesni_ctr {
+  unsigned char rk[15][16] __attribute__((aligned(16)));
+  int rounds;
+  int level;
+  unsigned long long lo, hi;   /* next counter block, little endian */
+  unsigned char pad[16];       /* keystream for the current block */
+  unsigned padlen;             /* bytes of pad used */
+};
+
+int aesni_probe(void);
+
+int aesni_ctr_init(
+  struct aesni_ctr *c,
+  const int level,
+  const unsigned char *key,
+  const int keysz,
+  const unsigned char *iv
+);
+void aesni_ctr_seek(
+  struct aesni_ctr *c,
+  const unsigned char *iv,
+  const unsigned long long offset
+);
+void aesni_ctr_crypt(
+  struct aesni_ctr *c,
+  unsigned char *buf,
+  unsigned long len
+);
+
+int aesni_gcm_probe(void);
+int aesni_gcm(
+  const unsigned char *key,
+  const int keysz,
+  const unsigned char *nonce,
+  unsigned char *buf,
+  unsigned long len,
+  unsigned char *tag,
+  const int decrypt
+);
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ ** spor_agent.c
+ ** spor-agent: hold an unlocked private key for spor 'u'
+ **/
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "pbkdf.h"
+#include "spor.h"
+#include "spor_ltc.h"
+#include "util.h"
+
+#define EXE "spor-agent"
+#define PWPROMPT "Password: "
+
+#define USAGE() \
+fprintf(stderr, "Usage: " EXE " socket [pwfd] <privatekey\n"\
+  "    unlock the private key on stdin with the password from the terminal,\n"\
+  "    or from descriptor pwfd, and serve it on the Unix socket until\n"\
+  "    SIGINT or SIGTERM.  point SPOR_AGENT at the socket and use 'u' in spor.\n"\
+  "Example:\n"\
+  "    " EXE " $HOME/.spor-agent <privatekey &\n"\
+  "    SPOR_AGENT=$HOME/.spor-agent spor 'u 3g' <file 3>file.sig\n"\
+),exit(1)
+
+
+unsigned char pwbuf[BUFSZ];
+struct asymkey akey;
+
+
+void cleanup_atexit(void) {
+  s0_teardown();
+  zeromem(pwbuf, sizeof(pwbuf));
+  zeromem(&akey, sizeof(akey));
+  burn_stack(1024*4);
+}
+
+
+int main(int argc, char **argv) {
+  unsigned pwsz;
+  int pwfd;
+
+  if ( argc < 2 || argc > 3 ) USAGE();
+
+  /* no core dumps or ptrace of the unlocked key */
+  prctl(PR_SET_DUMPABLE, 0);
+
+  s0_setup();
+  s0_asym_setup(&akey);
+  atexit(cleanup_atexit);
+
+  if ( argc == 3 ) {
+    pwfd = atoi(argv[2]);
+    pwsz = read_or_die(pwfd, pwbuf, sizeof(pwbuf), "reading passphrase");
+    close(pwfd);
+  } else {
+    pwsz = readpass(PWPROMPT, pwbuf, sizeof(pwbuf));
+  }
+  s0_import_key(&akey, 0, pwbuf, pwsz);
+  zeromem(pwbuf, sizeof(pwbuf));
+  close(0);
+  s0_kdf_release();
+
+  /* after the KDF, whose 256 MiB would not fit RLIMIT_MEMLOCK */
+  if ( mlockall(MCL_CURRENT|MCL_FUTURE) ) DIES("locking memory");
+
+  agent_serve(argv[1], &akey);
+  exit(0);
+}
@@ -0,0 +1,292 @@
+/*
+ * spor_ecc.c
+ * fixed-base tables and batched ECDSA verification on libtomcrypt's math
+ *
+ * ecc_verify_hash() finds u1*G + u2*Q from scratch: a doubling for
+ * every bit of the order, plus the additions.  with a table holding
+ * every window digit times every power of the window base, for G and
+ * for Q, the same sum takes one addition per nonzero digit and no
+ * doublings.  a table costs a few verifications to build, so G's is
+ * kept for the process and a key's for as long as it is loaded.
+ *
+ * a batch against one key also shares the curve setup and both
+ * modular inversions per signature (s^-1 mod n, and Z^-1 mod p to
+ * leave projective coordinates): Montgomery's trick does them all with
+ * one inversion and three multiplications each.
+ *
+ * the curve constants and G's table are filled in by the first caller
+ * under cv_lock, so contexts verifying on several threads (libspor)
+ * don't race to build them; once filled they are only read.  they
+ * hold one curve: a table for a key on any other fails to build, and
+ * that key is verified by ecc_verify_hash() as before.  spor's own
+ * keys are all P-521.
+ */
+
+#include <pthread.h>
+
+#include "spor_ecc.h"
+#include "util.h"
+
+#define TRY(x) if ( (err=(x)) != CRYPT_OK ) goto done
+
+/* curve constants, one curve per process */
+static struct {
+  const ltc_ecc_set_type *dp;
+  void *prime, *order;
+  void *mu;                   /* R mod prime, montgomery one */
+  void *mp;                   /* montgomery digit */
+  struct ecc_comb *g;         /* table for the generator, on demand */
+} cv;
+static pthread_mutex_t cv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ecc_comb *comb_build(const ltc_ecc_set_type *dp, ecc_point *P);
+
+static int curve_load(const ltc_ecc_set_type *dp) {
+  int err;
+
+  if ( cv.dp == dp ) return CRYPT_OK;
+  if ( cv.dp ) return CRYPT_INVALID_ARG;
+  TRY(mp_init_multi(&cv.prime, &cv.order, &cv.mu, NULL));
+  TRY(mp_read_radix(cv.prime, dp->prime, 16));
+  TRY(mp_read_radix(cv.order, dp->order, 16));
+  TRY(mp_montgomery_setup(cv.prime, &cv.mp));
+  TRY(mp_montgomery_normalization(cv.mu, cv.prime));
+  cv.dp = dp;
+done:
+  return err;
+}
+
+static int generator(void) {
+  ecc_point *G;
+  int err;
+
+  if ( cv.g ) return CRYPT_OK;
+  if ( ! (G=ltc_ecc_new_point()) ) return CRYPT_MEM;
+  TRY(mp_read_radix(G->x, cv.dp->Gx, 16));
+  TRY(mp_read_radix(G->y, cv.dp->Gy, 16));
+  TRY(mp_set(G->z, 1));
+  if ( ! (cv.g=comb_build(cv.dp, G)) ) err = CRYPT_MEM;
+done:
+  ltc_ecc_del_point(G);
+  return err;
+}
+
+static int curve_setup(const ltc_ecc_set_type *dp, const int gen) {
+  /* cv for dp, and G's table if gen, made once whichever thread asks */
+  int err;
+
+  pthread_mutex_lock(&cv_lock);
+  if ( (err=curve_load(dp)) == CRYPT_OK && gen ) err = generator();
+  pthread_mutex_unlock(&cv_lock);
+  return err;
+}
+
+
+/**
+ ** Tables
+ **/
+
+static struct ecc_comb *comb_build(const ltc_ecc_set_type *dp, ecc_point *P) {
+  /* P is affine, as libtomcrypt keeps public keys; cv is loaded */
+  struct ecc_comb *c;
+  ecc_point **T;
+  unsigned i, j;
+  int err;
+
+  if ( ! (c=calloc(1, sizeof(*c))) ) return NULL;
+  c->dp = dp;
+  c->nwin = (mp_count_bits(cv.order) + COMB_WINBITS-1) / COMB_WINBITS;
+  if ( ! (c->pt=calloc(c->nwin * COMB_DIGITS, sizeof(*c->pt))) ) goto fail;
+  for ( i=0; i < c->nwin * COMB_DIGITS; i++ )
+    if ( ! (c->pt[i]=ltc_ecc_new_point()) ) goto fail;
+
+  T = c->pt;
+  TRY(mp_mulmod(P->x, cv.mu, cv.prime, T[0]->x));
+  TRY(mp_mulmod(P->y, cv.mu, cv.prime, T[0]->y));
+  TRY(mp_copy(cv.mu, T[0]->z));
+  for ( i=0; i < c->nwin; i++, T += COMB_DIGITS ) {
+    /* the window base is twice half the last window's range */
+    if ( i ) TRY(ltc_mp.ecc_ptdbl(T[-COMB_DIGITS + (COMB_DIGITS>>1)], T[0], cv.prime, cv.mp));
+    TRY(ltc_mp.ecc_ptdbl(T[0], T[1], cv.prime, cv.mp));
+    for ( j=2; j < COMB_DIGITS; j++ )
+      TRY(ltc_mp.ecc_ptadd(T[j-1], T[0], T[j], cv.prime, cv.mp));
+  }
+  return c;
+
+done:
+fail:
+  ecc_comb_free(c);
+  return NULL;
+}
+
+struct ecc_comb *ecc_comb_new(const ltc_ecc_set_type *dp, ecc_point *P) {
+  if ( curve_setup(dp, 0) != CRYPT_OK ) return NULL;
+  return comb_build(dp, P);
+}
+
+void ecc_comb_free(struct ecc_comb *c) {
+  unsigned i;
+  if ( ! c ) return;
+  if ( c->pt ) {
+    for ( i=0; i < c->nwin * COMB_DIGITS; i++ )
+      if ( c->pt[i] ) ltc_ecc_del_point(c->pt[i]);
+    free(c->pt);
+  }
+  free(c);
+}
+
+static unsigned digit(const unsigned char *k, const unsigned len, const unsigned i) {
+  /* window i of the big endian number k */
+  unsigned d = 0, b, bit;
+  for ( b=COMB_WINBITS; b--; ) {
+    bit = i*COMB_WINBITS + b;
+    d <<= 1;
+    if ( bit/8 < len ) d |= (k[len-1 - bit/8] >> (bit%8)) & 1;
+  }
+  return d;
+}
+
+static int comb_add(struct ecc_comb *c, void *k, ecc_point *acc, int *have) {
+  /* acc += k*P */
+  unsigned char kb[MAXBLOCKSIZE];
+  unsigned long len = mp_unsigned_bin_size(k);
+  unsigned i, d;
+  ecc_point *T;
+  int err = CRYPT_OK;
+
+  if ( len > sizeof(kb) || mp_count_bits(k) > c->nwin*COMB_WINBITS ) return CRYPT_INVALID_ARG;
+  TRY(mp_to_unsigned_bin(k, kb));
+  for ( i=0; i < c->nwin; i++ ) {
+    if ( ! (d=digit(kb, len, i)) ) continue;
+    T = c->pt[i*COMB_DIGITS + d-1];
+    if ( *have ) {
+      TRY(ltc_mp.ecc_ptadd(acc, T, acc, cv.prime, cv.mp));
+    } else {
+      TRY(mp_copy(T->x, acc->x));
+      TRY(mp_copy(T->y, acc->y));
+      TRY(mp_copy(T->z, acc->z));
+      *have = 1;
+    }
+  }
+done:
+  return err;
+}
+
+
+/**
+ ** Verification
+ **/
+
+static int invert_all(void **a, void **out, const unsigned n, void *m, void *t) {
+  /* out[i] = a[i]^-1 mod m, for one inversion */
+  unsigned i;
+  int err;
+
+  TRY(mp_copy(a[0], out[0]));
+  for ( i=1; i<n; i++ ) TRY(mp_mulmod(out[i-1], a[i], m, out[i]));
+  TRY(mp_invmod(out[n-1], m, t));
+  for ( i=n-1; i>0; i-- ) {
+    TRY(mp_mulmod(t, out[i-1], m, out[i]));
+    TRY(mp_mulmod(t, a[i], m, t));
+  }
+  TRY(mp_copy(t, out[0]));
+done:
+  return err;
+}
+
+static int read_hash(void *e, const unsigned char *hash, const unsigned hashsz) {
+  /* the leftmost bits of the hash, as many as the order has */
+  unsigned pbits = mp_count_bits(cv.order), pbytes = (pbits+7) / 8, i;
+  int err;
+
+  if ( pbits > hashsz*8 ) return mp_read_unsigned_bin(e, (unsigned char *)hash, hashsz);
+  TRY(mp_read_unsigned_bin(e, (unsigned char *)hash, pbytes));
+  for ( i=pbits%8 ? 8 - pbits%8 : 0; i; i-- ) TRY(mp_div_2(e, e));
+done:
+  return err;
+}
+
+struct sigjob {
+  void *r, *s, *e, *w, *x, *zi;
+  ecc_point *acc;
+  int ok;
+};
+
+int ecc_verify_batch(ecc_key *key, struct ecc_comb *kc,
+                     const unsigned char *hashes, const unsigned hashsz,
+                     const unsigned char **sigs, const unsigned *sigszs,
+                     const unsigned n, int *stat) {
+  /* stat[i] is set for each valid (hashes + i*hashsz, sigs[i]) */
+  struct sigjob *job;
+  void **a = NULL, **inv = NULL, *t = NULL;
+  unsigned i, m;
+  int err = CRYPT_MEM, have;
+
+  for ( i=0; i<n; i++ ) stat[i] = 0;
+  if ( ! n ) return CRYPT_OK;
+  if ( kc->dp != key->dp ) return CRYPT_INVALID_ARG;
+  if ( (err=curve_setup(key->dp, 1)) != CRYPT_OK ) return err;
+
+  if ( ! (job=calloc(n, sizeof(*job))) ) return CRYPT_MEM;
+  if ( ! (a=calloc(n, sizeof(*a))) || ! (inv=calloc(n, sizeof(*inv))) ) goto done;
+  TRY(mp_init(&t));
+  for ( i=0; i<n; i++ ) {
+    TRY(mp_init_multi(&job[i].r, &job[i].s, &job[i].e, &job[i].w, &job[i].x, &job[i].zi, NULL));
+    if ( ! (job[i].acc=ltc_ecc_new_point()) ) { err = CRYPT_MEM; goto done; }
+  }
+
+  /* r and s in [1,n-1]; w = s^-1 */
+  for ( i=m=0; i<n; i++ ) {
+    if ( der_decode_sequence_multi(sigs[i], sigszs[i],
+           LTC_ASN1_INTEGER, 1UL, job[i].r, LTC_ASN1_INTEGER, 1UL, job[i].s,
+           LTC_ASN1_EOL, 0UL, NULL) != CRYPT_OK ) continue;
+    if ( mp_iszero(job[i].r) || mp_iszero(job[i].s) ||
+         mp_cmp(job[i].r, cv.order) != LTC_MP_LT ||
+         mp_cmp(job[i].s, cv.order) != LTC_MP_LT ) continue;
+    job[i].ok = 1;
+    a[m] = job[i].s;
+    inv[m++] = job[i].w;
+  }
+  if ( m ) TRY(invert_all(a, inv, m, cv.order, t));
+
+  /* u1*G + u2*Q, with u1 = e*w and u2 = r*w */
+  for ( i=m=0; i<n; i++ ) {
+    if ( ! job[i].ok ) continue;
+    TRY(read_hash(job[i].e, hashes + i*hashsz, hashsz));
+    TRY(mp_mulmod(job[i].e, job[i].w, cv.order, job[i].e));
+    TRY(mp_mulmod(job[i].r, job[i].w, cv.order, job[i].w));
+    have = 0;
+    TRY(comb_add(cv.g, job[i].e, job[i].acc, &have));
+    TRY(comb_add(kc, job[i].w, job[i].acc, &have));
+    TRY(mp_montgomery_reduce(job[i].acc->x, cv.prime, cv.mp));
+    TRY(mp_montgomery_reduce(job[i].acc->z, cv.prime, cv.mp));
+    if ( ! have || mp_iszero(job[i].acc->z) ) {
+      job[i].ok = 0;
+      continue;
+    }
+    a[m] = job[i].acc->z;
+    inv[m++] = job[i].zi;
+  }
+  if ( m ) TRY(invert_all(a, inv, m, cv.prime, t));
+
+  /* affine x = X/Z^2, and x mod n must be r */
+  for ( i=0; i<n; i++ ) {
+    if ( ! job[i].ok ) continue;
+    TRY(mp_mulmod(job[i].zi, job[i].zi, cv.prime, job[i].zi));
+    TRY(mp_mulmod(job[i].acc->x, job[i].zi, cv.prime, job[i].x));
+    TRY(mp_mod(job[i].x, cv.order, job[i].x));
+    stat[i] = mp_cmp(job[i].x, job[i].r) == LTC_MP_EQ;
+  }
+  err = CRYPT_OK;
+
+done:
+  for ( i=0; i<n; i++ ) {
+    if ( job[i].r ) mp_clear_multi(job[i].r, job[i].s, job[i].e, job[i].w, job[i].x, job[i].zi, NULL);
+    if ( job[i].acc ) ltc_ecc_del_point(job[i].acc);
+  }
+  if ( t ) mp_clear(t);
+  free(job);
+  free(a);
+  free(inv);
+  return err;
+}
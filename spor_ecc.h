@@ -0,0 +1,44 @@
+/*
+ * spor_ecc.h
+ * fixed-base tables and batched ECDSA verification on libtomcrypt's math
+ */
+
+#ifndef SPOR_ECC_H
+#define SPOR_ECC_H
+
+#include <tomcrypt.h>
+
+/* bits per window of a table */
+#define COMB_WINBITS    4
+#define COMB_DIGITS     ((1<<COMB_WINBITS) - 1)
+
+/*
+ * pt[i*COMB_DIGITS + j-1] is j * 2^(i*COMB_WINBITS) * P, in projective
+ * montgomery coordinates, for every window i of the curve order
+ */
+struct ecc_comb {
+  const ltc_ecc_set_type *dp;
+  unsigned nwin;
+  ecc_point **pt;
+};
+
+struct ecc_comb *ecc_comb_new(
+  const ltc_ecc_set_type *dp,
+  ecc_point *P
+);
+void ecc_comb_free(
+  struct ecc_comb *c
+);
+
+int ecc_verify_batch(
+  ecc_key *key,
+  struct ecc_comb *kc,
+  const unsigned char *hashes,
+  const unsigned hashsz,
+  const unsigned char **sigs,
+  const unsigned *sigszs,
+  const unsigned n,
+  int *stat
+);
+
+#endif
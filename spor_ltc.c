@@ -4,23 +4,36 @@
  */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <tomcrypt.h>
 
 #include "spor.h"
+#include "spor_aesni.h"
+#include "spor_ecc.h"
 #include "spor_ltc.h"
+#include "spor_shani.h"
 #include "util.h"
 
 
-#define DIET(err, msg) fprintf(stderr, "died in %s: %s\n", msg, error_to_string(err)),exit(2)
+/* verifications with one key before it gets a table */
+#define COMB_AFTER      8
+
+#define DIET(err, msg) die("in %s: %s", msg, error_to_string(err))
 
 
 struct s0_profile {
   int prng_ok;
   prng_state prng;
   symmetric_CTR cipher_state;
-  hash_state hash;
+  unsigned char cipher_iv[MAXBLOCKSIZE];  /* counter at stream offset 0 */
+  struct aesni_ctr hw_ctr;
+  int hw_level;           /* best native AES available, see spor_aesni.h */
+  int cipher_hw;          /* current stream runs on hw_ctr */
+  int gcm_hw;             /* AES-GCM on AES-NI and PCLMULQDQ */
+  int sha_ok;             /* SHA extensions available */
+  struct s0_digest hash;  /* the s0_hash_* stream */
   unsigned char prng_idx;
   unsigned char cipher_idx;
   unsigned char hash_idx;
@@ -41,6 +54,15 @@ void s0_setup (void) {
   if ( (err=register_cipher(&CIPHER)) != CRYPT_OK ) DIET(err, "register_cipher");
   if ( (err=register_hash(&HASH)) != CRYPT_OK ) DIET(err, "register_hash");
   zeromem(&prof, sizeof(prof));
+  prof.hw_level = aesni_probe();
+  prof.gcm_hw = aesni_gcm_probe();
+  prof.sha_ok = shani_probe();
+}
+
+void s0_set_hwaccel(const int on) {
+  prof.hw_level = on ? aesni_probe() : AESNI_NONE;
+  prof.gcm_hw = on ? aesni_gcm_probe() : 0;
+  prof.sha_ok = on ? shani_probe() : 0;
 }
 
 void s0_teardown(void) {
@@ -53,12 +75,25 @@ void s0_teardown(void) {
  ** RNG primitives
  **/
 
+/*
+ * the PRNG is shared by every thread (libspor's contexts included),
+ * so it is only touched under prng_lock.  nothing dies holding it.
+ */
+
+static pthread_mutex_t prng_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define PRNG_LOCK()   pthread_mutex_lock(&prng_lock)
+#define PRNG_UNLOCK() pthread_mutex_unlock(&prng_lock)
+
 void s0_prng_init(void) {
   unsigned char entropy[MIN_ENTROPY];
-  int random_fd, len, err;
+  int random_fd, len, err = CRYPT_OK, ok;
   struct ltc_prng_descriptor *prngp = &prng_descriptor[prof.prng_idx];
 
-  if ( prof.prng_ok ) return;
+  PRNG_LOCK();
+  ok = prof.prng_ok;
+  PRNG_UNLOCK();
+  if ( ok ) return;
 
   /* get some entropy from the OS */
   if ( (random_fd=open(ENTROPY_SOURCE, O_RDONLY)) < 0 ) DIES("opening " ENTROPY_SOURCE);
@@ -66,28 +101,36 @@ void s0_prng_init(void) {
   if ( len < sizeof(entropy) ) DIES("insufficient entropy");
   close(random_fd);
 
-  /* prepare the prng */
-  if ( (err=prngp->start(&prof.prng)) != CRYPT_OK )  DIET(err,"prng.start");
-  if ( (err=prngp->add_entropy(entropy, sizeof(entropy), &prof.prng)) ) DIET(err,"prng.add_entropy");
-  if ( (err=prngp->ready(&prof.prng)) ) DIET(err,"prng.ready");
-
-  prof.prng_ok = 1;
+  /* prepare the prng, unless another thread just has */
+  PRNG_LOCK();
+  if ( ! prof.prng_ok ) {
+    if ( (err=prngp->start(&prof.prng)) == CRYPT_OK &&
+         (err=prngp->add_entropy(entropy, sizeof(entropy), &prof.prng)) == CRYPT_OK &&
+         (err=prngp->ready(&prof.prng)) == CRYPT_OK ) prof.prng_ok = 1;
+  }
+  PRNG_UNLOCK();
   /* cleanup*/
   zeromem(entropy, sizeof(entropy));
+  if ( err != CRYPT_OK ) DIET(err, "prng start");
 }
 
 void s0_prng_getbytes (unsigned char *buf, const int buflen) {
-  int err;
-
-  if ( !prof.prng_ok ) s0_prng_init();
+  int len;
   struct ltc_prng_descriptor *prngp = &prng_descriptor[prof.prng_idx];
-  if ( (err=prngp->read(buf, buflen, &prof.prng)) != buflen ) DIET(err,"prng.read");
+
+  s0_prng_init();
+  PRNG_LOCK();
+  len = prngp->read(buf, buflen, &prof.prng);
+  PRNG_UNLOCK();
+  if ( len != buflen ) DIE("prng.read");
 }
 
 void s0_prng_done(void) {
   struct ltc_prng_descriptor *prngp = &prng_descriptor[prof.prng_idx];
+  PRNG_LOCK();
   if ( prof.prng_ok )  prngp->done(&prof.prng);
   prof.prng_ok = 0;
+  PRNG_UNLOCK();
 }
 
 
@@ -97,48 +140,236 @@ void s0_prng_done(void) {
 void s0_cipher_init(const unsigned char *key, const unsigned char *iv,
                     const int sz) {
   int err;
+  /* native AES when the CPU has it, libtomcrypt otherwise */
+  prof.cipher_hw = aesni_ctr_init(&prof.hw_ctr, prof.hw_level, key, sz, iv);
+  if ( prof.cipher_hw ) {
+    memcpy(prof.cipher_iv, iv, 16);
+    return;
+  }
   if ( (err=ctr_start(prof.cipher_idx, iv, key, sz, 0,
        CTR_COUNTER_LITTLE_ENDIAN,
        &prof.cipher_state)) != CRYPT_OK ) DIET(err,"ctr_start");
+  memcpy(prof.cipher_iv, iv, prof.cipher_state.blocklen);
+}
+
+static void ltc_ctr_at(symmetric_CTR *ctr, const unsigned char *iv, unsigned char *buf,
+                       const unsigned long sz, const unsigned long long offset) {
+  int err, i, bl = ctr->blocklen;
+  unsigned char ctrblk[MAXBLOCKSIZE], skip[MAXBLOCKSIZE] = { 0 };
+  unsigned long long blk = offset / bl;
+  unsigned carry = 0;
+
+  /* counter = iv + block index, little endian over the whole block */
+  for ( i=0; i<bl; i++ ) {
+    carry += iv[i] + (blk & 0xff);
+    ctrblk[i] = carry & 0xff;
+    carry >>= 8;
+    blk >>= 8;
+  }
+  if ( (err=ctr_setiv(ctrblk, bl, ctr)) != CRYPT_OK ) DIET(err, "ctr_setiv");
+  if ( offset % bl ) {
+    if ( (err=ctr_encrypt(skip, skip, offset % bl, ctr)) != CRYPT_OK ) DIET(err, "ctr skip");
+  }
+  if ( (err=ctr_encrypt(buf, buf, sz, ctr)) != CRYPT_OK ) DIET(err, "encrypt");
+  zeromem(skip, sizeof(skip));
+}
+
+void s0_cipher_crypt_at(unsigned char *buf, const unsigned long sz,
+                        const unsigned long long offset) {
+  /* en/decrypt buf as if it sat at offset in the stream started by
+   * s0_cipher_init.  works on a private copy of the CTR state, so
+   * several threads may call this at once.
+   */
+  symmetric_CTR ctr;
+  struct aesni_ctr hw;
+
+  if ( prof.cipher_hw ) {
+    memcpy(&hw, &prof.hw_ctr, sizeof(hw));
+    aesni_ctr_seek(&hw, prof.cipher_iv, offset);
+    aesni_ctr_crypt(&hw, buf, sz);
+    zeromem(&hw, sizeof(hw));
+    return;
+  }
+
+  memcpy(&ctr, &prof.cipher_state, sizeof(ctr));
+  ltc_ctr_at(&ctr, prof.cipher_iv, buf, sz, offset);
+  zeromem(&ctr, sizeof(ctr));
+}
+
+void s0_ctr_crypt(const unsigned char *key, const unsigned char *iv, unsigned char *buf,
+                  const unsigned long sz, const unsigned long long offset) {
+  /* s0_cipher_init and s0_cipher_crypt_at in one, on no shared state */
+  int err;
+  symmetric_CTR ctr;
+  struct aesni_ctr hw;
+
+  if ( aesni_ctr_init(&hw, prof.hw_level, key, KEYSZ_SYM, iv) ) {
+    aesni_ctr_seek(&hw, iv, offset);
+    aesni_ctr_crypt(&hw, buf, sz);
+    zeromem(&hw, sizeof(hw));
+    return;
+  }
+  if ( (err=ctr_start(prof.cipher_idx, iv, key, KEYSZ_SYM, 0,
+       CTR_COUNTER_LITTLE_ENDIAN, &ctr)) != CRYPT_OK ) DIET(err,"ctr_start");
+  ltc_ctr_at(&ctr, iv, buf, sz, offset);
+  ctr_done(&ctr);
+  zeromem(&ctr, sizeof(ctr));
 }
 
 void s0_cipher_encrypt(unsigned char *buf, const unsigned sz) {
   int err;
+  if ( prof.cipher_hw ) {
+    aesni_ctr_crypt(&prof.hw_ctr, buf, sz);
+    return;
+  }
   if ( (err=ctr_encrypt(buf, buf, sz, &prof.cipher_state)) != CRYPT_OK) DIET(err,"encrypt");
 }
 
 void s0_cipher_decrypt(unsigned char *buf, const unsigned sz) {
   int err;
+  if ( prof.cipher_hw ) {
+    aesni_ctr_crypt(&prof.hw_ctr, buf, sz);
+    return;
+  }
   if ( (err=ctr_decrypt(buf, buf, sz, &prof.cipher_state)) != CRYPT_OK ) DIET(err,"decrypt");
 }
 
 void s0_cipher_done() {
   int err;
+  if ( prof.cipher_hw ) {
+    zeromem(&prof.hw_ctr, sizeof(prof.hw_ctr));
+    prof.cipher_hw = 0;
+    return;
+  }
   if ( (err=ctr_done(&prof.cipher_state)) != CRYPT_OK ) DIET(err, "ctr_done");
 }
 
 
+/**
+ ** Authenticated encryption primitives
+ ** AES-GCM, 96 bit nonce, no associated data.  stateless, so
+ ** segments may be sealed and opened from several threads at once.
+ **/
+
+static void ltc_gcm(const unsigned char *key, const unsigned keysz,
+                    const unsigned char *nonce, unsigned char *buf,
+                    const unsigned long sz, unsigned char *tag,
+                    const int direction) {
+  int err;
+  unsigned long taglen = AEAD_TAGSZ;
+  gcm_state *gcm;
+
+  if ( ! (gcm=malloc(sizeof(*gcm))) ) DIE("allocating gcm state");
+  if ( (err=gcm_init(gcm, prof.cipher_idx, key, keysz)) != CRYPT_OK ) DIET(err, "gcm_init");
+  if ( (err=gcm_add_iv(gcm, nonce, AEAD_NONCESZ)) != CRYPT_OK ) DIET(err, "gcm_add_iv");
+  if ( (err=gcm_add_aad(gcm, NULL, 0)) != CRYPT_OK ) DIET(err, "gcm_add_aad");
+  if ( (err=gcm_process(gcm, buf, sz, buf, direction)) != CRYPT_OK ) DIET(err, "gcm_process");
+  if ( (err=gcm_done(gcm, tag, &taglen)) != CRYPT_OK ) DIET(err, "gcm_done");
+  zeromem(gcm, sizeof(*gcm));
+  free(gcm);
+}
+
+void s0_aead_seal(const unsigned char *key, const unsigned keysz,
+                  const unsigned char *nonce, unsigned char *buf,
+                  const unsigned long sz, unsigned char *tag) {
+  if ( prof.gcm_hw && aesni_gcm(key, keysz, nonce, buf, sz, tag, 0) ) return;
+  ltc_gcm(key, keysz, nonce, buf, sz, tag, GCM_ENCRYPT);
+}
+
+int s0_aead_open(const unsigned char *key, const unsigned keysz,
+                 const unsigned char *nonce, unsigned char *buf,
+                 const unsigned long sz, const unsigned char *tag) {
+  /* returns nonzero if the tag matched; buf is garbage otherwise */
+  unsigned char calc[AEAD_TAGSZ], diff = 0;
+  int i;
+
+  if ( ! (prof.gcm_hw && aesni_gcm(key, keysz, nonce, buf, sz, calc, 1)) )
+    ltc_gcm(key, keysz, nonce, buf, sz, calc, GCM_DECRYPT);
+
+  for ( i=0; i<AEAD_TAGSZ; i++ ) diff |= calc[i] ^ tag[i];
+  return diff == 0;
+}
+
+void s0_subkey(const unsigned char *key, const unsigned char *salt, unsigned char *subkey) {
+  /* a key of its own for each stream sharing a derived key: H(key || salt) */
+  unsigned long sz = KEYSZ_SYM;
+  int err;
+  if ( (err=hash_memory_multi(prof.hash_idx, subkey, &sz, key, (unsigned long)KEYSZ_SYM,
+         salt, (unsigned long)SALTSZ, NULL)) != CRYPT_OK )
+    DIET(err, "hash_memory_multi");
+}
+
+
 /**
  ** Hashing primitives
  **/
 
-void s0_hash_init(void) {
+static void digest_init(struct s0_digest *d) {
   int err;
   struct ltc_hash_descriptor hash = hash_descriptor[prof.hash_idx];
-  if ( (err=hash.init(&prof.hash)) != CRYPT_OK ) DIET(err, "hash init");
+  /* native SHA-256 when the CPU has it, libtomcrypt otherwise */
+  d->hw = prof.sha_ok && ! strcmp(hash.name, "sha256");
+  if ( d->hw ) {
+    shani_init(&d->sha);
+    return;
+  }
+  if ( (err=hash.init(&d->ltc)) != CRYPT_OK ) DIET(err, "hash init");
 }
 
-void s0_hash_update(const unsigned char *buf, const unsigned sz) {
+static void digest_update(struct s0_digest *d, const unsigned char *buf, const unsigned long sz) {
   int err;
   struct ltc_hash_descriptor hash = hash_descriptor[prof.hash_idx];
-  if ( (err=hash.process(&prof.hash, buf, sz)) != CRYPT_OK ) DIET(err, "hash process");  
+  if ( d->hw ) {
+    shani_update(&d->sha, buf, sz);
+    return;
+  }
+  if ( (err=hash.process(&d->ltc, buf, sz)) != CRYPT_OK ) DIET(err, "hash process");  
 }
 
-void s0_hash_done(unsigned char *buf, const unsigned sz) {
+static void digest_done(struct s0_digest *d, unsigned char *buf, const unsigned sz) {
   int err;
   struct ltc_hash_descriptor *hash = &hash_descriptor[prof.hash_idx];
   if ( sz < hash->hashsize )  DIE("Buffer overflow");
-  if ( (err=hash->done(&prof.hash, buf)) != CRYPT_OK ) DIET(err, "hash done");
+  if ( d->hw ) {
+    shani_done(&d->sha, buf);
+    return;
+  }
+  if ( (err=hash->done(&d->ltc, buf)) != CRYPT_OK ) DIET(err, "hash done");
+}
+
+void s0_hash_init(void) {
+  digest_init(&prof.hash);
+}
+
+void s0_hash_update(const unsigned char *buf, const unsigned sz) {
+  digest_update(&prof.hash, buf, sz);
+}
+
+void s0_hash_done(unsigned char *buf, const unsigned sz) {
+  digest_done(&prof.hash, buf, sz);
+}
+
+/*
+ * more hashes at once, for a stream that is hashed in several ways
+ * or while it is signed
+ */
+
+struct s0_digest *s0_digest_new(void) {
+  struct s0_digest *d;
+  if ( ! (d=malloc(sizeof(*d))) ) DIE("allocating hash");
+  digest_init(d);
+  return d;
+}
+
+void s0_digest_update(struct s0_digest *d, const unsigned char *buf, const unsigned long sz) {
+  digest_update(d, buf, sz);
+}
+
+void s0_digest_done(struct s0_digest *d, unsigned char *buf, const unsigned sz) {
+  /* and frees d */
+  digest_done(d, buf, sz);
+  zeromem(d, sizeof(*d));
+  free(d);
 }
 
 unsigned s0_hash_size(void) {
@@ -146,27 +377,218 @@ unsigned s0_hash_size(void) {
 }
 
 
+/**
+ ** Curve25519 primitives
+ ** a key is an Ed25519 pair for signing and an X25519 pair for
+ ** wrapping message keys.  exported, the public form is the two public
+ ** halves; the private form puts the two secrets in front.
+ **/
+
+#ifdef LTC_CURVE25519
+
+static void c25519_part(unsigned char *out, const int which, const int wrap,
+                        const curve25519_key *k) {
+  unsigned long len = KEYSZ_25519;
+  int err;
+  err = wrap ? x25519_export(out, &len, which, k) : ed25519_export(out, &len, which, k);
+  if ( err != CRYPT_OK ) DIET(err, "curve25519 export");
+}
+
+static void c25519_keygen(struct asymkey *akeyp) {
+  int err;
+  PRNG_LOCK();
+  if ( (err=ed25519_make_key(&prof.prng, prof.prng_idx, &akeyp->ed)) == CRYPT_OK )
+    err = x25519_make_key(&prof.prng, prof.prng_idx, &akeyp->x);
+  PRNG_UNLOCK();
+  if ( err != CRYPT_OK ) DIET(err, "curve25519 make_key");
+}
+
+static void c25519_import(const unsigned char *buf, const unsigned len,
+                          struct asymkey *akeyp) {
+  unsigned char pub[2*KEYSZ_25519];
+  int err, which;
+
+  if ( len == 4*KEYSZ_25519 ) {
+    which = PK_PRIVATE;
+  } else if ( len == 2*KEYSZ_25519 ) {
+    which = PK_PUBLIC;
+  } else {
+    DIE("bad curve25519 key size");
+  }
+  if ( (err=ed25519_import_raw(buf, KEYSZ_25519, which, &akeyp->ed)) != CRYPT_OK ||
+       (err=x25519_import_raw(buf+KEYSZ_25519, KEYSZ_25519, which, &akeyp->x)) != CRYPT_OK )
+    DIET(err, "curve25519 import (bad passphrase?)");
+  if ( which == PK_PUBLIC ) return;
+
+  /* the public halves follow, to catch a wrong passphrase */
+  c25519_part(pub, PK_PUBLIC, 0, &akeyp->ed);
+  c25519_part(pub+KEYSZ_25519, PK_PUBLIC, 1, &akeyp->x);
+  if ( memcmp(pub, buf+2*KEYSZ_25519, sizeof(pub)) ) DIE("curve25519 import (bad passphrase?)");
+}
+
+static void c25519_export(unsigned char *buf, unsigned long *szp,
+                          const unsigned export_private, struct asymkey *akeyp) {
+  unsigned n = 0;
+  if ( *szp < 4*KEYSZ_25519 ) DIE("buffer overflow");
+  if ( export_private ) {
+    c25519_part(buf + KEYSZ_25519*n++, PK_PRIVATE, 0, &akeyp->ed);
+    c25519_part(buf + KEYSZ_25519*n++, PK_PRIVATE, 1, &akeyp->x);
+  }
+  c25519_part(buf + KEYSZ_25519*n++, PK_PUBLIC, 0, &akeyp->ed);
+  c25519_part(buf + KEYSZ_25519*n++, PK_PUBLIC, 1, &akeyp->x);
+  *szp = KEYSZ_25519*n;
+}
+
+static void c25519_kek(unsigned char *kek, unsigned long *keksz, const unsigned char *shared,
+                       const unsigned char *ephpub, const unsigned char *pub) {
+  /* the wrapping key binds both public keys to the shared secret */
+  const unsigned long sz = KEYSZ_25519;
+  int err;
+  if ( (err=hash_memory_multi(prof.hash_idx, kek, keksz, shared, sz,
+         ephpub, sz, pub, sz, NULL)) != CRYPT_OK )
+    DIET(err, "hash_memory_multi");
+}
+
+static void c25519_shared(const curve25519_key *priv, const curve25519_key *pub,
+                          unsigned char *shared) {
+  unsigned long len = KEYSZ_25519;
+  unsigned char any = 0;
+  int err, i;
+  if ( (err=x25519_shared_secret(priv, pub, shared, &len)) != CRYPT_OK )
+    DIET(err, "x25519_shared_secret");
+  for ( i=0; i<KEYSZ_25519; i++ ) any |= shared[i];
+  if ( ! any ) DIE("x25519: low order public key");
+}
+
+static void c25519_wrap(struct asymkey *akeyp, const unsigned char *skey, const unsigned ssz,
+                        unsigned char *cryptbuf, unsigned long *cryptszp) {
+  /* ephemeral X25519 public key, then skey under the wrapping key */
+  curve25519_key eph;
+  unsigned char shared[KEYSZ_25519], pub[KEYSZ_25519], kek[MAXBLOCKSIZE];
+  unsigned long keksz = sizeof(kek);
+  unsigned i;
+  int err;
+
+  if ( ssz > s0_hash_size() || *cryptszp < KEYSZ_25519 + ssz ) DIE("buffer overflow");
+  PRNG_LOCK();
+  err = x25519_make_key(&prof.prng, prof.prng_idx, &eph);
+  PRNG_UNLOCK();
+  if ( err != CRYPT_OK ) DIET(err, "x25519_make_key");
+  c25519_part(cryptbuf, PK_PUBLIC, 1, &eph);
+  c25519_part(pub, PK_PUBLIC, 1, &akeyp->x);
+  c25519_shared(&eph, &akeyp->x, shared);
+  c25519_kek(kek, &keksz, shared, cryptbuf, pub);
+  for ( i=0; i<ssz; i++ ) cryptbuf[KEYSZ_25519+i] = skey[i] ^ kek[i];
+  *cryptszp = KEYSZ_25519 + ssz;
+
+  zeromem(&eph, sizeof(eph));
+  zeromem(shared, sizeof(shared));
+  zeromem(kek, sizeof(kek));
+}
+
+static void c25519_unwrap(struct asymkey *akeyp, unsigned char *skey, const unsigned long ssz,
+                          const unsigned char *cryptbuf, const unsigned long cryptsz) {
+  curve25519_key eph;
+  unsigned char shared[KEYSZ_25519], pub[KEYSZ_25519], kek[MAXBLOCKSIZE];
+  unsigned long keksz = sizeof(kek);
+  unsigned i;
+  int err;
+
+  if ( cryptsz != KEYSZ_25519 + ssz || ssz > s0_hash_size() ) DIE("bad wrapped key size");
+  if ( (err=x25519_import_raw(cryptbuf, KEYSZ_25519, PK_PUBLIC, &eph)) != CRYPT_OK )
+    DIET(err, "x25519_import_raw");
+  c25519_part(pub, PK_PUBLIC, 1, &akeyp->x);
+  c25519_shared(&akeyp->x, &eph, shared);
+  c25519_kek(kek, &keksz, shared, cryptbuf, pub);
+  for ( i=0; i<ssz; i++ ) skey[i] = cryptbuf[KEYSZ_25519+i] ^ kek[i];
+
+  zeromem(shared, sizeof(shared));
+  zeromem(kek, sizeof(kek));
+}
+
+#else
+
+#define NO25519() DIE("built without Curve25519 (needs libtomcrypt with LTC_CURVE25519)")
+#define c25519_keygen(a) NO25519()
+#define c25519_import(b, l, a) NO25519()
+#define c25519_export(b, s, p, a) NO25519()
+#define c25519_wrap(a, k, n, b, s) NO25519()
+#define c25519_unwrap(a, k, n, b, s) NO25519()
+
+#endif
+
+
 /**
  ** PK primitives
+ ** dispatched on the key type; P-521 is libtomcrypt's ecc
  **/
 
 void s0_asym_setup(struct asymkey *akeyp) {
   akeyp->ready = 0;
+  akeyp->type = ASYM_P521;
+  akeyp->comb = NULL;
+  akeyp->verified = 0;
+}
+
+static void s0_asym_forget(struct asymkey *akeyp, const unsigned type) {
+  /* drop the old key, and with it its table, before a new one */
+  if ( akeyp->ready && akeyp->type == ASYM_P521 ) ecc_free(&akeyp->key);
+  akeyp->ready = 0;
+  ecc_comb_free(akeyp->comb);
+  akeyp->comb = NULL;
+  akeyp->verified = 0;
+  akeyp->type = type;
+#ifdef LTC_CURVE25519
+  zeromem(&akeyp->ed, sizeof(akeyp->ed));
+  zeromem(&akeyp->x, sizeof(akeyp->x));
+#endif
 }
 
-void s0_asym_keygen(struct asymkey *akeyp) {
+struct asymkey *s0_asym_new(void) {
+  /* for callers that can't see inside struct asymkey */
+  struct asymkey *akeyp;
+  if ( ! (akeyp=malloc(sizeof(*akeyp))) ) DIE("allocating key");
+  s0_asym_setup(akeyp);
+  return akeyp;
+}
+
+void s0_asym_free(struct asymkey *akeyp) {
+  if ( ! akeyp ) return;
+  s0_asym_forget(akeyp, ASYM_P521);
+  zeromem(akeyp, sizeof(*akeyp));
+  free(akeyp);
+}
+
+unsigned s0_asym_type(struct asymkey *akeyp) {
+  return akeyp->type;
+}
+
+void s0_asym_keygen(struct asymkey *akeyp, const unsigned type) {
   int err;
   s0_prng_init();
-  if ( (err=ecc_make_key(&prof.prng, prof.prng_idx, KEYSZ_PK, &akeyp->key))
-        != CRYPT_OK) DIET(err,"ecc_make_key");
+  s0_asym_forget(akeyp, type);
+  if ( type == ASYM_25519 ) {
+    c25519_keygen(akeyp);
+  } else {
+    PRNG_LOCK();
+    err = ecc_make_key(&prof.prng, prof.prng_idx, KEYSZ_PK, &akeyp->key);
+    PRNG_UNLOCK();
+    if ( err != CRYPT_OK ) DIET(err,"ecc_make_key");
+  }
   akeyp->ready = 1;
 }
 
 void s0_asym_import (const unsigned const char *buf, unsigned len,
-                     struct asymkey *akeyp) {
+                     const unsigned type, struct asymkey *akeyp) {
   int err;
-  if ( (err=ecc_import(buf, len, &akeyp->key)) != CRYPT_OK)
+  s0_asym_forget(akeyp, type);
+  if ( type == ASYM_25519 ) {
+    c25519_import(buf, len, akeyp);
+  } else if ( type != ASYM_P521 ) {
+    DIED("unknown key type", type);
+  } else if ( (err=ecc_import(buf, len, &akeyp->key)) != CRYPT_OK) {
     DIET(err, "ecc_import (bad passphrase?)");
+  }
   akeyp->ready = 1;
 }
 
@@ -174,6 +596,10 @@ void s0_asym_export (unsigned char *buf, long unsigned *szp,
                      const unsigned export_private, struct asymkey *akeyp) {
   int err, type;
   if ( ! akeyp->ready ) DIE("no key loaded");
+  if ( akeyp->type == ASYM_25519 ) {
+    c25519_export(buf, szp, export_private, akeyp);
+    return;
+  }
   type = (export_private) ? PK_PRIVATE : PK_PUBLIC;
   if ( (err=ecc_export(buf, szp, type, &akeyp->key)) != CRYPT_OK) {
     DIET(err,"ecc_export(private)");
@@ -185,24 +611,62 @@ void s0_asym_sign(struct asymkey *akeyp, const unsigned char *hash, const int ha
                   unsigned char *sig, long unsigned *sigszp) {
   int err;
   if ( ! akeyp->ready ) DIE("no key loaded");
+#ifdef LTC_CURVE25519
+  if ( akeyp->type == ASYM_25519 ) {
+    if ( (err=ed25519_sign(hash, hashsz, sig, sigszp, &akeyp->ed)) != CRYPT_OK )
+      DIET(err, "ed25519_sign");
+    return;
+  }
+#endif
   s0_prng_init();
-  if ( (err=ecc_sign_hash(
-         hash, hashsz, sig, sigszp,
-         &prof.prng, prof.prng_idx, &akeyp->key)
-       ) != CRYPT_OK ) DIET(err, "ecc_sign_hash");
+  PRNG_LOCK();
+  err = ecc_sign_hash(hash, hashsz, sig, sigszp, &prof.prng, prof.prng_idx, &akeyp->key);
+  PRNG_UNLOCK();
+  if ( err != CRYPT_OK ) DIET(err, "ecc_sign_hash");
 }
 
 int s0_asym_verify(struct asymkey *akeyp, const unsigned char *hash, const int hashsz,
                    const unsigned char *sig, const const unsigned sigsz) {
-  int err;
   int stat;
-  if ( ! akeyp->ready ) DIE("no key loaded");
-  if ( (err=ecc_verify_hash(sig, sigsz, hash, hashsz,
-         &stat, &akeyp->key)
-       ) != CRYPT_OK ) DIET(err, "ecc_verify_hash");
+  s0_asym_verify_batch(akeyp, hash, hashsz, &sig, &sigsz, 1, &stat);
   return stat;
 }
 
+void s0_asym_verify_batch(struct asymkey *akeyp, const unsigned char *hashes, const int hashsz,
+                          const unsigned char **sigs, const unsigned *sigszs,
+                          const unsigned n, int *stat) {
+  /* a key seen often enough gets a table; one-off checks
+   * are cheaper without */
+  int err;
+  unsigned i;
+  if ( ! akeyp->ready ) DIE("no key loaded");
+
+#ifdef LTC_CURVE25519
+  if ( akeyp->type == ASYM_25519 ) {
+    for ( i=0; i<n; i++ ) {
+      if ( ed25519_verify(hashes + i*hashsz, hashsz, sigs[i], sigszs[i],
+             &stat[i], &akeyp->ed) != CRYPT_OK ) stat[i] = 0;
+    }
+    return;
+  }
+#endif
+
+  if ( ! akeyp->comb && akeyp->verified + n >= COMB_AFTER )
+    akeyp->comb = ecc_comb_new(akeyp->key.dp, &akeyp->key.pubkey);
+  akeyp->verified += n;
+
+  if ( akeyp->comb ) {
+    if ( (err=ecc_verify_batch(&akeyp->key, akeyp->comb, hashes, hashsz,
+           sigs, sigszs, n, stat)) != CRYPT_OK ) DIET(err, "ecc_verify_batch");
+    return;
+  }
+  for ( i=0; i<n; i++ ) {
+    if ( (err=ecc_verify_hash(sigs[i], sigszs[i], hashes + i*hashsz, hashsz,
+           &stat[i], &akeyp->key)
+         ) != CRYPT_OK ) stat[i] = 0;
+  }
+}
+
 void s0_asym_encrypt_key(struct asymkey *akeyp,
                          const unsigned char *skey, const unsigned ssz,
                          unsigned char *cryptbuf, unsigned long *cryptszp) {
@@ -210,8 +674,15 @@ void s0_asym_encrypt_key(struct asymkey *akeyp,
   if ( ! akeyp->ready ) DIE("no key loaded");
   s0_prng_init();
   assert (ssz >0);
-  if ( (err=ecc_encrypt_key(skey, ssz, cryptbuf, cryptszp,
-        &prof.prng, prof.prng_idx, prof.hash_idx, &akeyp->key)) != CRYPT_OK ) DIET(err, "ecc_encrypt_key");
+  if ( akeyp->type == ASYM_25519 ) {
+    c25519_wrap(akeyp, skey, ssz, cryptbuf, cryptszp);
+    return;
+  }
+  PRNG_LOCK();
+  err = ecc_encrypt_key(skey, ssz, cryptbuf, cryptszp,
+                        &prof.prng, prof.prng_idx, prof.hash_idx, &akeyp->key);
+  PRNG_UNLOCK();
+  if ( err != CRYPT_OK ) DIET(err, "ecc_encrypt_key");
 }
 
 void s0_asym_decrypt_key(struct asymkey *akeyp,
@@ -219,6 +690,10 @@ void s0_asym_decrypt_key(struct asymkey *akeyp,
                          const unsigned char *cryptbuf, const unsigned long cryptsz) {
   int err;
   if ( ! akeyp->ready ) DIE("no key loaded");
+  if ( akeyp->type == ASYM_25519 ) {
+    c25519_unwrap(akeyp, skey, ssz, cryptbuf, cryptsz);
+    return;
+  }
   if ( (err=ecc_decrypt_key(cryptbuf, cryptsz, skey, &ssz, &akeyp->key)) != CRYPT_OK ) {
     DIET(err, "ecc_decrypt_key");
   }
@@ -8,9 +8,26 @@
 
 #include <tomcrypt.h>
 
+#include "spor_shani.h"
+
+struct ecc_comb;
+
 struct asymkey {
     unsigned char ready;
+    unsigned char type;         /* ASYM_* */
     ecc_key key;
+#ifdef LTC_CURVE25519
+    curve25519_key ed, x;       /* signing, key wrapping */
+#endif
+    struct ecc_comb *comb;      /* verification table, once it pays */
+    unsigned verified;          /* signatures checked with this key */
+};
+
+/* one running hash, for streams hashed alongside another */
+struct s0_digest {
+    int hw;                     /* runs on sha */
+    struct shani_state sha;
+    hash_state ltc;
 };
 
 
@@ -0,0 +1,147 @@
+/*
+ * spor_shani.c
+ * native SHA-256 using the x86 SHA extensions
+ *
+ * sha256rnds2 does two rounds per instruction and sha256msg1/2
+ * compute the message schedule, so a 64 byte block costs about the
+ * same as a handful of portable rounds.
+ */
+
+#include <string.h>
+
+#include "spor_shani.h"
+
+static const unsigned int sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+static const unsigned int K[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+int shani_probe(void) {
+  unsigned a, b, c, d;
+  if ( ! __get_cpuid(1, &a, &b, &c, &d) ) return 0;
+  if ( ! (c & bit_SSE4_1) || ! (c & bit_SSSE3) ) return 0;
+  if ( ! __get_cpuid_count(7, 0, &a, &b, &c, &d) ) return 0;
+  return (b & bit_SHA) != 0;
+}
+
+SHANI_TARGET
+static void compress(unsigned int h[8], const unsigned char *data, unsigned long blocks) {
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, tmp, msg, w[4];
+  int g;
+
+  /* the round instructions want the state as ABEF/CDGH */
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+  while ( blocks-- ) {
+    abef = state0;
+    cdgh = state1;
+
+    for ( g=0; g<16; g++ ) {
+      /* w[g%4] holds schedule words 4g..4g+3 */
+      if ( g < 4 ) {
+        w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+16*g)), bswap);
+      } else {
+        tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[g&3], w[(g+1)&3]),
+                            _mm_alignr_epi8(w[(g+3)&3], w[(g+2)&3], 4));
+        w[g&3] = _mm_sha256msg2_epu32(tmp, w[(g+3)&3]);
+      }
+      msg = _mm_add_epi32(w[g&3], _mm_load_si128((const __m128i *)&K[4*g]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += 64;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+  _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+  _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#else  /* no x86: callers check shani_probe() first */
+
+int shani_probe(void) {
+  return 0;
+}
+
+static void compress(unsigned int h[8], const unsigned char *data, unsigned long blocks) {
+}
+
+#endif
+
+
+/**
+ ** Streaming interface
+ **/
+
+void shani_init(struct shani_state *s) {
+  memcpy(s->h, sha256_iv, sizeof(s->h));
+  s->buflen = 0;
+  s->len = 0;
+}
+
+void shani_update(struct shani_state *s, const unsigned char *buf, unsigned long len) {
+  unsigned long n;
+  s->len += len;
+  if ( s->buflen ) {
+    n = 64 - s->buflen;
+    if ( n > len ) n = len;
+    memcpy(s->buf + s->buflen, buf, n);
+    s->buflen += n;
+    buf += n;
+    len -= n;
+    if ( s->buflen < 64 ) return;
+    compress(s->h, s->buf, 1);
+    s->buflen = 0;
+  }
+  if ( len >= 64 ) {
+    compress(s->h, buf, len / 64);
+    buf += len & ~63UL;
+    len &= 63;
+  }
+  memcpy(s->buf, buf, len);
+  s->buflen = len;
+}
+
+void shani_done(struct shani_state *s, unsigned char *out) {
+  unsigned long long bits = s->len * 8;
+  int i;
+
+  s->buf[s->buflen++] = 0x80;
+  if ( s->buflen > 56 ) {
+    memset(s->buf + s->buflen, 0, 64 - s->buflen);
+    compress(s->h, s->buf, 1);
+    s->buflen = 0;
+  }
+  memset(s->buf + s->buflen, 0, 56 - s->buflen);
+  for ( i=0; i<8; i++ ) s->buf[63-i] = bits >> (8*i);
+  compress(s->h, s->buf, 1);
+
+  for ( i=0; i<32; i++ ) out[i] = s->h[i/4] >> (24 - 8*(i%4));
+  memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,31 @@
+/*
+ * spor_shani.h
+ * native SHA-256 using the x86 SHA extensions
+ */
+
+#ifndef SPOR_SHANI_H
+#define SPOR_SHANI_H
+
+struct shani_state {
+  unsigned int h[8];
+  unsigned char buf[64];
+  unsigned buflen;
+  unsigned long long len;      /* total bytes hashed */
+};
+
+int shani_probe(void);
+
+void shani_init(
+  struct shani_state *s
+);
+void shani_update(
+  struct shani_state *s,
+  const unsigned char *buf,
+  unsigned long len
+);
+void shani_done(
+  struct shani_state *s,
+  unsigned char *out
+);
+
+#endif
@@ -7,21 +7,45 @@ msg() {
 }
 
 testok() {
-  msg spor $*
-  if ! eval ../spor $* ; then
+  msg $2 spor $1
+  if ! eval $2 ../spor $1 ; then
     echo "test failed"
     return 1;
   fi
 }
 
 testno() {
-  msg ! spor $*
-  if eval ../spor $* ; then
+  msg ! $2 spor $1
+  if eval $2 ../spor $1 ; then
     msg "test succeeded; should have failed"
     return 1;
   fi
 }
 
+libok() {
+  msg $2 spor-libtest $1
+  if ! eval $2 ../spor-libtest $1 ; then
+    echo "test failed"
+    return 1;
+  fi
+}
+
+libno() {
+  msg ! $2 spor-libtest $1
+  if eval $2 ../spor-libtest $1 2>/dev/null ; then
+    msg "test succeeded; should have failed"
+    return 1;
+  fi
+}
+
+check() {
+  msg $1
+  if ! eval $1 ; then
+    echo "test failed"
+    return 1;
+  fi
+}
+
 same() {
   msg diff -q $1 $2
   if ! diff -q $1 $2 >/dev/null; then
@@ -38,6 +62,13 @@ notsame() {
   fi
 }
 
+flip() {
+  # change the byte at offset $2 of file $1
+  b=$(dd if=$1 bs=1 skip=$2 count=1 2>/dev/null)
+  if [ "$b" = X ]; then b=Y; else b=X; fi
+  printf $b | dd of=$1 bs=1 seek=$2 conv=notrunc 2>/dev/null
+}
+
 d=./testfiles
 
 rm -r $d || true
@@ -76,6 +107,33 @@ testok "'bm' < pub2key"
 testok "'3p vm' <privkey 3<pwfile"
 testno "'3p vm' <privkey 3<pwfile2"
 
+msg
+msg "-- Curve25519 keys --"
+# only with a libtomcrypt that has them (newer than 1.18); later
+# sections using these keys are skipped too
+c25519=
+if ../spor '[25519]k' >/dev/null 2>&1; then c25519=1; fi
+if [ "$c25519" ]; then
+  testok "'[25519]k bx p 3vx' <pwfile >pubkey.c 3>privkey.c"
+  testok "'3p vm' <privkey.c 3<pwfile"
+  testno "'3p vm' <privkey.c 3<pwfile2"
+  testok "'3p 4vm 5g' 3<pwfile 4<privkey.c <msg 5>msg.sig.c"
+  testok "'4bm 5f' 4<pubkey.c <msg 5<msg.sig.c"
+  testno "'4bm 5f' 4<pubkey.c <msg2 5<msg.sig.c"
+  testno "'4bm 5f' 4<pubkey <msg 5<msg.sig.c"
+  testok "'3bm E' 3<pubkey.c <msg >msg.s0"
+  testok "'3p 4vm D' 3<pwfile 4<privkey.c <msg.s0 >msgout"
+  same msg msgout
+  testno "'3p 4vm D' 3<pwfile 4<privkey <msg.s0 >msgout"
+  testok "'3bm r 4bm r a E' 3<pubkey.c 4<pubkey <msg >msg.s0"
+  testok "'3p 4vm D' 3<pwfile 4<privkey.c <msg.s0 >msgout"
+  same msg msgout
+  testok "'3p 4vm D' 3<pwfile 4<privkey <msg.s0 >msgout"
+  same msg msgout
+else
+  msg "skipped: built without Curve25519"
+fi
+
 msg
 msg "-- key management --"
 testok "'3p vm 4p 5vx' <privkey 3<pwfile 4<pwfile2 5>privkey.pw2"
@@ -120,6 +178,350 @@ testno "'3p 4vm D' 3<pwfile 4<pubkey <msg.s0 >msgout"
 testok "'3p 4vm D' 3<pwfile2 4<priv2key <msg.s0 >msgout"
 notsame msg msgout
 
+msg
+msg "-- parallel streams --"
+head -c 300000 /dev/urandom > big
+testok "'3p e' 3<pwfile <big >big.s0" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096"
+testok "'3p d' 3<pwfile <big.s0 >bigout"
+same big bigout
+testok "'3bm E' 3<pubkey <big >big.s0"
+testok "'3p 4vm D' 3<pwfile 4<privkey <big.s0 >bigout" "SPOR_THREADS=3 SPOR_CHUNKSZ=8192"
+same big bigout
+
+msg
+msg "-- multiple recipients --"
+testok "'k bx p 3vx' <pwfile >pub3key 3>priv3key"
+testok "'3bm r 4bm r a E' 3<pubkey 4<pub2key <big >big.s0"
+testok "'3p 4vm D' 3<pwfile 4<privkey <big.s0 >bigout"
+same big bigout
+testok "'3p 4vm [1000,5000]D' 3<pwfile2 4<priv2key <big.s0 >bigout"
+tail -c +1001 big | head -c 5000 > bigrange
+same bigrange bigout
+testno "'3p 4vm D' 3<pwfile 4<priv3key <big.s0 >bigout"
+testok "'l' <big.s0 >recipients"
+(tail -c +5 pubkey | sha256sum | cut -c1-16; tail -c +5 pub2key | sha256sum | cut -c1-16) >recipients.ok
+same recipients recipients.ok
+
+msg
+msg "-- single-pass sign+encrypt --"
+testok "'3p 4vm 5s 6p a e' 3<pwfile 4<privkey 6<pwfile <big >big.s0 5>big.sig" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096"
+testok "'4bm 5f' 4<pubkey <big 5<big.sig"
+testno "'3p 4vm s 6p e' 3<pwfile 4<privkey 6<pwfile <big >bigout"
+testno "'3p 4vm 1s 6p e' 3<pwfile 4<privkey 6<pwfile <big >bigout"
+testok "'3bm 5t 6p d' 3<pubkey 5<big.sig 6<pwfile <big.s0 >bigout" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096"
+same big bigout
+testno "'3bm 5t 6p d' 3<pub2key 5<big.sig 6<pwfile <big.s0 >bigout"
+testno "'3bm 5t 6p [10]d' 3<pubkey 5<big.sig 6<pwfile <big.s0 >bigout"
+testok "'3bm r 4p 5vm 6s E' 3<pub2key 4<pwfile 5<privkey <big >big.s0 6>big.sig" SPOR_IOURING=1
+testok "'3bm 4t 5p 6vm D' 3<pubkey 4<big.sig 5<pwfile2 6<priv2key <big.s0 >bigout" SPOR_IOURING=1
+same big bigout
+testno "'3bm 4t 5p 6vm D' 3<pubkey 4<msg.sig 5<pwfile2 6<priv2key <big.s0 >bigout"
+testok "'3p 4vm 5s 6p 7vm 8p e' 3<pwfile 4<privkey 6<pwfile2 7<priv2key 8<pwfile2 <big >big.s0 5>big.sig"
+testok "'4bm 5f' 4<pubkey <big 5<big.sig"
+testno "'4bm 5f' 4<pub2key <big 5<big.sig"
+
+msg
+msg "-- digests alongside streams --"
+sha256sum <big >big.sum
+testok "'3p 4h 5H a e' 3<pwfile <big >big.s0 4>plain.sum 5>cipher.sum" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096 SPOR_IOURING=1"
+same big.sum plain.sum
+sha256sum <big.s0 >big.s0.sum
+same big.s0.sum cipher.sum
+testok "'3p 4h 5H d' 3<pwfile <big.s0 >bigout 4>plain.sum 5>cipher.sum" SPOR_IOURING=0
+same big.sum plain.sum
+same big.s0.sum cipher.sum
+testok "'3bm 4H 5h E' 3<pubkey >big.s0 4>cipher.sum 5>plain.sum" "cat big |"
+same big.sum plain.sum
+sha256sum <big.s0 >big.s0.sum
+same big.s0.sum cipher.sum
+testok "'3bm 4t 5p 6vm 7h D' 3<pubkey 4<big.sig 5<pwfile 6<privkey <big.s0 >bigout 7>plain.sum"
+same big.sum plain.sum
+testno "'3p 4vm 5h [10]D' 3<pwfile 4<privkey <big.s0 >bigout 5>plain.sum"
+testno "'3p h e' 3<pwfile <big >bigout"
+testno "'3p 1H e' 3<pwfile <big >bigout"
+testok "'3p 4h 4H e' 3<pwfile <big >big.s0 4>sums"
+check '[ $(wc -l <sums) = 2 ]'
+
+msg
+msg "-- io_uring/blocking I/O --"
+testok "'3p a e' 3<pwfile <big >big.s0" "SPOR_IOURING=1 SPOR_CHUNKSZ=4096"
+testok "'3p d' 3<pwfile <big.s0 >bigout" SPOR_IOURING=0
+same big bigout
+testok "'3p e' 3<pwfile <big >big.s0" SPOR_IOURING=0
+cat big.s0 | testok "'3p d' 3<pwfile >bigout" SPOR_IOURING=1
+same big bigout
+
+msg
+msg "-- native/portable AES and SHA --"
+testok "'3p e' 3<pwfile <big >big.s0" SPOR_HWACCEL=1
+testok "'3p d' 3<pwfile <big.s0 >bigout" SPOR_HWACCEL=0
+same big bigout
+testok "'3p 4vm 5g' 3<pwfile 4<privkey <big 5>big.sig" SPOR_HWACCEL=1
+testok "'4bm 5f' 4<pubkey <big 5<big.sig" SPOR_HWACCEL=0
+
+msg
+msg "-- authenticated segments --"
+testok "'3p a e' 3<pwfile <big >big.s0" SPOR_THREADS=4
+testok "'3p d' 3<pwfile <big.s0 >bigout"
+same big bigout
+testok "'3p a e' 3<pwfile <msg >msg.s0"
+testok "'3p d' 3<pwfile <msg.s0 >msgout" SPOR_HWACCEL=0
+same msg msgout
+testok "'3bm a E' 3<pubkey </dev/null >empty.s0"
+testok "'3p 4vm D' 3<pwfile 4<privkey <empty.s0 >emptyout"
+same /dev/null emptyout
+testno "'3p d' 3<pwfile2 <big.s0 >bigout"
+head -c 200000 big.s0 > big.trunc
+testno "'3p d' 3<pwfile <big.trunc >bigout"
+cp big.s0 big.bad
+flip big.bad 150000
+testno "'3p d' 3<pwfile <big.bad >bigout" SPOR_THREADS=4
+
+msg
+msg "-- range decryption --"
+tail -c +100001 big | head -c 5000 > bigrange
+testok "'3p e' 3<pwfile <big >big.s0"
+testok "'3p [100000,5000]d' 3<pwfile <big.s0 >bigout"
+same bigrange bigout
+testok "'3p [100000,5000]d' 3<pwfile >bigout" "cat big.s0 |"
+same bigrange bigout
+testno "'3p [400000,10]d' 3<pwfile <big.s0 >bigout"
+testno "'3p [5,9]e' 3<pwfile <big >bigout"
+testok "'3p a e' 3<pwfile <big >big.s0"
+testok "'3p [100000,5000]d' 3<pwfile <big.s0 >bigout"
+same bigrange bigout
+testno "'3p [400000,10]d' 3<pwfile <big.s0 >bigout"
+tail -c +299991 big > bigrange
+testok "'3bm a E' 3<pubkey <big >big.s0"
+testok "'3p 4vm [299990]D' 3<pwfile 4<privkey <big.s0 >bigout"
+same bigrange bigout
+
+msg
+msg "-- compressed streams --"
+seq 1 100000 > text
+testok "'3p z e' 3<pwfile <text >text.s0" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096"
+check '[ $(wc -c <text.s0) -lt $(wc -c <text) ]'
+testok "'3p d' 3<pwfile <text.s0 >textout" SPOR_IOURING=0
+same text textout
+sha256sum <text >text.sum
+testok "'3bm a z E' 3<pubkey <text >text.s0" SPOR_IOURING=1
+testok "'3p 4vm 5h D' 3<pwfile 4<privkey <text.s0 >textout 5>plain.sum" "SPOR_THREADS=3 SPOR_CHUNKSZ=8192"
+same text textout
+same text.sum plain.sum
+testok "'3p a z e' 3<pwfile >big.s0" "cat big |"
+testok "'3p d' 3<pwfile >bigout" "cat big.s0 |"
+same big bigout
+testok "'3p z e' 3<pwfile </dev/null >empty.s0"
+testok "'3p d' 3<pwfile <empty.s0 >emptyout"
+same /dev/null emptyout
+testok "'3p a z e' 3<pwfile <text >text.s0"
+testno "'3p [10,10]d' 3<pwfile <text.s0 >textout"
+cp text.s0 text.bad
+flip text.bad 1000
+testno "'3p d' 3<pwfile <text.bad >textout"
+
+msg
+msg "-- KDF parameters --"
+testok "'[200,16]c' >kdfparams"
+testok "'3p e' 3<pwfile <msg >msg.s0" "SPOR_KDF=\$(cat kdfparams)"
+testok "'3p d' 3<pwfile <msg.s0 >msgout"
+same msg msgout
+testok "'3p vm 4p 5vx' <privkey 3<pwfile 4<pwfile 5>privkey.kdf" SPOR_KDF=argon2i,t=2,m=1024,p=2
+testok "'3p vm' <privkey.kdf 3<pwfile"
+# a larger derivation after a smaller one in the same process
+testok "'3p vm 4p 5vx' <privkey.kdf 3<pwfile 4<pwfile 5>privkey.big"
+testok "'3p vm' <privkey.big 3<pwfile"
+testno "'k'" SPOR_KDF=argon2x,t=1,m=1024,p=1
+# streams from before the 'P' header use the default parameters
+testok "'3p e' 3<pwfile <msg >msg.s0"
+(head -c 4 msg.s0; tail -c +20 msg.s0) >msg.old.s0
+testok "'3p d' 3<pwfile <msg.old.s0 >msgout"
+same msg msgout
+# a 'P' header asking for years of work is refused, not obeyed
+cp msg.s0 msg.big.s0
+printf '\377\377\377\377' | dd of=msg.big.s0 bs=1 seek=7 conv=notrunc 2>/dev/null
+testno "'3p d' 3<pwfile <msg.big.s0 >msgout"
+testno "'k'" SPOR_KDF=argon2id,t=1,m=8388608,p=1
+
+msg
+msg "-- key agent --"
+rm -f agent.sock
+../spor-agent agent.sock 3 <privkey 3<pwfile &
+agentpid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -S agent.sock ] && break; sleep 1; done
+testok "'u 3g' <big 3>big.sig" SPOR_AGENT=agent.sock
+testok "'4bm 5f' 4<pubkey <big 5<big.sig"
+testok "'u 3bx' 3>pubtest" SPOR_AGENT=agent.sock
+same pubkey pubtest
+testok "'3bm a E' 3<pubkey <big >big.s0"
+testok "'u D' <big.s0 >bigout" SPOR_AGENT=agent.sock
+same big bigout
+testno "'u 3g' <big 3>big.sig" SPOR_AGENT=nosuch.sock
+kill $agentpid
+wait $agentpid
+
+msg
+msg "-- batch --"
+printf 'e msg msg.b.s0\n# comment\n\ne big big.b.s0\nE big big.b.E\ng big big.b.sig\n' > manifest
+testok "'3p 4vm 5p M' 3<pwfile 4<privkey 5<pwfile <manifest >status" SPOR_JOBS=2
+printf 'd msg.b.s0 msg.b\nd big.b.s0 big.b\nf big big.b.sig\n' > manifest
+testok "'3p 4bm M' 3<pwfile 4<pubkey <manifest >status" SPOR_JOBS=2
+same msg msg.b
+same big big.b
+testok "'3p 4vm D' 3<pwfile 4<privkey <big.b.E >bigout"
+same big bigout
+testok "'3p d' 3<pwfile <big.b.s0 >bigout"
+same big bigout
+printf 'e msg msg.b.s0\ne msg msg.b2.s0\n' > manifest
+testok "'3p a M' 3<pwfile <manifest >status"
+# the 'U' salts, just after the 'P' header: every file has its own key
+head -c 37 msg.b.s0 | tail -c 18 | od -An -tx1 > salt1
+head -c 37 msg.b2.s0 | tail -c 18 | od -An -tx1 > salt2
+check "grep -q '^ 55 10' salt1"
+notsame salt1 salt2
+testok "'3p d' 3<pwfile <msg.b2.s0 >msgout"
+same msg msgout
+printf 'e msg msg.b.s0\nd nosuch nosuch.out\ne big big.b.s0\n' > manifest
+testno "'3p M' 3<pwfile <manifest >status"
+check 'grep -q "^2 failed" status'
+
+msg
+msg "-- batch verification --"
+for i in 1 2 3 4 5 6 7 8; do echo "msg msg.sig"; echo "msg2 msg2.sig"; done > siglist
+testok "'3bm F' 3<pubkey <siglist >status"
+testno "'3bm F' 3<pub2key <siglist >status"
+mkdir -p adir
+printf 'msg msg.sig\nmsg msg2.sig\nnosuch msg.sig\nadir msg.sig\nmsg adir\n' >> siglist
+testno "'3bm F' 3<pubkey <siglist >status"
+check '[ $(grep -c " failed " status) = 4 ]'
+
+msg
+msg "-- appending --"
+head -c 100001 big > part1
+tail -c +100002 big > part2
+testok "'3p e' 3<pwfile <part1 >app.s0"
+testok "'3p 4o n' 3<pwfile 4<>app.s0 <part2" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096"
+testok "'3p d' 3<pwfile <app.s0 >bigout"
+same big bigout
+testno "'3p 4o n' 3<pwfile 4>>app.s0 <part2"
+testok "'3bm E' 3<pubkey <part1 >app.s0"
+testok "'3p 4vm 5o N' 3<pwfile 4<privkey 5<>app.s0 <part2" SPOR_IOURING=1
+testok "'3p 4vm D' 3<pwfile 4<privkey <app.s0 >bigout"
+same big bigout
+testok "'3p a e' 3<pwfile <part1 >app.s0"
+testno "'3p 4o n' 3<pwfile 4<>app.s0 <part2"
+testok "'3p z e' 3<pwfile <part1 >app.s0"
+testno "'3p 4o n' 3<pwfile 4<>app.s0 <part2"
+
+msg
+msg "-- tree signatures --"
+testok "'3p 4vm [4096]T 5g' 3<pwfile 4<privkey <big 5>big.tsig" "SPOR_THREADS=4"
+testok "'4bm 5f' 4<pubkey <big 5<big.tsig" SPOR_IOURING=1
+testok "'4bm 5f' 4<pubkey 5<big.tsig" "cat big |"
+testno "'4bm 5f' 4<pubkey <msg 5<big.tsig"
+testok "'3p e' 3<pwfile <big >big.s0"
+testno "'4bm 5t 6p d' 4<pubkey 5<big.tsig 6<pwfile <big.s0 >bigout"
+if [ "$c25519" ]; then
+  testok "'3p 4vm T 5g' 3<pwfile 4<privkey.c </dev/null 5>empty.tsig"
+  testok "'4bm 5f' 4<pubkey.c </dev/null 5<empty.tsig"
+fi
+testok "'[8192,5000]3q' <big 3<big.tsig >piece.sig"
+tail -c +8193 big | head -c 8192 > piece
+testok "'4bm 5f' 4<pubkey <piece 5<piece.sig"
+head -c 4096 piece | testno "'4bm 5f' 4<pubkey 5<piece.sig"
+testno "'4bm 5f' 4<pubkey <big 5<piece.sig"
+testno "'[100]3q' <big 3<big.tsig >piece.sig"
+testno "'[0]3q' <msg 3<msg.sig >piece.sig"
+printf 'big big.tsig\nbig msg.sig\nmsg msg.sig\n' > siglist
+testno "'3bm F' 3<pubkey <siglist >status"
+check '[ $(grep -c " failed " status) = 1 ]'
+
+msg
+msg "-- keyrings --"
+id1=$(tail -c +5 pubkey | sha256sum | cut -c1-16)
+id2=$(tail -c +5 pub2key | sha256sum | cut -c1-16)
+printf 'pubkey\n# comment\npub2key\n\n' > keylist
+if [ "$c25519" ]; then echo pubkey.c >> keylist; fi
+echo pubkey >> keylist
+testok "'Y' <keylist >ring"
+testno "'Y' >ring.bad" "echo nosuch |"
+testok "'3y [0x$id1]K 4f' 3<ring <msg 4<msg.sig"
+testno "'3y [0x$id2]K 4f' 3<ring <msg 4<msg.sig"
+testok "'3y [0x$id2]K 4f' 3<ring <msg 4<msg.sig2"
+testno "'3y [0x0123456789abcdef]K' 3<ring"
+testno "'3y' 3<msg"
+# a ring whose only entry holds another key than its id names
+echo pubkey > keylist
+testok "'Y' <keylist >ring1"
+head -c $(( $(wc -c <ring1) - $(wc -c <pub2key) + 4 )) ring1 > ring.bad
+tail -c +5 pub2key >> ring.bad
+testno "'3y [0x$id1]K 4f' 3<ring.bad <msg 4<msg.sig"
+testok "'3y [0x$id1]K r [0x$id2]K r a E' 3<ring <msg >msg.s0"
+testok "'3p 4vm D' 3<pwfile2 4<priv2key <msg.s0 >msgout"
+same msg msgout
+printf "msg msg.sig $id1\nmsg msg.sig2 $id2\nmsg2 msg2.sig $id1\nmsg msg.sig\n" > siglist
+testok "'3y 4bm F' 3<ring 4<pubkey <siglist >status"
+printf "msg msg.sig2 $id1\nmsg msg.sig 0123456789abcdef\n" >> siglist
+testno "'3y 4bm F' 3<ring 4<pubkey <siglist >status"
+check '[ $(grep -c " failed " status) = 2 ]'
+
+msg
+msg "-- random bytes --"
+testok "'[1000001]R' >rand" "SPOR_THREADS=4 SPOR_CHUNKSZ=4096"
+check '[ $(wc -c <rand) = 1000001 ]'
+testok "'[1000001]R' >rand2" SPOR_IOURING=1
+notsame rand rand2
+testok "'[0]R' >rand"
+same /dev/null rand
+testno "'R' >rand"
+
+msg
+msg "-- library --"
+libok "pwfile e <big >big.l"
+testok "'3p d' 3<pwfile <big.l >bigout"
+same big bigout
+libok "pwfile e <msg >msg.l"
+libok "pwfile d <msg.l >msgout"
+same msg msgout
+# one context's messages share a salt, but not a key
+head -c 37 big.l | tail -c 18 | od -An -tx1 > salt1
+head -c 37 msg.l | tail -c 18 | od -An -tx1 > salt2
+check "grep -q '^ 55 10' salt1"
+notsame salt1 salt2
+libok "pwfile d <msg.b2.s0 >msgout"
+same msg msgout
+testok "'3p a z e' 3<pwfile <big >big.s0"
+libok "pwfile d <big.s0 >bigout"
+same big bigout
+testok "'3p e' 3<pwfile <msg >msg.s0"
+libok "pwfile d <msg.s0 >msgout"
+same msg msgout
+libno "pwfile2 d <big.l >bigout"
+libno "pwfile d <msg >msgout"
+if [ "$c25519" ]; then
+  libok "pwfile g privkey.c <msg >msg.sig.l"
+  testok "'4bm 5f' 4<pubkey.c <msg 5<msg.sig.l"
+  libno "pwfile v pubkey.c <msg msg.sig"
+fi
+libok "pwfile g privkey <msg >msg.sig.l"
+testok "'4bm 5f' 4<pubkey <msg 5<msg.sig.l"
+libok "pwfile v pubkey <msg msg.sig"
+libno "pwfile v pubkey <msg2 msg.sig"
+libno "pwfile2 g privkey <msg >msg.sig.l"
+libok "pwfile t 8 privkey <big" SPOR_KDF=argon2id,t=1,m=1024,p=1
+libok "pwfile t 2 privkey <msg"
+
+msg
+msg "-- metrics --"
+testok "'3p a e' 3<pwfile <big >big.s0 9>metrics" "SPOR_METRICS=9 SPOR_PROGRESS=0.000001 SPOR_CHUNKSZ=4096"
+check "grep -q '\"cmd\":\"e\",\"done\":true' metrics"
+check "grep -q '\"progress\":\"e\"' metrics"
+testno "'3p d' 3<pwfile2 <big.s0 >bigout 9>metrics" SPOR_METRICS=9
+check "grep -q '\"cmd\":\"d\",\"done\":false' metrics"
+printf 'd big.s0 big.b\nd big.s0 big.b2\n' > manifest
+testok "'3p M' 3<pwfile <manifest >status 9>metrics" "SPOR_METRICS=9 SPOR_JOBS=2"
+check '[ $(wc -l <metrics) = 1 ]'
+
 # done!
 msg
 msg "-- tests complete --"
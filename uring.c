@@ -0,0 +1,150 @@
+/*
+ * spor/uring.c
+ * minimal io_uring submission/completion rings, no liburing
+ *
+ * one ring per thread, never shared, so the only ordering needed is
+ * against the kernel: acquire on the indices it writes, release on
+ * the ones we write.  anything short of a working ring with
+ * IORING_OP_READ/WRITE (5.6+) makes uring_open fail and callers fall
+ * back to blocking read()/write().
+ */
+
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "uring.h"
+#include "util.h"
+
+static int enabled = 1;
+
+void uring_set_enabled(const int on) {
+  enabled = on;
+}
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n) {
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_open(struct uring *u, unsigned entries) {
+  /* returns 0 if io_uring is disabled or unusable */
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+  if ( ! enabled ) return 0;
+
+  memset(&p, 0, sizeof(p));
+  if ( (u->fd=sys_setup(entries, &p)) < 0 ) return 0;
+  if ( ! (p.features & IORING_FEAT_RW_CUR_POS) ) {
+    uring_close(u);
+    return 0;
+  }
+  u->entries = p.sq_entries;
+
+  u->sq_ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sq_ring = mmap(NULL, u->sq_ringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = mmap(NULL, u->cq_ringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    u->fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if ( u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED ) {
+    uring_close(u);
+    return 0;
+  }
+
+  sq = u->sq_ring;
+  cq = u->cq_ring;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+void uring_close(struct uring *u) {
+  if ( u->sqes && u->sqes != MAP_FAILED )
+    munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+  if ( u->cq_ring && u->cq_ring != MAP_FAILED ) munmap(u->cq_ring, u->cq_ringsz);
+  if ( u->sq_ring && u->sq_ring != MAP_FAILED ) munmap(u->sq_ring, u->sq_ringsz);
+  if ( u->fd >= 0 ) close(u->fd);
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+}
+
+void uring_register(struct uring *u, const struct iovec *iov, unsigned n) {
+  /* pinning may exceed RLIMIT_MEMLOCK; unregistered buffers still work */
+  u->fixed = sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+void uring_prep(struct uring *u, const int write, const int fd,
+                unsigned char *buf, const unsigned len,
+                const unsigned long long off, const unsigned bufidx,
+                const unsigned long long data) {
+  /* the caller keeps no more than entries in flight */
+  unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  if ( u->fixed ) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = bufidx;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = data;
+
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->queued++;
+}
+
+void uring_submit(struct uring *u, const unsigned wait) {
+  /* submit what is queued and wait for at least wait completions */
+  int n;
+  while ( u->queued || wait ) {
+    n = sys_enter(u->fd, u->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    metrics_uring();
+    if ( n < 0 ) {
+      if ( errno == EINTR ) continue;
+      DIES("submitting I/O");
+    }
+    u->queued -= n;
+    break;
+  }
+}
+
+int uring_reap(struct uring *u, unsigned long long *data, int *res) {
+  /* take one completion, if there is one */
+  unsigned head = *u->cq_head;
+  struct io_uring_cqe *cqe;
+
+  if ( head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) ) return 0;
+  cqe = &u->cqes[head & *u->cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
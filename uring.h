@@ -0,0 +1,46 @@
+/*
+ * spor/uring.h
+ * minimal io_uring submission/completion rings, no liburing
+ */
+#ifndef SPOR_URING_H
+#define SPOR_URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* largest single read or write; bigger transfers are split */
+#define URING_IOSZ   (1<<18)
+
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ringsz, cq_ringsz;
+  unsigned queued;              /* prepared, not yet submitted */
+  int fixed;                    /* buffers are registered */
+};
+
+void uring_set_enabled(const int on);
+
+int uring_open(struct uring *u, unsigned entries);
+void uring_close(struct uring *u);
+void uring_register(struct uring *u, const struct iovec *iov, unsigned n);
+
+void uring_prep(
+  struct uring *u,
+  const int write,
+  const int fd,
+  unsigned char *buf,
+  const unsigned len,
+  const unsigned long long off,
+  const unsigned bufidx,
+  const unsigned long long data
+);
+void uring_submit(struct uring *u, const unsigned wait);
+int uring_reap(struct uring *u, unsigned long long *data, int *res);
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,6 +15,26 @@
 
 #include "util.h"
 
+__thread struct die_trap *die_trap;
+
+void die(const char *fmt, ...) {
+  struct die_trap *t = die_trap;
+  va_list ap;
+
+  va_start(ap, fmt);
+  if ( t ) {
+    vsnprintf(t->msg, sizeof(t->msg), fmt, ap);
+    va_end(ap);
+    die_trap = NULL;
+    longjmp(t->env, 1);
+  }
+  fprintf(stderr, "died ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(2);
+}
+
 int readpass(char *prompt, unsigned char *buf, unsigned sz) {
   int fd, len;
   struct termios term, term_old;
@@ -5,18 +5,33 @@
 #define SPOR_UTIL_H
 
 #include <errno.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define FOO(msg) fprintf(stderr, "%s\n", msg);
 
-#define DIE(msg) fprintf(stderr, "died %s\n", msg),exit(2)
-#define DIEC(msg, a) fprintf(stderr, "died %s: %c\n", msg, a),exit(2);
-#define DIEC2(msg, a,b) fprintf(stderr, "died %s: %c,%c\n", msg, a, b),exit(2);
-#define DIED(msg, a) fprintf(stderr, "died %s: %d\n", msg, a),exit(2);
-#define DIES(msg) fprintf(stderr, "died %s: %s\n", msg, strerror(errno)),exit(2)
-#define DIES2(msg,a) fprintf(stderr, "died %s %s: %s\n", msg, a, strerror(errno)), exit(2)
+#define DIE(msg) die("%s", msg)
+#define DIEC(msg, a) die("%s: %c", msg, a);
+#define DIEC2(msg, a,b) die("%s: %c,%c", msg, a, b);
+#define DIED(msg, a) die("%s: %d", msg, a);
+#define DIES(msg) die("%s: %s", msg, strerror(errno))
+#define DIES2(msg,a) die("%s %s: %s", msg, a, strerror(errno))
+
+/*
+ * dying prints the message and exits, unless the thread has set a
+ * trap (libspor does, around each call): then the message goes in
+ * the trap and control returns to its setjmp
+ */
+struct die_trap {
+  jmp_buf env;
+  char msg[256];
+};
+
+extern __thread struct die_trap *die_trap;
+
+void die(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
 
 
 int readpass(char *prompt, unsigned char *buf, unsigned sz);